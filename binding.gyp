@@ -1,4 +1,9 @@
 {
+  'variables': {
+    # Build the native soak/benchmark executables under test/native:
+    #   node-gyp rebuild -- -Dbuild_native_tests=1
+    'build_native_tests%': 0,
+  },
   'target_defaults': {
 
     'conditions': [
@@ -15,8 +20,20 @@
       'target_name': 'usb_driver',
       'sources': [
         'src/usb_common.cc',
+        'src/usb_driver.cc',
+        'src/usb_registry.cc',
+        'src/journal.cc',
+        'src/event_queue.cc',
+        'src/poll_scheduler.cc',
+        'src/shared_table.cc',
+        'src/timeline.cc',
+        'src/volume_stats.cc',
+        'src/device_id.cc',
         'src/bindings.cc',
-        'src/utils/logger.cc'
+        'src/utils/logger.cc',
+        'src/utils/strings.cc',
+        'src/utils/tracer.cc',
+        'src/utils/work_pool.cc'
       ],
       'conditions': [
         ['OS=="mac"', {
@@ -36,6 +53,22 @@
             ],
           },
         }],
+        ['OS=="linux"', {
+          'sources': [
+            'src/linux/usb_driver.cc',
+            'src/linux/fd_cache.cc',
+            'src/linux/sysfs.cc',
+            'src/linux/uring.cc',
+            'src/linux/watcher.cc'
+          ],
+          'cflags!': [ '-fno-exceptions' ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'link_settings': {
+            'libraries': [
+              '-lrt'    # shm_open() on glibc before 2.34
+            ]
+          }
+        }],
         ['OS=="win"', {
           'sources': [
             'src/win/usb_driver.cc',
@@ -48,5 +81,127 @@
         }]
       ],
     }
-  ]
+  ],
+  'conditions': [
+    ['build_native_tests==1', {
+      'targets': [
+        {
+          'target_name': 'registry_soak',
+          'type': 'executable',
+          'sources': [
+            'src/usb_common.cc',
+            'src/usb_registry.cc',
+            'src/journal.cc',
+            'src/utils/strings.cc',
+            'test/native/registry_soak.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+          },
+        },
+        {
+          'target_name': 'format_bench',
+          'type': 'executable',
+          'sources': [
+            'src/usb_common.cc',
+            'src/usb_registry.cc',
+            'src/journal.cc',
+            'src/utils/logger.cc',
+            'src/utils/strings.cc',
+            'test/native/format_bench.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+          },
+        },
+        {
+          'target_name': 'device_id_fuzz',
+          'type': 'executable',
+          'sources': [
+            'src/device_id.cc',
+            'test/native/device_id_fuzz.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+          },
+        },
+        {
+          'target_name': 'device_id_bench',
+          'type': 'executable',
+          'sources': [
+            'src/device_id.cc',
+            'test/native/device_id_bench.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+          },
+        },
+      ],
+    }],
+    ['build_native_tests==1 and OS=="linux"', {
+      'targets': [
+        {
+          'target_name': 'sysfs_bench',
+          'type': 'executable',
+          'sources': [
+            'src/usb_common.cc',
+            'src/usb_registry.cc',
+            'src/journal.cc',
+            'src/linux/fd_cache.cc',
+            'src/linux/sysfs.cc',
+            'src/linux/uring.cc',
+            'src/utils/logger.cc',
+            'src/utils/strings.cc',
+            'src/utils/tracer.cc',
+            'test/native/sysfs_bench.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+        },
+        {
+          'target_name': 'hotplug_bench',
+          'type': 'executable',
+          'sources': [
+            'src/usb_common.cc',
+            'src/usb_driver.cc',
+            'src/usb_registry.cc',
+            'src/journal.cc',
+            'src/poll_scheduler.cc',
+            'src/shared_table.cc',
+            'src/timeline.cc',
+            'src/linux/watcher.cc',
+            'src/utils/logger.cc',
+            'src/utils/strings.cc',
+            'src/utils/tracer.cc',
+            'test/native/hotplug_bench.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'link_settings': {
+            'libraries': [ '-lrt', '-luv' ]
+          },
+        },
+        {
+          'target_name': 'shared_table_test',
+          'type': 'executable',
+          'sources': [
+            'src/shared_table.cc',
+            'src/usb_common.cc',
+            'src/usb_registry.cc',
+            'src/journal.cc',
+            'src/utils/logger.cc',
+            'src/utils/strings.cc',
+            'src/utils/tracer.cc',
+            'test/native/shared_table_test.cc'
+          ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'link_settings': {
+            'libraries': [ '-lrt' ]
+          },
+        },
+      ],
+    }],
+  ],
 }
@@ -1,20 +1,16 @@
 const usbDriver = require('../src/usb-driver.js');
 
-// Poll time in milliseconds
-const POLL_TIME = 1500;
+// Poll quickly after a change, backing off to every 5 seconds while idle
+const POLL_OPTIONS = { pollIntervalMin: 100, pollIntervalMax: 5000 };
 
-function logDevices() {
-  usbDriver.pollDevices()
-    .then(function(usbDrives) {
-      console.log('Number Polled: ' + usbDrives.length);
-      console.log(usbDrives);
-    })
-    .catch(function(error) {
-      console.error('Failed to poll devices:\n\t' + error);
-    });
-
-  setTimeout(logDevices, POLL_TIME);
+function logDevices(usbDrives) {
+  console.log('Number Polled: ' + usbDrives.length);
+  console.log(usbDrives);
 }
 
 // Run
-logDevices();
+usbDriver.startPolling(POLL_OPTIONS, logDevices);
+
+process.on('SIGINT', function() {
+  usbDriver.stopPolling();
+});
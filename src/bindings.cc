@@ -1,8 +1,20 @@
 #include "usb_driver.h"
+#include "event_queue.h"
+#include "journal.h"
+#include "poll_scheduler.h"
+#include "shared_table.h"
+#include "timeline.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include <v8.h>
 #include <node.h>
+#include <uv.h>
 
 // Throws a JS error and returns from the current function
 #define THROW_AND_RETURN(isolate, msg)                                  \
@@ -18,6 +30,8 @@ namespace USBDriver
   namespace NodeJS
   {
     using v8::FunctionCallbackInfo;
+    using v8::Function;
+    using v8::HandleScope;
     using v8::Isolate;
     using v8::Local;
     using v8::Handle;
@@ -32,7 +46,8 @@ namespace USBDriver
     using v8::Value;
     using v8::Null;
     using v8::Undefined;
-
+    using v8::WeakCallbackInfo;
+    using v8::WeakCallbackType;
 
     static Local<Object> USBDrive_to_Object(Isolate *isolate, USBDriver::USBDevicePtr usbDrive)
     {
@@ -64,11 +79,91 @@ namespace USBDriver
       OBJ_ATTR_STR("serialNumber", usbDrive->serialNumber);
       OBJ_ATTR_STR("manufacturer", usbDrive->vendor);
       OBJ_ATTR_STR("mount", usbDrive->mountPoint);
+      OBJ_ATTR_STR("filesystemUUID", usbDrive->filesystemUUID);
+      OBJ_ATTR_STR("filesystemLabel", usbDrive->filesystemLabel);
+      OBJ_ATTR_NUMBER("busNumber", usbDrive->busNumber);
+      OBJ_ATTR_STR("portPath", usbDrive->portPath);
+      OBJ_ATTR_NUMBER("speed", usbDrive->speed);
+      OBJ_ATTR_NUMBER("totalBytes", usbDrive->totalBytes);
+      OBJ_ATTR_NUMBER("freeBytes", usbDrive->freeBytes);
+      OBJ_ATTR_NUMBER("totalInodes", usbDrive->totalInodes);
+      OBJ_ATTR_NUMBER("freeInodes", usbDrive->freeInodes);
 
 #undef OBJ_ATTR_STR
       return obj;
     }
 
+    typedef struct CachedObject {
+      USBDevicePtr device;         // The record the object was built from.
+      Persistent<Object> object;   // Weak, the entry goes away with the object.
+    } CachedObject;
+
+    typedef struct ObjectCache {
+      std::unordered_map<std::string, CachedObject *> objects;  // By device UID.
+      Persistent<Function> freeze;                              // Object.freeze
+    } ObjectCache;
+
+    // Device objects handed out to each isolate
+    static std::unordered_map<Isolate *, ObjectCache> gObjectCaches;
+
+    static void OnObjectCollected(const WeakCallbackInfo<CachedObject> &data)
+    {
+      CachedObject *cached = data.GetParameter();
+      auto &objects = gObjectCaches[data.GetIsolate()].objects;
+      auto it = objects.find(cached->device->uid);
+
+      if(it != objects.end() && it->second == cached)
+        objects.erase(it);
+
+      cached->object.Reset();
+      delete cached;
+    }
+
+    /**
+     * Get the JS object for a device. A record is replaced whenever its
+     * device changes, so as long as the cached object was built from the
+     * current record the same frozen object is returned, and callers can
+     * compare devices across polls with ===.
+     */
+    static Local<Object> Device_to_Object(Isolate *isolate, const USBDevicePtr &device)
+    {
+      ObjectCache &cache = gObjectCaches[isolate];
+      auto it = cache.objects.find(device->uid);
+
+      if(it != cache.objects.end() && it->second->device == device)
+        return Local<Object>::New(isolate, it->second->object);
+
+      CORE_TRACE_SCOPE("js", "newObject");
+
+      Local<Object> obj = USBDrive_to_Object(isolate, device);
+
+      if(cache.freeze.IsEmpty()) {
+        Local<Object> objectClass = isolate->GetCurrentContext()->Global()
+          ->Get(String::NewFromUtf8(isolate, "Object"))->ToObject();
+
+        cache.freeze.Reset(isolate, Local<Function>::Cast(objectClass->Get(String::NewFromUtf8(isolate, "freeze"))));
+      }
+
+      Local<Value> argv[] = { obj };
+      Local<Function>::New(isolate, cache.freeze)->Call(Null(isolate), 1, argv);
+
+      CachedObject *cached = new CachedObject;
+      cached->device = device;
+      cached->object.Reset(isolate, obj);
+      cached->object.SetWeak(cached, OnObjectCollected, WeakCallbackType::kParameter);
+
+      // The device changed, the old object stays valid for whoever holds it
+      if(it != cache.objects.end()) {
+        it->second->object.Reset();
+        delete it->second;
+        it->second = cached;
+      } else {
+        cache.objects[device->uid] = cached;
+      }
+
+      return obj;
+    }
+
     void Unmount(const FunctionCallbackInfo<Value> &info)
     {
       auto isolate = info.GetIsolate();
@@ -105,32 +200,474 @@ namespace USBDriver
 
       auto usbDrive = USBDriver::getDevice(*str);
 
-      if(usbDrive == NULL) {
+      if(usbDrive == nullptr) {
+        info.GetReturnValue().SetNull();
+      } else {
+        info.GetReturnValue().Set(Device_to_Object(isolate, usbDrive));
+      }
+    }
+
+    void RefreshDevice(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      auto usbDrive = USBDriver::refreshDevice(*str);
+
+      if(usbDrive == nullptr) {
+        info.GetReturnValue().SetNull();
+      } else {
+        info.GetReturnValue().Set(Device_to_Object(isolate, usbDrive));
+      }
+    }
+
+    static Local<Array> Devices_to_Array(Isolate *isolate, const std::vector<USBDevicePtr> &devices)
+    {
+      CORE_TRACE_SCOPE("js", "toJS");
+
+      Local<Array> array = Array::New(isolate, static_cast<int>(devices.size()));
+
+      for(size_t i = 0; i < devices.size(); ++i) {
+        auto device_obj = Device_to_Object(isolate, devices[i]);
+
+        array->Set((int)i, device_obj);
+      }
+
+      return array;
+    }
+
+    void GetParent(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      auto usbDrive = USBDriver::getParent(*str);
+
+      if(usbDrive == nullptr) {
         info.GetReturnValue().SetNull();
       } else {
-        info.GetReturnValue().Set(USBDrive_to_Object(isolate, usbDrive));
+        info.GetReturnValue().Set(Device_to_Object(isolate, usbDrive));
       }
     }
 
+    void GetDescendants(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      Local<Array> array = Devices_to_Array(isolate, USBDriver::getDescendants(*str));
+
+      if(array.IsEmpty())
+        THROW_AND_RETURN(isolate, "Array creation failed");
+
+      info.GetReturnValue().Set(array);
+    }
+
     void PollDevices(const FunctionCallbackInfo<Value> &info)
     {
+      CORE_TRACE_SCOPE("js", "PollDevices");
+
       auto isolate = info.GetIsolate();
       auto devices = USBDriver::getDevices();
 
-      Handle<Array> array = Array::New(isolate, static_cast<int>(devices.size()));
+      Local<Array> array = Devices_to_Array(isolate, devices);
 
       if(array.IsEmpty())
         THROW_AND_RETURN(isolate, "Array creation failed");
 
-      for(size_t i = 0; i < devices.size(); ++i) {
-        auto device_obj = USBDrive_to_Object(isolate, devices[i]);
+      info.GetReturnValue().Set(array);
+    }
 
-        array->Set((int)i, device_obj);
+    /**
+     * Read the optional property `name` of a query criteria object into
+     * `field`, left alone if undefined. Throws and returns false if it is
+     * of the wrong type.
+     */
+    static bool Criteria_Property(Isolate *isolate, Local<Object> criteria, const char *name, int &field)
+    {
+      Local<Value> val = criteria->Get(String::NewFromUtf8(isolate, name));
+
+      if(val->IsUndefined())
+        return true;
+
+      if(!val->IsNumber()) {
+        std::string msg = std::string("Expected ") + name + " to be of type number";
+
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, msg.c_str())));
+        return false;
       }
 
+      field = static_cast<int>(val->IntegerValue());
+      return true;
+    }
+
+    static bool Criteria_Property(Isolate *isolate, Local<Object> criteria, const char *name, std::string &field)
+    {
+      Local<Value> val = criteria->Get(String::NewFromUtf8(isolate, name));
+
+      if(val->IsUndefined())
+        return true;
+
+      if(!val->IsString()) {
+        std::string msg = std::string("Expected ") + name + " to be of type string";
+
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, msg.c_str())));
+        return false;
+      }
+
+      field = *String::Utf8Value(val->ToString());
+      return true;
+    }
+
+    void FindDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      CORE_TRACE_SCOPE("js", "FindDevices");
+
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsObject())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type object");
+
+      Local<Object> criteria = info[0]->ToObject();
+      DeviceQuery query;
+
+      if(!Criteria_Property(isolate, criteria, "vendorId", query.vendorID) ||
+         !Criteria_Property(isolate, criteria, "productId", query.productID) ||
+         !Criteria_Property(isolate, criteria, "serialNumber", query.serialNumber) ||
+         !Criteria_Property(isolate, criteria, "mount", query.mountPoint))
+        return;
+
+      Local<Array> array = Devices_to_Array(isolate, USBDriver::findDevices(query));
+
+      if(array.IsEmpty())
+        THROW_AND_RETURN(isolate, "Array creation failed");
+
       info.GetReturnValue().Set(array);
     }
 
+    void GetDeviceByMount(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      auto usbDrive = USBDriver::getDeviceByMount(*str);
+
+      if(usbDrive == nullptr) {
+        info.GetReturnValue().SetNull();
+      } else {
+        info.GetReturnValue().Set(Device_to_Object(isolate, usbDrive));
+      }
+    }
+
+    typedef struct EventSubscription {
+      std::shared_ptr<EventQueue> queue;
+      Persistent<Function> notify;   // Called when events were queued.
+    } EventSubscription;
+
+    // State of the native poll scheduler, only touched on the JS thread
+    static uv_async_t *gPollAsync = nullptr;
+    static Persistent<Function> gPollCallback;
+    static unsigned long gDeliveredChanges = 0;
+    static bool gRedeliver = false;   // Call the polling callback even without a new change.
+    static std::unordered_map<int, EventSubscription *> gEventSubscriptions;
+    static int gNextSubscription = 1;
+
+    // Event queues, also fed by the scheduler thread
+    static std::mutex gEventQueuesMutex;
+    static std::unordered_map<int, std::shared_ptr<EventQueue> > gEventQueues;
+
+    /**
+     * Runs on the JS thread after the scheduler saw a change. Several
+     * wakeups may be coalesced into one call, in which case only the
+     * latest device set is delivered.
+     */
+    static void OnDevicesChanged(uv_async_t *)
+    {
+      auto isolate = Isolate::GetCurrent();
+      HandleScope scope(isolate);
+
+      unsigned long changeCount;
+      auto devices = PollScheduler::instance().devices(&changeCount);
+
+      if(gPollAsync == nullptr)
+        return;
+
+      bool changed = changeCount != gDeliveredChanges;
+
+      if(!gPollCallback.IsEmpty() && (changed || gRedeliver)) {
+        Local<Value> argv[] = { Devices_to_Array(isolate, devices) };
+        Local<Function> callback = Local<Function>::New(isolate, gPollCallback);
+
+        node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 1, argv);
+      }
+
+      gRedeliver = false;
+
+      // Callbacks may close subscriptions
+      std::vector<int> readable;
+
+      for(auto &subscription : gEventSubscriptions) {
+        if(subscription.second->queue->size() > 0 || subscription.second->queue->overflowed())
+          readable.push_back(subscription.first);
+      }
+
+      for(int id : readable) {
+        auto subscription = gEventSubscriptions.find(id);
+
+        if(subscription == gEventSubscriptions.end())
+          continue;
+
+        Local<Function> notify = Local<Function>::New(isolate, subscription->second->notify);
+
+        node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), notify, 0, nullptr);
+      }
+
+      for(unsigned long id = gDeliveredChanges + 1; id <= changeCount; ++id)
+        CORE_TRACE_ASYNC_END("scheduler", "deviceChange", id);
+
+      gDeliveredChanges = changeCount;
+    }
+
+    // Run the scheduler while there is a polling callback or an event subscription
+    static void UpdateScheduler()
+    {
+      bool used = !gPollCallback.IsEmpty() || !gEventSubscriptions.empty();
+
+      if(used && gPollAsync == nullptr) {
+        // Closing is asynchronous, so every start gets a fresh handle
+        gPollAsync = new uv_async_t;
+        uv_async_init(uv_default_loop(), gPollAsync, OnDevicesChanged);
+
+        gDeliveredChanges = 0;
+        gRedeliver = false;
+
+        uv_async_t *async = gPollAsync;
+
+        PollScheduler::instance().start([async]() {
+            {
+              // Read under the lock, so queues seeded meanwhile never go back to older devices
+              std::lock_guard<std::mutex> lock(gEventQueuesMutex);
+              auto devices = PollScheduler::instance().devices();
+
+              for(auto &queue : gEventQueues)
+                queue.second->update(devices);
+            }
+
+            uv_async_send(async);
+          });
+      } else if(!used && gPollAsync != nullptr) {
+        // Joins the scheduler thread, so nothing signals the handle afterwards
+        PollScheduler::instance().stop();
+
+        uv_close(reinterpret_cast<uv_handle_t *>(gPollAsync), [](uv_handle_t *handle) {
+            delete reinterpret_cast<uv_async_t *>(handle);
+          });
+
+        gPollAsync = nullptr;
+      }
+    }
+
+    void StartPolling(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsFunction())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type function");
+
+      if(!gPollCallback.IsEmpty())
+        THROW_AND_RETURN(isolate, "Already polling");
+
+      gPollCallback.Reset(isolate, Local<Function>::Cast(info[0]));
+
+      // Already running for event subscriptions, deliver the current devices
+      if(gPollAsync != nullptr) {
+        gRedeliver = true;
+        uv_async_send(gPollAsync);
+      }
+
+      UpdateScheduler();
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void StopPolling(const FunctionCallbackInfo<Value> &info)
+    {
+      gPollCallback.Reset();
+
+      UpdateScheduler();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
+    void OpenEvents(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 3)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsNumber() || info[0]->NumberValue() < 1)
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a positive number");
+
+      if(!info[1]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the second argument to be of type string");
+
+      if(!info[2]->IsFunction())
+        THROW_AND_RETURN(isolate, "Expected the third argument to be of type function");
+
+      String::Utf8Value overflowName(info[1]->ToString());
+      std::string overflowStr(*overflowName);
+      EventQueue::Overflow overflow;
+
+      if(overflowStr == "drop-oldest")
+        overflow = EventQueue::DROP_OLDEST;
+      else if(overflowStr == "coalesce")
+        overflow = EventQueue::COALESCE;
+      else if(overflowStr == "error")
+        overflow = EventQueue::FAIL;
+      else
+        THROW_AND_RETURN(isolate, "Expected overflow to be 'drop-oldest', 'coalesce' or 'error'");
+
+      int id = gNextSubscription++;
+
+      EventSubscription *subscription = new EventSubscription;
+      subscription->queue = std::make_shared<EventQueue>(static_cast<size_t>(info[0]->NumberValue()), overflow);
+      subscription->notify.Reset(isolate, Local<Function>::Cast(info[2]));
+
+      gEventSubscriptions[id] = subscription;
+
+      {
+        std::lock_guard<std::mutex> lock(gEventQueuesMutex);
+
+        // Start with the devices already attached, before the scheduler thread can feed it
+        if(gPollAsync != nullptr)
+          subscription->queue->update(PollScheduler::instance().devices());
+
+        gEventQueues[id] = subscription->queue;
+      }
+
+      if(gPollAsync != nullptr)
+        uv_async_send(gPollAsync);
+
+      UpdateScheduler();
+
+      info.GetReturnValue().Set(Number::New(isolate, id));
+    }
+
+    static const char *EventType_to_String(DeviceEvent::Type type)
+    {
+      switch(type) {
+      case DeviceEvent::ATTACH: return "attach";
+      case DeviceEvent::DETACH: return "detach";
+      case DeviceEvent::CHANGE: return "change";
+      }
+
+      return "unknown";
+    }
+
+    void ReadEvents(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1 || !info[0]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a subscription");
+
+      auto subscription = gEventSubscriptions.find(static_cast<int>(info[0]->NumberValue()));
+
+      if(subscription == gEventSubscriptions.end())
+        THROW_AND_RETURN(isolate, "Unknown subscription");
+
+      EventQueue &queue = *subscription->second->queue;
+      std::vector<DeviceEvent> events;
+
+      queue.drain(events);
+
+      Local<Array> array = Array::New(isolate, static_cast<int>(events.size()));
+
+      for(size_t i = 0; i < events.size(); ++i) {
+        Local<Object> event = Object::New(isolate);
+
+        event->Set(String::NewFromUtf8(isolate, "type"),
+                   String::NewFromUtf8(isolate, EventType_to_String(events[i].type)));
+        event->Set(String::NewFromUtf8(isolate, "device"), Device_to_Object(isolate, events[i].device));
+
+        array->Set((int)i, event);
+      }
+
+      Local<Object> result = Object::New(isolate);
+
+      result->Set(String::NewFromUtf8(isolate, "events"), array);
+      result->Set(String::NewFromUtf8(isolate, "dropped"),
+                  Number::New(isolate, static_cast<double>(queue.dropped())));
+      result->Set(String::NewFromUtf8(isolate, "coalesced"),
+                  Number::New(isolate, static_cast<double>(queue.coalesced())));
+      result->Set(String::NewFromUtf8(isolate, "overflowed"), Boolean::New(isolate, queue.overflowed()));
+
+      info.GetReturnValue().Set(result);
+    }
+
+    void CloseEvents(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1 || !info[0]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a subscription");
+
+      int id = static_cast<int>(info[0]->NumberValue());
+      auto subscription = gEventSubscriptions.find(id);
+
+      if(subscription != gEventSubscriptions.end()) {
+        {
+          std::lock_guard<std::mutex> lock(gEventQueuesMutex);
+
+          gEventQueues.erase(id);
+        }
+
+        subscription->second->notify.Reset();
+        delete subscription->second;
+
+        gEventSubscriptions.erase(subscription);
+
+        UpdateScheduler();
+      }
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
     void SetLogFile(const FunctionCallbackInfo<Value> &info)
     {
       auto isolate = info.GetIsolate();
@@ -148,14 +685,364 @@ namespace USBDriver
       info.GetReturnValue().Set(Undefined(isolate));
     }
 
+    void Configure(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsObject())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type object");
+
+      Local<Object> config = info[0]->ToObject();
+      Options &opts = USBDriver::options();
+
+#define CONFIG_BOOL(name, field)                                        \
+      do {                                                              \
+        Local<Value> _val = config->Get(String::NewFromUtf8(isolate, name)); \
+        if (!_val->IsUndefined()) {                                     \
+          opts.field = _val->BooleanValue();                            \
+        }                                                               \
+      }                                                                 \
+      while (0)
+
+#define CONFIG_INT(name, field)                                         \
+      do {                                                              \
+        Local<Value> _val = config->Get(String::NewFromUtf8(isolate, name)); \
+        if (_val->IsNumber()) {                                         \
+          opts.field = static_cast<int>(_val->IntegerValue());          \
+        }                                                               \
+      }                                                                 \
+      while (0)
+
+      CONFIG_BOOL("ioUring", ioUring);
+      CONFIG_INT("attributeFdBudget", attributeFdBudget);
+      CONFIG_INT("pollIntervalMin", pollIntervalMin);
+      CONFIG_INT("pollIntervalMax", pollIntervalMax);
+      CONFIG_BOOL("filesystemInfo", filesystemInfo);
+      CONFIG_INT("deviceTTL", deviceTTL);
+      CONFIG_BOOL("capacityInfo", capacityInfo);
+      CONFIG_INT("capacityTTL", capacityTTL);
+      CONFIG_INT("capacityTimeout", capacityTimeout);
+
+#undef CONFIG_BOOL
+#undef CONFIG_INT
+
+      Local<Value> repeatWindow = config->Get(String::NewFromUtf8(isolate, "logRepeatWindow"));
+
+      if(repeatWindow->IsNumber())
+        Logger::instance().setRepeatWindow(static_cast<unsigned int>(std::max<int64_t>(0, repeatWindow->IntegerValue())));
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void ShareDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      if(!SharedTable::instance().own(*str))
+        THROW_AND_RETURN(isolate, "Failed to create the shared device table, see the log file");
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void AttachDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      if(!SharedTable::instance().attach(*str))
+        THROW_AND_RETURN(isolate, "Failed to attach to the shared device table, see the log file");
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void DetachDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      SharedTable::instance().detach();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
+    void GetHistory(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 3)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsObject())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type object");
+
+      if(!info[1]->IsNumber() || !info[2]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the time range to be of type number");
+
+      Local<Object> criteria = info[0]->ToObject();
+      JournalQuery query;
+
+      if(!Criteria_Property(isolate, criteria, "id", query.uid) ||
+         !Criteria_Property(isolate, criteria, "vendorId", query.vendorID) ||
+         !Criteria_Property(isolate, criteria, "productId", query.productID) ||
+         !Criteria_Property(isolate, criteria, "serialNumber", query.serialNumber))
+        return;
+
+      // Milliseconds from JS, microseconds in the journal
+      uint64_t since = static_cast<uint64_t>(std::max(0.0, info[1]->NumberValue()) * 1000);
+      uint64_t until = static_cast<uint64_t>(std::max(0.0, info[2]->NumberValue()) * 1000);
+
+      static const char *TYPES[] = { "attach", "detach", "mount", "unmount" };
+
+      auto entries = DeviceJournal::instance().entries(query, since, until);
+      Local<Array> array = Array::New(isolate, static_cast<int>(entries.size()));
+
+      for(size_t i = 0; i < entries.size(); ++i) {
+        const JournalEntry &entry = entries[i];
+        Local<Object> obj = Object::New(isolate);
+
+        obj->Set(String::NewFromUtf8(isolate, "type"), String::NewFromUtf8(isolate, TYPES[entry.type]));
+        obj->Set(String::NewFromUtf8(isolate, "id"), String::NewFromUtf8(isolate, entry.uid));
+        obj->Set(String::NewFromUtf8(isolate, "vendorId"), Number::New(isolate, entry.vendorID));
+        obj->Set(String::NewFromUtf8(isolate, "productId"), Number::New(isolate, entry.productID));
+
+        if(entry.serialNumber[0] != '\0')
+          obj->Set(String::NewFromUtf8(isolate, "serialNumber"), String::NewFromUtf8(isolate, entry.serialNumber));
+        else
+          obj->Set(String::NewFromUtf8(isolate, "serialNumber"), Null(isolate));
+        obj->Set(String::NewFromUtf8(isolate, "time"), Number::New(isolate, entry.timestamp / 1000.0));
+
+        if(entry.type == JournalEntry::MOUNT || entry.type == JournalEntry::UNMOUNT)
+          obj->Set(String::NewFromUtf8(isolate, "mount"), String::NewFromUtf8(isolate, entry.mountPoint));
+
+        array->Set(static_cast<int>(i), obj);
+      }
+
+      info.GetReturnValue().Set(array);
+    }
+
+    void GetStats(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      Local<Object> obj = Object::New(isolate);
+      Stats &counters = USBDriver::stats();
+
+#define STATS_NUMBER(name, field)                                       \
+      obj->Set(String::NewFromUtf8(isolate, name),                      \
+               Number::New(isolate, static_cast<double>(counters.field.load())))
+
+      obj->Set(String::NewFromUtf8(isolate, "watcher"),
+               String::NewFromUtf8(isolate, counters.watcher.load()));
+      STATS_NUMBER("polls", polls);
+      STATS_NUMBER("scans", scans);
+      STATS_NUMBER("deviceReads", deviceReads);
+      STATS_NUMBER("watcherEvents", watcherEvents);
+      STATS_NUMBER("refreshes", refreshes);
+
+#undef STATS_NUMBER
+
+      obj->Set(String::NewFromUtf8(isolate, "logSuppressed"),
+               Number::New(isolate, static_cast<double>(Logger::instance().suppressed())));
+      obj->Set(String::NewFromUtf8(isolate, "logRepeatRecords"),
+               Number::New(isolate, static_cast<double>(Logger::instance().repeatRecords())));
+
+      info.GetReturnValue().Set(obj);
+    }
+
+    void StartTracing(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsNumber() || info[0]->NumberValue() < 1)
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a positive number");
+
+      Tracer::instance().enable(static_cast<size_t>(info[0]->NumberValue()));
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void StopTracing(const FunctionCallbackInfo<Value> &info)
+    {
+      Tracer::instance().disable();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
+    void DumpTrace(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      info.GetReturnValue().Set(Boolean::New(isolate, Tracer::instance().dump(*str)));
+    }
+
+    void StartRecording(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      if(!TimelineRecorder::instance().start(*str))
+        THROW_AND_RETURN(isolate, "Failed to start recording, see the log file");
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void StopRecording(const FunctionCallbackInfo<Value> &info)
+    {
+      TimelineRecorder::instance().stop();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
+    typedef struct ReplayRequest {
+      uv_work_t work;
+      std::string path;
+      double speed;
+      bool ok;
+      ReplayResult result;
+      Persistent<Function> callback;
+    } ReplayRequest;
+
+    // Runs on the libuv thread pool
+    static void ReplayWork(uv_work_t *work)
+    {
+      ReplayRequest *request = static_cast<ReplayRequest *>(work->data);
+
+      request->ok = TimelineReplayer::instance().replay(request->path, request->speed, request->result);
+    }
+
+    static void ReplayDone(uv_work_t *work, int)
+    {
+      ReplayRequest *request = static_cast<ReplayRequest *>(work->data);
+      auto isolate = Isolate::GetCurrent();
+      HandleScope scope(isolate);
+
+      Local<Value> argv[2];
+
+      if(request->ok) {
+        Local<Object> result = Object::New(isolate);
+
+        result->Set(String::NewFromUtf8(isolate, "events"),
+                    Number::New(isolate, static_cast<double>(request->result.events)));
+        result->Set(String::NewFromUtf8(isolate, "snapshots"),
+                    Number::New(isolate, static_cast<double>(request->result.snapshots)));
+        result->Set(String::NewFromUtf8(isolate, "durationMs"),
+                    Number::New(isolate, request->result.milliseconds));
+
+        argv[0] = Null(isolate);
+        argv[1] = result;
+      } else {
+        argv[0] = Exception::Error(String::NewFromUtf8(isolate, "Failed to replay the timeline, see the log file"));
+        argv[1] = Null(isolate);
+      }
+
+      Local<Function> callback = Local<Function>::New(isolate, request->callback);
+
+      node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 2, argv);
+
+      request->callback.Reset();
+      delete request;
+    }
+
+    void Replay(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 3)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      if(!info[1]->IsNumber() || info[1]->NumberValue() < 0)
+        THROW_AND_RETURN(isolate, "Expected the second argument to be a non-negative number");
+
+      if(!info[2]->IsFunction())
+        THROW_AND_RETURN(isolate, "Expected the third argument to be of type function");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      ReplayRequest *request = new ReplayRequest;
+      request->work.data = request;
+      request->path = *str;
+      request->speed = info[1]->NumberValue();
+      request->ok = false;
+      request->callback.Reset(isolate, Local<Function>::Cast(info[2]));
+
+      uv_queue_work(uv_default_loop(), &request->work, ReplayWork, ReplayDone);
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void CancelReplay(const FunctionCallbackInfo<Value> &info)
+    {
+      TimelineReplayer::instance().cancel();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
     void Init(Handle<Object> exports)
     {
       Logger::instance().setLogFile("usb-driver.log");
 
       NODE_SET_METHOD(exports, "setLogFile", SetLogFile);
+      NODE_SET_METHOD(exports, "configure", Configure);
       NODE_SET_METHOD(exports, "unmount", Unmount);
       NODE_SET_METHOD(exports, "getDevice", GetDevice);
+      NODE_SET_METHOD(exports, "refreshDevice", RefreshDevice);
       NODE_SET_METHOD(exports, "pollDevices", PollDevices);
+      NODE_SET_METHOD(exports, "findDevices", FindDevices);
+      NODE_SET_METHOD(exports, "getDeviceByMount", GetDeviceByMount);
+      NODE_SET_METHOD(exports, "getParent", GetParent);
+      NODE_SET_METHOD(exports, "getDescendants", GetDescendants);
+      NODE_SET_METHOD(exports, "startPolling", StartPolling);
+      NODE_SET_METHOD(exports, "stopPolling", StopPolling);
+      NODE_SET_METHOD(exports, "openEvents", OpenEvents);
+      NODE_SET_METHOD(exports, "readEvents", ReadEvents);
+      NODE_SET_METHOD(exports, "closeEvents", CloseEvents);
+      NODE_SET_METHOD(exports, "getStats", GetStats);
+      NODE_SET_METHOD(exports, "getHistory", GetHistory);
+      NODE_SET_METHOD(exports, "shareDevices", ShareDevices);
+      NODE_SET_METHOD(exports, "attachDevices", AttachDevices);
+      NODE_SET_METHOD(exports, "detachDevices", DetachDevices);
+      NODE_SET_METHOD(exports, "startTracing", StartTracing);
+      NODE_SET_METHOD(exports, "stopTracing", StopTracing);
+      NODE_SET_METHOD(exports, "dumpTrace", DumpTrace);
+      NODE_SET_METHOD(exports, "startRecording", StartRecording);
+      NODE_SET_METHOD(exports, "stopRecording", StopRecording);
+      NODE_SET_METHOD(exports, "replay", Replay);
+      NODE_SET_METHOD(exports, "cancelReplay", CancelReplay);
     }
   }  // namespace NodeJS
 } // namepsace USBDriver
@@ -0,0 +1,167 @@
+#include "device_id.h"
+
+namespace USBDriver
+{
+  static char _upper(char c)
+  {
+    return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+  }
+
+  // Case insensitive, so it doesn't depend on the C locale
+  static bool _skipPrefix(const char *&p, const char *end, const char *prefix)
+  {
+    const char *q = p;
+
+    for(; *prefix != '\0'; ++prefix, ++q) {
+      if(q == end || _upper(*q) != _upper(*prefix))
+        return false;
+    }
+
+    p = q;
+
+    return true;
+  }
+
+  static int _hexDigit(char c)
+  {
+    if(c >= '0' && c <= '9')
+      return c - '0';
+    if(c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+
+    return -1;
+  }
+
+  /**
+   * Read between minDigits and maxDigits hex digits, stopping at the
+   * first non digit.
+   */
+  static bool _parseHex(const char *&p, const char *end, size_t minDigits, size_t maxDigits, int &value)
+  {
+    size_t digits = 0;
+    int result = 0;
+    int digit;
+
+    while(p != end && digits < maxDigits && (digit = _hexDigit(*p)) >= 0) {
+      result = (result << 4) | digit;
+      ++digits;
+      ++p;
+    }
+
+    if(digits < minDigits)
+      return false;
+
+    value = result;
+
+    return true;
+  }
+
+  // The end of a string that may also be NUL or newline terminated
+  static bool _atEnd(const char *p, const char *end)
+  {
+    return p == end || *p == '\0' || *p == '\n';
+  }
+
+  bool parseInstanceID(const char *str, size_t len, DeviceID &id)
+  {
+    const char *p = str;
+    const char *end = str + len;
+
+    if(!_skipPrefix(p, end, "USB\\VID_") || !_parseHex(p, end, 4, 4, id.vendorID))
+      return false;
+
+    if(!_skipPrefix(p, end, "&PID_") || !_parseHex(p, end, 4, 4, id.productID))
+      return false;
+
+    id.deviceVersion = -1;
+    id.serialNumber.clear();
+
+    // Hardware IDs carry the revision instead of an instance
+    if(_skipPrefix(p, end, "&REV_"))
+      return _parseHex(p, end, 4, 4, id.deviceVersion) && (_atEnd(p, end) || *p == '&');
+
+    // An interface, or nothing more
+    if(_atEnd(p, end) || *p == '&')
+      return true;
+
+    if(*p++ != '\\')
+      return false;
+
+    const char *serial = p;
+
+    while(!_atEnd(p, end)) {
+      // Made up by Windows, the device has no serial number
+      if(*p == '&')
+        return true;
+
+      ++p;
+    }
+
+    id.serialNumber.assign(serial, p - serial);
+
+    for(auto &c : id.serialNumber)
+      c = _upper(c);
+
+    return true;
+  }
+
+  bool parseModalias(const char *str, size_t len, DeviceID &id)
+  {
+    const char *p = str;
+    const char *end = str + len;
+
+    if(!_skipPrefix(p, end, "usb:v") || !_parseHex(p, end, 4, 4, id.vendorID))
+      return false;
+
+    if(!_skipPrefix(p, end, "p") || !_parseHex(p, end, 4, 4, id.productID))
+      return false;
+
+    id.deviceVersion = -1;
+    id.serialNumber.clear();
+
+    // Interface and class fields follow, none of which identify the device
+    if(_skipPrefix(p, end, "d") && !_parseHex(p, end, 4, 4, id.deviceVersion))
+      return false;
+
+    return true;
+  }
+
+  bool parseUeventProduct(const char *str, size_t len, DeviceID &id)
+  {
+    const char *p = str;
+    const char *end = str + len;
+
+    // Hex without leading zeros
+    if(!_skipPrefix(p, end, "PRODUCT=") || !_parseHex(p, end, 1, 4, id.vendorID))
+      return false;
+
+    if(!_skipPrefix(p, end, "/") || !_parseHex(p, end, 1, 4, id.productID))
+      return false;
+
+    if(!_skipPrefix(p, end, "/") || !_parseHex(p, end, 1, 4, id.deviceVersion))
+      return false;
+
+    id.serialNumber.clear();
+
+    return _atEnd(p, end);
+  }
+
+  bool parseDeviceID(const char *str, size_t len, DeviceID &id)
+  {
+    const char *p = str;
+    const char *end = str + len;
+
+    if(_skipPrefix(p, end, "USB\\"))
+      return parseInstanceID(str, len, id);
+
+    if(_skipPrefix(p, end, "usb:"))
+      return parseModalias(str, len, id);
+
+    if(_skipPrefix(p, end, "PRODUCT="))
+      return parseUeventProduct(str, len, id);
+
+    return false;
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef _USB_DRIVER_DEVICE_ID_H__
+#define _USB_DRIVER_DEVICE_ID_H__
+
+#include <string>
+#include <stddef.h>
+
+namespace USBDriver
+{
+  typedef struct DeviceID {
+    int vendorID;
+    int productID;
+    int deviceVersion;          // bcdDevice, -1 if the identifier doesn't carry it.
+    std::string serialNumber;   // Upper case, Windows instance IDs only. Can be empty.
+
+    DeviceID() : vendorID(0), productID(0), deviceVersion(-1) {}
+  } DeviceID;
+
+  /**
+   * Parse a Windows device instance ID, `USB\VID_0781&PID_5567\4C530001`,
+   * or hardware ID, `USB\VID_0781&PID_5567&REV_0100`. IDs of interfaces
+   * (`&MI_00`) and instance IDs generated by Windows for devices without
+   * a serial number (`\6&2B2E9A3&0&1`) leave serialNumber empty.
+   */
+  bool parseInstanceID(const char *str, size_t len, DeviceID &id);
+  /**
+   * Parse a Linux `modalias` string, `usb:v0781p5567d0100dc00...`.
+   */
+  bool parseModalias(const char *str, size_t len, DeviceID &id);
+  /**
+   * Parse the `PRODUCT=781/5567/100` field of a Linux USB uevent.
+   */
+  bool parseUeventProduct(const char *str, size_t len, DeviceID &id);
+  /**
+   * Parse any of the above, told apart by their prefix.
+   */
+  bool parseDeviceID(const char *str, size_t len, DeviceID &id);
+}
+
+#endif // _USB_DRIVER_DEVICE_ID_H__
@@ -0,0 +1,164 @@
+#include "event_queue.h"
+#include "usb_common.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace USBDriver
+{
+  EventQueue::EventQueue(size_t highWaterMark, Overflow overflow)
+    : m_highWaterMark(std::max<size_t>(1, highWaterMark)), m_overflow(overflow),
+      m_dropped(0), m_coalesced(0), m_overflowed(false)
+  {
+  }
+
+  void EventQueue::diff(const std::vector<USBDevicePtr> &previous,
+                        const std::vector<USBDevicePtr> &current,
+                        std::vector<DeviceEvent> &events)
+  {
+    std::unordered_map<std::string, USBDevicePtr> known;
+
+    for(auto &device : previous)
+      known[device->uid] = device;
+
+    std::vector<DeviceEvent> updates;
+
+    for(auto &device : current) {
+      auto it = known.find(device->uid);
+
+      if(it == known.end()) {
+        updates.push_back(DeviceEvent{DeviceEvent::ATTACH, device});
+        continue;
+      }
+
+      if(it->second != device)
+        updates.push_back(DeviceEvent{DeviceEvent::CHANGE, device});
+
+      known.erase(it);
+    }
+
+    // Whatever is left went away
+    for(auto &device : previous) {
+      if(known.count(device->uid))
+        events.push_back(DeviceEvent{DeviceEvent::DETACH, device});
+    }
+
+    events.insert(events.end(), updates.begin(), updates.end());
+  }
+
+  void EventQueue::update(const std::vector<USBDevicePtr> &devices)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(sameDevices(devices, m_devices))
+      return;
+
+    std::vector<DeviceEvent> events;
+    diff(m_devices, devices, events);
+
+    for(auto &event : events)
+      push(event);
+
+    m_devices = devices;
+  }
+
+  void EventQueue::push(const DeviceEvent &event)
+  {
+    if(m_events.size() < m_highWaterMark) {
+      m_events.push_back(event);
+      return;
+    }
+
+    switch(m_overflow) {
+    case COALESCE:
+      if(coalesce(event))
+        return;
+
+      // Nothing to merge with
+      m_events.pop_front();
+      m_events.push_back(event);
+      ++m_dropped;
+      break;
+
+    case DROP_OLDEST:
+      m_events.pop_front();
+      m_events.push_back(event);
+      ++m_dropped;
+      break;
+
+    case FAIL:
+      m_overflowed = true;
+      ++m_dropped;
+      break;
+    }
+  }
+
+  bool EventQueue::coalesce(const DeviceEvent &event)
+  {
+    auto queued = std::find_if(m_events.rbegin(), m_events.rend(), [&event](const DeviceEvent &other) {
+        return other.device->uid == event.device->uid;
+      });
+
+    if(queued == m_events.rend())
+      return false;
+
+    ++m_coalesced;
+
+    // Never seen by the consumer, so never there
+    if(queued->type == DeviceEvent::ATTACH && event.type == DeviceEvent::DETACH) {
+      m_events.erase(std::next(queued).base());
+      return true;
+    }
+
+    // Went away and came back
+    if(queued->type == DeviceEvent::DETACH && event.type == DeviceEvent::ATTACH)
+      queued->type = DeviceEvent::CHANGE;
+    // An attach stays an attach, of the latest record
+    else if(queued->type != DeviceEvent::ATTACH)
+      queued->type = event.type;
+
+    queued->device = event.device;
+
+    return true;
+  }
+
+  size_t EventQueue::drain(std::vector<DeviceEvent> &events)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t count = m_events.size();
+
+    events.insert(events.end(), m_events.begin(), m_events.end());
+    m_events.clear();
+
+    return count;
+  }
+
+  size_t EventQueue::size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_events.size();
+  }
+
+  unsigned long EventQueue::dropped() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_dropped;
+  }
+
+  unsigned long EventQueue::coalesced() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_coalesced;
+  }
+
+  bool EventQueue::overflowed() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_overflowed;
+  }
+}
@@ -0,0 +1,86 @@
+#ifndef _USB_DRIVER_EVENT_QUEUE_H__
+#define _USB_DRIVER_EVENT_QUEUE_H__
+
+#include "usb_driver.h"
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace USBDriver
+{
+  typedef struct DeviceEvent {
+    enum Type {
+      ATTACH,
+      DETACH,
+      CHANGE    // Same device, e.g. mounted or unmounted.
+    };
+
+    Type type;
+    USBDevicePtr device;   // The new record, or the last one for DETACH.
+  } DeviceEvent;
+
+  /**
+   * Bounded queue of device events for one consumer. The queue keeps the
+   * device set it last saw and turns every new set into events.
+   *
+   * Once `highWaterMark` events are queued, the overflow policy decides
+   * what happens to the next one:
+   *  - DROP_OLDEST: the oldest queued event is dropped.
+   *  - COALESCE: the event is merged into a queued event for the same
+   *    device, e.g. an attach followed by a detach cancel out. The oldest
+   *    event is dropped if there is none.
+   *  - FAIL: the event is dropped and the queue is marked as overflowed.
+   */
+  class EventQueue
+  {
+  public:
+    enum Overflow {
+      DROP_OLDEST,
+      COALESCE,
+      FAIL
+    };
+
+    EventQueue(size_t highWaterMark, Overflow overflow);
+
+    /**
+     * Queue the events turning the last seen device set into `devices`.
+     */
+    void update(const std::vector<USBDevicePtr> &devices);
+    /**
+     * Move all queued events to `events`. Returns the number moved.
+     */
+    size_t drain(std::vector<DeviceEvent> &events);
+
+    size_t size() const;
+    unsigned long dropped() const;
+    unsigned long coalesced() const;
+    bool overflowed() const;
+
+    /**
+     * The events turning device set `previous` into `current`: detaches
+     * first, then attaches and changes in the order of `current`.
+     */
+    static void diff(const std::vector<USBDevicePtr> &previous,
+                     const std::vector<USBDevicePtr> &current,
+                     std::vector<DeviceEvent> &events);
+
+  private:
+    EventQueue(const EventQueue &);
+    EventQueue &operator=(const EventQueue &);
+
+    void push(const DeviceEvent &event);
+    bool coalesce(const DeviceEvent &event);
+
+    mutable std::mutex m_mutex;
+    std::deque<DeviceEvent> m_events;
+    std::vector<USBDevicePtr> m_devices;   // Device set as of the last update().
+    size_t m_highWaterMark;
+    Overflow m_overflow;
+    unsigned long m_dropped;
+    unsigned long m_coalesced;
+    bool m_overflowed;
+  };
+}
+
+#endif // _USB_DRIVER_EVENT_QUEUE_H__
@@ -0,0 +1,146 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+namespace USBDriver
+{
+  static void _copyField(char *dst, size_t size, const char *src, size_t len)
+  {
+    len = std::min(len, size - 1);
+
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+  }
+
+  // Compared as truncated
+  static bool _sameField(const std::string &value, const char *field, size_t size)
+  {
+    return strncmp(value.c_str(), field, size - 1) == 0;
+  }
+
+  DeviceJournal::DeviceJournal()
+    : m_next(0)
+  {
+    for(auto &slot : m_slots) {
+      slot.version.store(0, std::memory_order_relaxed);
+
+      for(auto &word : slot.words)
+        word.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void DeviceJournal::record(JournalEntry::Type type, const USBDevicePtr &device)
+  {
+    JournalEntry entry;
+    uint64_t words[SLOT_WORDS] = { 0 };
+
+    memset(&entry, 0, sizeof(entry));
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+
+    entry.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    entry.type = type;
+    entry.vendorID = device->vendorID;
+    entry.productID = device->productID;
+
+    _copyField(entry.uid, sizeof(entry.uid), device->uid.c_str(), device->uid.size());
+    _copyField(entry.serialNumber, sizeof(entry.serialNumber), device->serialNumber.c_str(),
+               device->serialNumber.size());
+
+    if(type == JournalEntry::MOUNT || type == JournalEntry::UNMOUNT)
+      _copyField(entry.mountPoint, sizeof(entry.mountPoint), device->mountPoint.c_str(), device->mountPoint.size());
+
+    memcpy(words, &entry, sizeof(entry));
+
+    uint64_t number = m_next.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = m_slots[number % CAPACITY];
+
+    slot.version.store(2 * number + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for(size_t i = 0; i < SLOT_WORDS; ++i)
+      slot.words[i].store(words[i], std::memory_order_relaxed);
+
+    slot.version.store(2 * number + 2, std::memory_order_release);
+  }
+
+  std::vector<JournalEntry> DeviceJournal::entries(const JournalQuery &query, uint64_t since, uint64_t until) const
+  {
+    std::vector<JournalEntry> entries = snapshot();
+    JournalQuery criteria = query;
+
+    // The device behind the UID, whichever UID it had at the time
+    if(!criteria.uid.empty()) {
+      for(auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if(!_sameField(criteria.uid, it->uid, sizeof(it->uid)) || it->serialNumber[0] == '\0')
+          continue;
+
+        if((criteria.vendorID >= 0 && criteria.vendorID != it->vendorID) ||
+           (criteria.productID >= 0 && criteria.productID != it->productID) ||
+           (!criteria.serialNumber.empty() &&
+            !_sameField(criteria.serialNumber, it->serialNumber, sizeof(it->serialNumber))))
+          return std::vector<JournalEntry>();
+
+        criteria.uid.clear();
+        criteria.vendorID = it->vendorID;
+        criteria.productID = it->productID;
+        criteria.serialNumber = it->serialNumber;
+        break;
+      }
+    }
+
+    auto rejected = [&criteria, since, until](const JournalEntry &entry) {
+      return (!criteria.uid.empty() && !_sameField(criteria.uid, entry.uid, sizeof(entry.uid))) ||
+        (criteria.vendorID >= 0 && criteria.vendorID != entry.vendorID) ||
+        (criteria.productID >= 0 && criteria.productID != entry.productID) ||
+        (!criteria.serialNumber.empty() &&
+         !_sameField(criteria.serialNumber, entry.serialNumber, sizeof(entry.serialNumber))) ||
+        (since != 0 && entry.timestamp < since) || (until != 0 && entry.timestamp > until);
+    };
+
+    entries.erase(std::remove_if(entries.begin(), entries.end(), rejected), entries.end());
+
+    return entries;
+  }
+
+  std::vector<JournalEntry> DeviceJournal::snapshot() const
+  {
+    std::vector<JournalEntry> entries;
+    uint64_t next = m_next.load(std::memory_order_acquire);
+    uint64_t first = next > CAPACITY ? next - CAPACITY : 0;
+
+    for(uint64_t number = first; number < next; ++number) {
+      const Slot &slot = m_slots[number % CAPACITY];
+      uint64_t version = slot.version.load(std::memory_order_acquire);
+
+      // Still being written, or already overwritten
+      if(version != 2 * number + 2)
+        continue;
+
+      uint64_t words[SLOT_WORDS];
+
+      for(size_t i = 0; i < SLOT_WORDS; ++i)
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if(slot.version.load(std::memory_order_relaxed) != version)
+        continue;
+
+      JournalEntry entry;
+
+      memcpy(&entry, words, sizeof(entry));
+
+      entries.push_back(entry);
+    }
+
+    return entries;
+  }
+
+  uint64_t DeviceJournal::recorded() const
+  {
+    return m_next.load(std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef _USB_DRIVER_JOURNAL_H__
+#define _USB_DRIVER_JOURNAL_H__
+
+#include "usb_driver.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace USBDriver
+{
+  // Longer UIDs, serial numbers and mount points are truncated in the journal
+  static const size_t JOURNAL_UID_SIZE = 96;
+  static const size_t JOURNAL_SERIAL_NUMBER_SIZE = 64;
+  static const size_t JOURNAL_MOUNT_POINT_SIZE = 128;
+
+  typedef struct JournalEntry {
+    enum Type {
+      ATTACH,
+      DETACH,
+      MOUNT,
+      UNMOUNT
+    };
+
+    uint64_t timestamp;                          // Microseconds since the Unix epoch.
+    uint32_t type;                               // A Type.
+    int32_t vendorID;
+    int32_t productID;
+    char uid[JOURNAL_UID_SIZE];                  // Changes on every plug.
+    char serialNumber[JOURNAL_SERIAL_NUMBER_SIZE];
+    char mountPoint[JOURNAL_MOUNT_POINT_SIZE];   // For MOUNT and UNMOUNT, empty otherwise.
+  } JournalEntry;
+
+  /**
+   * Criteria for DeviceJournal::entries(). Entries must match all criteria
+   * given.
+   */
+  typedef struct JournalQuery {
+    std::string uid;            // Every plug of this device, see entries(). Empty for any.
+    int vendorID;               // -1 for any.
+    int productID;              // -1 for any.
+    std::string serialNumber;   // Empty for any.
+
+    JournalQuery() : vendorID(-1), productID(-1) {}
+  } JournalQuery;
+
+  /**
+   * History of devices coming and going, fed by the device registry.
+   *
+   * Entries go to a fixed ring of slots allocated with the journal, so
+   * its footprint doesn't depend on uptime: once full, the oldest entries
+   * are overwritten. Recording and reading are lock free. Each slot is
+   * guarded by a sequence number, odd while the slot is written, and
+   * readers skip slots that changed under them.
+   */
+  class DeviceJournal
+  {
+  public:
+    static const size_t CAPACITY = 2048;
+
+    static DeviceJournal &instance()
+    {
+      static DeviceJournal instance;
+      return instance;
+    }
+
+    void record(JournalEntry::Type type, const USBDevicePtr &device);
+
+    /**
+     * Get the entries still in the journal matching `query`, oldest first,
+     * and only those recorded in [since, until], in microseconds since the
+     * Unix epoch, a bound of 0 being open.
+     *
+     * A device gets a new UID every time it is plugged in, so a query by
+     * UID also returns the other plugs of the same device, the same
+     * vendor, product and serial number, when it has a serial number.
+     */
+    std::vector<JournalEntry> entries(const JournalQuery &query, uint64_t since, uint64_t until) const;
+
+    /**
+     * Entries recorded so far, including the overwritten ones.
+     */
+    uint64_t recorded() const;
+
+  private:
+    DeviceJournal();
+    DeviceJournal(const DeviceJournal &);
+    DeviceJournal &operator=(const DeviceJournal &);
+
+    // Every complete entry still in the ring, oldest first
+    std::vector<JournalEntry> snapshot() const;
+
+    static const size_t SLOT_WORDS = (sizeof(JournalEntry) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    typedef struct Slot {
+      std::atomic<uint64_t> version;            // 2 * entry + 1 while written, 2 * entry + 2 after.
+      std::atomic<uint64_t> words[SLOT_WORDS];  // The entry, copied word by word.
+    } Slot;
+
+    Slot m_slots[CAPACITY];
+    std::atomic<uint64_t> m_next;   // Number of the next entry.
+  };
+}
+
+#endif // _USB_DRIVER_JOURNAL_H__
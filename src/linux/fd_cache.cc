@@ -0,0 +1,193 @@
+#include "fd_cache.h"
+#include "sysfs.h"
+#include "../usb_driver.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace USBDriver
+{
+  static ssize_t _pread(int fd, char *buf, size_t len)
+  {
+    ssize_t n;
+
+    do {
+      Sysfs::countSyscalls(1);
+      n = pread(fd, buf, len, 0);
+    } while(n < 0 && errno == EINTR);
+
+    return n < 0 ? -errno : n;
+  }
+
+  AttributeFdCache::AttributeFdCache()
+    : m_poll(0)
+  {
+  }
+
+  AttributeFdCache::~AttributeFdCache()
+  {
+    clear();
+  }
+
+  void AttributeFdCache::beginPoll()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    ++m_poll;
+  }
+
+  ssize_t AttributeFdCache::read(const std::string &path, const std::string &device,
+                                 char *buf, size_t len)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    ssize_t n;
+
+    if(lookup(path, buf, len, n))
+      return n;
+
+    if(!makeRoom())
+      return -EAGAIN;
+
+    Sysfs::countSyscalls(1);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+      return -errno;
+
+    n = _pread(fd, buf, len);
+
+    if(n < 0) {
+      Sysfs::countSyscalls(1);
+      close(fd);
+
+      return n;
+    }
+
+    insert(path, device, fd);
+
+    return n;
+  }
+
+  bool AttributeFdCache::readCached(const std::string &path, char *buf, size_t len, ssize_t &result)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return lookup(path, buf, len, result);
+  }
+
+  bool AttributeFdCache::adopt(const std::string &path, const std::string &device, int fd)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_entries.count(path) || !makeRoom())
+      return false;
+
+    insert(path, device, fd);
+
+    return true;
+  }
+
+  bool AttributeFdCache::lookup(const std::string &path, char *buf, size_t len, ssize_t &result)
+  {
+    auto it = m_entries.find(path);
+
+    if(it == m_entries.end())
+      return false;
+
+    LRUList::iterator entry = it->second;
+    ssize_t n = _pread(entry->fd, buf, len);
+
+    // The device went away, or was replaced by one with the same name
+    // and our descriptor points at the old one. Reopen it.
+    if(n == -ENODEV || n == -ENOENT) {
+      evict(entry);
+      return false;
+    }
+
+    entry->lastPoll = m_poll;
+    m_lru.splice(m_lru.begin(), m_lru, entry);
+    result = n;
+
+    return true;
+  }
+
+  void AttributeFdCache::insert(const std::string &path, const std::string &device, int fd)
+  {
+    Entry entry;
+    entry.path = path;
+    entry.device = device;
+    entry.fd = fd;
+    entry.lastPoll = m_poll;
+
+    m_lru.push_front(entry);
+    m_entries[path] = m_lru.begin();
+  }
+
+  bool AttributeFdCache::makeRoom()
+  {
+    size_t budget = static_cast<size_t>(std::max(0, options().attributeFdBudget.load()));
+
+    while(m_entries.size() >= budget) {
+      // Nothing to evict, or evicting would only thrash this poll
+      if(m_lru.empty() || m_lru.back().lastPoll == m_poll)
+        return false;
+
+      evict(std::prev(m_lru.end()));
+    }
+
+    return true;
+  }
+
+  void AttributeFdCache::evict(LRUList::iterator entry)
+  {
+    Sysfs::countSyscalls(1);
+    close(entry->fd);
+
+    m_entries.erase(entry->path);
+    m_lru.erase(entry);
+  }
+
+  void AttributeFdCache::retainDevices(const std::unordered_set<std::string> &devices)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for(auto it = m_lru.begin(); it != m_lru.end();) {
+      auto entry = it++;
+
+      if(!devices.count(entry->device))
+        evict(entry);
+    }
+  }
+
+  void AttributeFdCache::invalidateDevice(const std::string &device)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for(auto it = m_lru.begin(); it != m_lru.end();) {
+      auto entry = it++;
+
+      if(entry->device == device)
+        evict(entry);
+    }
+  }
+
+  void AttributeFdCache::clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    while(!m_lru.empty())
+      evict(m_lru.begin());
+  }
+
+  size_t AttributeFdCache::size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_entries.size();
+  }
+}
@@ -0,0 +1,95 @@
+#ifndef _USB_DRIVER_LINUX_FD_CACHE_H__
+#define _USB_DRIVER_LINUX_FD_CACHE_H__
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/types.h>
+
+namespace USBDriver
+{
+  /**
+   * Keeps sysfs attribute files open across polls so that re-reading an
+   * attribute of a device that stays plugged in is a single pread().
+   *
+   * The number of open descriptors is bounded by
+   * options().attributeFdBudget. When the budget is exhausted the least
+   * recently used descriptor is closed, unless it was used by the current
+   * poll, in which case the attribute is read without caching instead of
+   * thrashing the cache.
+   */
+  class AttributeFdCache
+  {
+  public:
+    static AttributeFdCache &instance()
+    {
+      static AttributeFdCache instance;
+      return instance;
+    }
+
+    ~AttributeFdCache();
+
+    /**
+     * Start a new poll, see the class description.
+     */
+    void beginPoll();
+
+    /**
+     * Read the attribute at path, which belongs to the device `device`.
+     * Returns the number of bytes read or -errno. Returns -EAGAIN without
+     * touching the file if it is not cached and the budget is exhausted.
+     */
+    ssize_t read(const std::string &path, const std::string &device, char *buf, size_t len);
+    /**
+     * Read the attribute at path only if its descriptor is cached. Returns
+     * false, with nothing read, if it isn't.
+     */
+    bool readCached(const std::string &path, char *buf, size_t len, ssize_t &result);
+    /**
+     * Keep `fd`, opened elsewhere on `path`, open across polls. Returns
+     * false if the budget is exhausted, in which case the caller keeps
+     * ownership of `fd`.
+     */
+    bool adopt(const std::string &path, const std::string &device, int fd);
+
+    /**
+     * Close the descriptors of all devices not in `devices`.
+     */
+    void retainDevices(const std::unordered_set<std::string> &devices);
+    /**
+     * Close the descriptors of one device, e.g. when it was unplugged.
+     */
+    void invalidateDevice(const std::string &device);
+    void clear();
+
+    size_t size() const;
+
+  private:
+    AttributeFdCache();
+    AttributeFdCache(const AttributeFdCache &);
+    AttributeFdCache &operator=(const AttributeFdCache &);
+
+    typedef struct Entry {
+      std::string path;
+      std::string device;
+      int fd;
+      unsigned long lastPoll;  // Generation of the poll that last read this entry.
+    } Entry;
+
+    typedef std::list<Entry> LRUList;  // Most recently used first
+
+    bool lookup(const std::string &path, char *buf, size_t len, ssize_t &result);
+    void insert(const std::string &path, const std::string &device, int fd);
+    bool makeRoom();
+    void evict(LRUList::iterator entry);
+
+    mutable std::mutex m_mutex;
+    LRUList m_lru;
+    std::unordered_map<std::string, LRUList::iterator> m_entries;
+    unsigned long m_poll;
+  };
+}
+
+#endif // _USB_DRIVER_LINUX_FD_CACHE_H__
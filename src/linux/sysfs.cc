@@ -0,0 +1,313 @@
+#include "sysfs.h"
+#include "fd_cache.h"
+#include "uring.h"
+#include "../usb_driver.h"
+#include "../utils.h"
+
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// USB descriptor types
+static const unsigned char DT_DEVICE = 0x01;
+static const unsigned char DT_CONFIG = 0x02;
+static const unsigned char DT_INTERFACE = 0x04;
+
+static const size_t DEVICE_DESCRIPTOR_SIZE = 18;
+static const unsigned char MASS_STORAGE_CLASS = 0x08;
+
+namespace USBDriver
+{
+  namespace Sysfs
+  {
+    static std::atomic<unsigned long> gSyscalls(0);
+
+    static inline int _le16(const unsigned char *p)
+    {
+      return p[0] | (p[1] << 8);
+    }
+
+    // Read up to len bytes from path with a single open/read/close
+    static ssize_t _readFile(const char *path, char *buf, size_t len)
+    {
+      gSyscalls.fetch_add(1, std::memory_order_relaxed);
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+      if(fd < 0)
+        return -errno;
+
+      ssize_t n;
+
+      do {
+        gSyscalls.fetch_add(1, std::memory_order_relaxed);
+        n = read(fd, buf, len);
+      } while(n < 0 && errno == EINTR);
+
+      if(n < 0)
+        n = -errno;
+
+      gSyscalls.fetch_add(1, std::memory_order_relaxed);
+      close(fd);
+
+      return n;
+    }
+
+    static void _stripNewlines(const char *buf, ssize_t &n)
+    {
+      while(n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\0'))
+        --n;
+    }
+
+    bool parseDescriptors(const unsigned char *buf, size_t len, DeviceDescriptor &desc)
+    {
+      if(len < DEVICE_DESCRIPTOR_SIZE || buf[0] < DEVICE_DESCRIPTOR_SIZE || buf[1] != DT_DEVICE)
+        return false;
+
+      desc.usbVersion        = _le16(buf + 2);
+      desc.deviceClass       = buf[4];
+      desc.deviceSubClass    = buf[5];
+      desc.deviceProtocol    = buf[6];
+      desc.vendorID          = _le16(buf + 8);
+      desc.productID         = _le16(buf + 10);
+      desc.deviceVersion     = _le16(buf + 12);
+      desc.manufacturerIndex = buf[14];
+      desc.productIndex      = buf[15];
+      desc.serialNumberIndex = buf[16];
+      desc.numConfigurations = buf[17];
+      desc.numInterfaces     = 0;
+      desc.massStorage       = desc.deviceClass == MASS_STORAGE_CLASS;
+
+      // Walk the configuration descriptors that follow
+      bool firstConfig = true;
+      size_t offset = buf[0];
+
+      while(offset + 2 <= len) {
+        unsigned char length = buf[offset];
+        unsigned char type = buf[offset + 1];
+
+        if(length < 2 || offset + length > len)
+          break;  // Truncated or corrupt, keep what we have
+
+        if(type == DT_CONFIG && length >= 5) {
+          if(firstConfig)
+            desc.numInterfaces = buf[offset + 4];
+
+          firstConfig = false;
+        } else if(type == DT_INTERFACE && length >= 6 && buf[offset + 5] == MASS_STORAGE_CLASS) {
+          desc.massStorage = true;
+        }
+
+        offset += length;
+      }
+
+      return true;
+    }
+
+    bool readDescriptors(const std::string &devicePath, DeviceDescriptor &desc)
+    {
+      std::string path = devicePath + "/descriptors";
+      unsigned char buf[DESCRIPTORS_BUF_SIZE];
+
+      ssize_t n = _readFile(path.c_str(), reinterpret_cast<char *>(buf), sizeof(buf));
+
+      if(n < 0)
+        return false;
+
+      return parseDescriptors(buf, static_cast<size_t>(n), desc);
+    }
+
+    bool readAttribute(const std::string &devicePath, const char *name, std::string &value)
+    {
+      std::string path = devicePath + "/" + name;
+      char buf[ATTRIBUTE_BUF_SIZE];
+
+      ssize_t n = _readFile(path.c_str(), buf, sizeof(buf));
+
+      if(n < 0)
+        return false;
+
+      _stripNewlines(buf, n);
+
+      value.assign(buf, static_cast<size_t>(n));
+
+      return true;
+    }
+
+    void readFilesPlain(std::vector<ReadRequest> &requests)
+    {
+      for(auto &request : requests)
+        request.result = _readFile(request.path.c_str(), request.buf, request.len);
+    }
+
+    static void _readFilesUncached(std::vector<ReadRequest> &requests)
+    {
+      if(requests.empty())
+        return;
+
+      if(options().ioUring) {
+        IOUring *ring = IOUring::instance();
+
+        if(ring != nullptr && ring->readFiles(requests.data(), requests.size()))
+          return;
+      }
+
+      readFilesPlain(requests);
+    }
+
+    void readFiles(std::vector<ReadRequest> &requests)
+    {
+      if(options().attributeFdBudget <= 0) {
+        _readFilesUncached(requests);
+        return;
+      }
+
+      AttributeFdCache &cache = AttributeFdCache::instance();
+      IOUring *ring = options().ioUring ? IOUring::instance() : nullptr;
+      std::vector<size_t> missed;
+
+      for(size_t i = 0; i < requests.size(); ++i) {
+        ReadRequest &request = requests[i];
+
+        if(ring != nullptr) {
+          if(!cache.readCached(request.path, request.buf, request.len, request.result))
+            missed.push_back(i);
+        } else {
+          request.result = cache.read(request.path, request.device, request.buf, request.len);
+
+          if(request.result == -EAGAIN)
+            missed.push_back(i);
+        }
+      }
+
+      if(missed.empty())
+        return;
+
+      // Open the misses through the ring in one go, and keep what fits
+      if(ring != nullptr) {
+        std::vector<ReadRequest> opening;
+        std::vector<int> fds(missed.size());
+
+        for(size_t i : missed)
+          opening.push_back(requests[i]);
+
+        bool ok = ring->readFiles(opening.data(), opening.size(), fds.data());
+
+        for(size_t i = 0; i < missed.size(); ++i) {
+          bool kept = ok && fds[i] >= 0 && opening[i].result >= 0 &&
+            cache.adopt(opening[i].path, opening[i].device, fds[i]);
+
+          if(fds[i] >= 0 && !kept) {
+            countSyscalls(1);
+            close(fds[i]);
+          }
+
+          if(ok)
+            requests[missed[i]].result = opening[i].result;
+        }
+
+        if(ok)
+          return;
+      }
+
+      // Over budget or the ring failed, read the rest without keeping them open
+      std::vector<ReadRequest> uncached;
+
+      for(size_t i : missed)
+        uncached.push_back(requests[i]);
+
+      _readFilesUncached(uncached);
+
+      for(size_t i = 0; i < missed.size(); ++i)
+        requests[missed[i]].result = uncached[i].result;
+    }
+
+    bool attributeValue(const ReadRequest &request, std::string &value)
+    {
+      if(request.result < 0)
+        return false;
+
+      ssize_t n = request.result;
+      _stripNewlines(request.buf, n);
+
+      value.assign(request.buf, static_cast<size_t>(n));
+
+      return true;
+    }
+
+    void readDevices(const std::string &root, std::vector<Device> &devices)
+    {
+      CORE_TRACE_SCOPE("enumeration", "readDevices");
+
+      std::vector<char> descBuf(devices.size() * DESCRIPTORS_BUF_SIZE);
+      std::vector<ReadRequest> requests(devices.size());
+
+      for(size_t i = 0; i < devices.size(); ++i) {
+        requests[i].path = root + "/" + devices[i].name + "/descriptors";
+        requests[i].device = devices[i].name;
+        requests[i].buf  = &descBuf[i * DESCRIPTORS_BUF_SIZE];
+        requests[i].len  = DESCRIPTORS_BUF_SIZE;
+      }
+
+      readFiles(requests);
+
+      // Only read the string attributes the devices actually have
+      std::vector<std::string *> values;
+      std::vector<ReadRequest> stringRequests;
+
+      auto addString = [&](Device &device, const char *attribute, std::string *value) {
+        ReadRequest request;
+        request.path = root + "/" + device.name + "/" + attribute;
+        request.device = device.name;
+        request.buf  = nullptr;
+        request.len  = ATTRIBUTE_BUF_SIZE;
+
+        stringRequests.push_back(request);
+        values.push_back(value);
+      };
+
+      for(size_t i = 0; i < devices.size(); ++i) {
+        Device &device = devices[i];
+        device.readable = true;
+        const unsigned char *buf = reinterpret_cast<const unsigned char *>(requests[i].buf);
+
+        if(requests[i].result < 0 ||
+           !parseDescriptors(buf, static_cast<size_t>(requests[i].result), device.desc)) {
+          device.readable = false;
+          continue;
+        }
+
+        if(device.desc.serialNumberIndex)
+          addString(device, "serial", &device.serialNumber);
+        if(device.desc.productIndex)
+          addString(device, "product", &device.product);
+        if(device.desc.manufacturerIndex)
+          addString(device, "manufacturer", &device.vendor);
+
+        addString(device, "speed", &device.speed);
+      }
+
+      std::vector<char> stringBuf(stringRequests.size() * ATTRIBUTE_BUF_SIZE);
+
+      for(size_t i = 0; i < stringRequests.size(); ++i)
+        stringRequests[i].buf = &stringBuf[i * ATTRIBUTE_BUF_SIZE];
+
+      readFiles(stringRequests);
+
+      for(size_t i = 0; i < stringRequests.size(); ++i)
+        attributeValue(stringRequests[i], *values[i]);
+    }
+
+    void countSyscalls(unsigned long count)
+    {
+      gSyscalls.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    unsigned long syscallCount()
+    {
+      return gSyscalls.load();
+    }
+  }
+}
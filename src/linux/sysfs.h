@@ -0,0 +1,107 @@
+#ifndef _USB_DRIVER_LINUX_SYSFS_H__
+#define _USB_DRIVER_LINUX_SYSFS_H__
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <sys/types.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// sysfs access
+////////////////////////////////////////////////////////////////////////////////
+namespace USBDriver
+{
+  namespace Sysfs
+  {
+    // Room for the device and first configuration descriptors of any
+    // real device. Longer files are truncated, which only loses trailing
+    // configurations.
+    static const size_t DESCRIPTORS_BUF_SIZE = 1024;
+    static const size_t ATTRIBUTE_BUF_SIZE = 256;
+
+    typedef struct DeviceDescriptor {
+      int usbVersion;          // bcdUSB, e.g. 0x0200.
+      int deviceClass;         // bDeviceClass.
+      int deviceSubClass;      // bDeviceSubClass.
+      int deviceProtocol;      // bDeviceProtocol.
+      int vendorID;            // idVendor.
+      int productID;           // idProduct.
+      int deviceVersion;       // bcdDevice.
+      int manufacturerIndex;   // iManufacturer, 0 if there is no string.
+      int productIndex;        // iProduct, 0 if there is no string.
+      int serialNumberIndex;   // iSerialNumber, 0 if there is no string.
+      int numConfigurations;   // bNumConfigurations.
+      int numInterfaces;       // bNumInterfaces of the first configuration.
+      bool massStorage;        // Any interface of class 0x08.
+    } DeviceDescriptor;
+
+    /**
+     * Parse the contents of a sysfs `descriptors` file: the device
+     * descriptor followed by the raw configuration descriptors.
+     */
+    bool parseDescriptors(const unsigned char *buf, size_t len, DeviceDescriptor &desc);
+
+    typedef struct Device {
+      std::string name;          // sysfs name, e.g. "1-2.4".
+      bool readable;             // False if the descriptors couldn't be read.
+      DeviceDescriptor desc;
+      std::string serialNumber;
+      std::string product;
+      std::string vendor;
+      std::string speed;         // Negotiated speed in Mbit/s, e.g. "480" or "1.5".
+    } Device;
+
+    /**
+     * Read and parse `<devicePath>/descriptors` with a single read.
+     */
+    bool readDescriptors(const std::string &devicePath, DeviceDescriptor &desc);
+
+    /**
+     * Read a text attribute, without the trailing newline. Returns false
+     * if the attribute does not exist or could not be read.
+     */
+    bool readAttribute(const std::string &devicePath, const char *name, std::string &value);
+
+    typedef struct ReadRequest {
+      std::string path;   // File to read.
+      std::string device; // Name of the device the file belongs to.
+      char *buf;          // Destination, owned by the caller.
+      size_t len;         // Size of buf.
+      ssize_t result;     // Bytes read, or -errno.
+    } ReadRequest;
+
+    /**
+     * Read a batch of files. Files kept open by the AttributeFdCache are
+     * re-read with a single pread(), the rest go through io_uring if it is
+     * enabled in options() and available, otherwise one after another.
+     */
+    void readFiles(std::vector<ReadRequest> &requests);
+
+    /**
+     * Same as readFiles(), never using io_uring.
+     */
+    void readFilesPlain(std::vector<ReadRequest> &requests);
+
+    /**
+     * Fill in the given devices below `root`: the descriptors of all of
+     * them in one readFiles() batch, then the string attributes they have
+     * in a second one.
+     */
+    void readDevices(const std::string &root, std::vector<Device> &devices);
+
+    /**
+     * Strip the trailing newline of a text attribute read through
+     * readFiles(). Returns false if the read failed.
+     */
+    bool attributeValue(const ReadRequest &request, std::string &value);
+
+    /**
+     * Number of open/read/close calls made through this module, used to
+     * measure the cost of enumeration. io_uring submissions count as one.
+     */
+    unsigned long syscallCount();
+    void countSyscalls(unsigned long count);
+  }
+}
+
+#endif // _USB_DRIVER_LINUX_SYSFS_H__
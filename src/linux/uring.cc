@@ -0,0 +1,377 @@
+#include "uring.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_OPENAT, _READ and _CLOSE arrived in 5.6, fast poll in 5.7
+#ifdef IORING_FEAT_FAST_POLL
+#define USB_DRIVER_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+// Files per submission. Batches larger than this are split.
+static const unsigned RING_ENTRIES = 256;
+// Result of a request that never completed
+static const long long NOT_COMPLETED = LLONG_MIN;
+
+namespace USBDriver
+{
+#ifdef USB_DRIVER_HAVE_IO_URING
+
+  static inline unsigned _loadAcquire(const unsigned *p)
+  {
+    return reinterpret_cast<const std::atomic<unsigned> *>(p)->load(std::memory_order_acquire);
+  }
+
+  static inline void _storeRelease(unsigned *p, unsigned value)
+  {
+    reinterpret_cast<std::atomic<unsigned> *>(p)->store(value, std::memory_order_release);
+  }
+
+  IOUring::IOUring()
+    : m_fd(-1), m_entries(0), m_unusable(false),
+      m_sqRing(MAP_FAILED), m_sqRingSize(0), m_sqHead(nullptr), m_sqTail(nullptr),
+      m_sqMask(nullptr), m_sqArray(nullptr), m_sqes(MAP_FAILED), m_sqesSize(0),
+      m_cqRing(MAP_FAILED), m_cqRingSize(0), m_cqHead(nullptr), m_cqTail(nullptr),
+      m_cqMask(nullptr), m_cqes(nullptr)
+  {
+  }
+
+  IOUring::~IOUring()
+  {
+    if(m_sqes != MAP_FAILED)
+      munmap(m_sqes, m_sqesSize);
+    if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+      munmap(m_cqRing, m_cqRingSize);
+    if(m_sqRing != MAP_FAILED)
+      munmap(m_sqRing, m_sqRingSize);
+    if(m_fd >= 0)
+      close(m_fd);
+  }
+
+  IOUring *IOUring::instance()
+  {
+    static IOUring *ring = []() -> IOUring * {
+      IOUring *ring = new IOUring;
+
+      if(!ring->setup(RING_ENTRIES)) {
+        delete ring;
+        return nullptr;
+      }
+
+      return ring;
+    }();
+
+    return ring;
+  }
+
+  bool IOUring::setup(unsigned entries)
+  {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+    if(m_fd < 0) {
+      CORE_WARNING("io_uring unavailable, using plain reads: " + std::string(strerror(errno)));
+      return false;
+    }
+
+    if(!(params.features & IORING_FEAT_FAST_POLL)) {
+      CORE_WARNING("io_uring lacks openat/read/close support, using plain reads");
+      return false;
+    }
+
+    m_entries = params.sq_entries;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      if(m_cqRingSize > m_sqRingSize)
+        m_sqRingSize = m_cqRingSize;
+      m_cqRingSize = m_sqRingSize;
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_fd, IORING_OFF_SQ_RING);
+
+    if(m_sqRing == MAP_FAILED)
+      return false;
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      m_cqRing = m_sqRing;
+    } else {
+      m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      m_fd, IORING_OFF_CQ_RING);
+
+      if(m_cqRing == MAP_FAILED)
+        return false;
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  m_fd, IORING_OFF_SQES);
+
+    if(m_sqes == MAP_FAILED)
+      return false;
+
+    char *sq = static_cast<char *>(m_sqRing);
+    char *cq = static_cast<char *>(m_cqRing);
+
+    m_sqHead  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sqMask  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    m_cqHead  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cqTail  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cqMask  = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes    = cq + params.cq_off.cqes;
+
+    return true;
+  }
+
+  unsigned IOUring::reapCompletions(long long *results)
+  {
+    unsigned head = *m_cqHead;
+    unsigned cqTail = _loadAcquire(m_cqTail);
+    unsigned reaped = 0;
+    struct io_uring_cqe *cqes = static_cast<struct io_uring_cqe *>(m_cqes);
+
+    for(; head != cqTail; ++head, ++reaped) {
+      struct io_uring_cqe &cqe = cqes[head & *m_cqMask];
+      results[cqe.user_data] = cqe.res;
+    }
+
+    _storeRelease(m_cqHead, head);
+
+    return reaped;
+  }
+
+  /**
+   * Submit the `count` SQEs prepared at the tail and wait for all of
+   * them. Results are stored by the user_data index of each SQE, those
+   * that never complete are left alone.
+   *
+   * On failure, the SQEs the kernel didn't take are taken back and those
+   * it took are waited for, so the ring is clean for the next call. If
+   * even that fails, the ring is marked unusable.
+   */
+  bool IOUring::submitAndWait(unsigned count, long long *results)
+  {
+    unsigned tail = *m_sqTail;
+
+    for(unsigned i = 0; i < count; ++i)
+      m_sqArray[(tail + i) & *m_sqMask] = (tail + i) & *m_sqMask;
+
+    _storeRelease(m_sqTail, tail + count);
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    while(completed < count) {
+      // The kernel doesn't wait when it took fewer SQEs than asked, the rest go with the next call
+      long ret = syscall(__NR_io_uring_enter, m_fd, count - submitted,
+                         count - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+      Sysfs::countSyscalls(1);
+
+      if(ret >= 0)
+        submitted += static_cast<unsigned>(ret);
+
+      completed += reapCompletions(results);
+
+      // Out of memory or a full completion queue, which reaping empties
+      bool retry = errno == EINTR || ((errno == EAGAIN || errno == EBUSY) && submitted > completed);
+
+      if(ret < 0 && !retry) {
+        CORE_ERROR("io_uring_enter() failed: " + std::string(strerror(errno)));
+        break;
+      }
+    }
+
+    if(completed == count)
+      return true;
+
+    _storeRelease(m_sqTail, tail + submitted);
+
+    while(completed < submitted) {
+      long ret = syscall(__NR_io_uring_enter, m_fd, 0, submitted - completed, IORING_ENTER_GETEVENTS,
+                         nullptr, 0);
+
+      Sysfs::countSyscalls(1);
+      completed += reapCompletions(results);
+
+      if(ret < 0 && errno != EINTR && completed < submitted) {
+        CORE_ERROR("Giving up on io_uring, requests are still running: " + std::string(strerror(errno)));
+        m_unusable = true;
+        break;
+      }
+    }
+
+    return false;
+  }
+
+  // Close the fds that opened, without the ring
+  static void _closeOpened(const long long *fds, unsigned count)
+  {
+    for(unsigned i = 0; i < count; ++i) {
+      if(fds[i] >= 0)
+        close(static_cast<int>(fds[i]));
+    }
+  }
+
+  bool IOUring::readFiles(Sysfs::ReadRequest *requests, size_t count, int *openFds)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(openFds != nullptr)
+      std::fill(openFds, openFds + count, -1);
+
+    if(m_unusable)
+      return false;
+
+    struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe *>(m_sqes);
+    std::vector<long long> fds(m_entries), reads(m_entries), closes(m_entries);
+
+    for(size_t offset = 0; offset < count; offset += m_entries) {
+      unsigned batch = static_cast<unsigned>(std::min<size_t>(m_entries, count - offset));
+      Sysfs::ReadRequest *chunk = requests + offset;
+
+      // Open everything
+      unsigned tail = *m_sqTail;
+
+      for(unsigned i = 0; i < batch; ++i) {
+        struct io_uring_sqe &sqe = sqes[(tail + i) & *m_sqMask];
+        memset(&sqe, 0, sizeof(sqe));
+
+        sqe.opcode      = IORING_OP_OPENAT;
+        sqe.fd          = AT_FDCWD;
+        sqe.addr        = reinterpret_cast<unsigned long>(chunk[i].path.c_str());
+        sqe.open_flags  = O_RDONLY | O_CLOEXEC;
+        sqe.user_data   = i;
+      }
+
+      std::fill(fds.begin(), fds.end(), NOT_COMPLETED);
+
+      if(!submitAndWait(batch, fds.data())) {
+        _closeOpened(fds.data(), batch);
+        return false;
+      }
+
+      // An old kernel rejects the opcode itself, let the caller fall back for good
+      if(fds[0] == -EINVAL) {
+        CORE_WARNING("io_uring can't open files, using plain reads");
+        _closeOpened(fds.data(), batch);
+        m_unusable = true;
+        return false;
+      }
+
+      // Read everything that opened
+      unsigned opened = 0;
+      tail = *m_sqTail;
+
+      for(unsigned i = 0; i < batch; ++i) {
+        if(fds[i] < 0) {
+          chunk[i].result = static_cast<ssize_t>(fds[i]);
+          continue;
+        }
+
+        struct io_uring_sqe &sqe = sqes[(tail + opened) & *m_sqMask];
+        memset(&sqe, 0, sizeof(sqe));
+
+        sqe.opcode    = IORING_OP_READ;
+        sqe.fd        = static_cast<int>(fds[i]);
+        sqe.addr      = reinterpret_cast<unsigned long>(chunk[i].buf);
+        sqe.len       = static_cast<unsigned>(chunk[i].len);
+        sqe.off       = 0;
+        sqe.user_data = i;
+
+        ++opened;
+      }
+
+      if(opened == 0)
+        continue;
+
+      std::fill(reads.begin(), reads.end(), NOT_COMPLETED);
+
+      if(!submitAndWait(opened, reads.data())) {
+        _closeOpened(fds.data(), batch);
+        return false;
+      }
+
+      // Close everything that opened, unless the caller keeps it
+      tail = *m_sqTail;
+      unsigned closing = 0;
+
+      for(unsigned i = 0; i < batch; ++i) {
+        if(fds[i] < 0)
+          continue;
+
+        chunk[i].result = static_cast<ssize_t>(reads[i]);
+
+        if(openFds != nullptr) {
+          openFds[offset + i] = static_cast<int>(fds[i]);
+          continue;
+        }
+
+        struct io_uring_sqe &sqe = sqes[(tail + closing) & *m_sqMask];
+        memset(&sqe, 0, sizeof(sqe));
+
+        sqe.opcode    = IORING_OP_CLOSE;
+        sqe.fd        = static_cast<int>(fds[i]);
+        sqe.user_data = i;
+
+        ++closing;
+      }
+
+      if(closing == 0)
+        continue;
+
+      std::fill(closes.begin(), closes.end(), NOT_COMPLETED);
+
+      if(!submitAndWait(closing, closes.data())) {
+        // Those the ring never closed
+        for(unsigned i = 0; i < batch; ++i) {
+          if(fds[i] >= 0 && closes[i] == NOT_COMPLETED)
+            close(static_cast<int>(fds[i]));
+        }
+
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+#else // No io_uring headers
+
+  IOUring *IOUring::instance()
+  {
+    return nullptr;
+  }
+
+  IOUring::~IOUring()
+  {
+  }
+
+  bool IOUring::readFiles(Sysfs::ReadRequest *, size_t, int *)
+  {
+    return false;
+  }
+
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef _USB_DRIVER_LINUX_URING_H__
+#define _USB_DRIVER_LINUX_URING_H__
+
+#include "sysfs.h"
+
+#include <mutex>
+#include <stddef.h>
+
+namespace USBDriver
+{
+  /**
+   * Minimal io_uring wrapper, talking to the kernel directly so there is
+   * no dependency on liburing. Files are read in three submissions per
+   * batch (all opens, all reads, all closes) instead of three syscalls
+   * per file.
+   */
+  class IOUring
+  {
+  public:
+    /**
+     * Get the shared ring, or nullptr if io_uring is unavailable because
+     * of an old kernel, a seccomp filter or a sysctl.
+     */
+    static IOUring *instance();
+
+    ~IOUring();
+
+    /**
+     * Read all requests. Returns false if the ring failed as a whole, in
+     * which case the caller should fall back to plain reads. A ring that
+     * failed in a way it can't recover from keeps returning false.
+     *
+     * With `openFds`, files are left open instead of closed, the caller
+     * owning the fd of each request there, -1 for those that didn't open,
+     * whatever is returned.
+     */
+    bool readFiles(Sysfs::ReadRequest *requests, size_t count, int *openFds = nullptr);
+
+  private:
+    IOUring();
+    IOUring(const IOUring &);
+    IOUring &operator=(const IOUring &);
+
+    bool setup(unsigned entries);
+    bool submitAndWait(unsigned count, long long *results);
+    unsigned reapCompletions(long long *results);
+
+    std::mutex m_mutex;
+    int m_fd;
+    unsigned m_entries;
+    bool m_unusable;          // Requests may still be running, or the kernel can't open files.
+
+    // Submission queue
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    unsigned *m_sqArray;
+    void *m_sqes;
+    size_t m_sqesSize;
+
+    // Completion queue
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    void *m_cqes;
+  };
+}
+
+#endif // _USB_DRIVER_LINUX_URING_H__
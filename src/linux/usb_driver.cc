@@ -0,0 +1,705 @@
+#include "../usb_driver.h"
+#include "../usb_common.h"
+#include "../usb_registry.h"
+#include "../timeline.h"
+#include "../volume_stats.h"
+#include "../utils.h"
+#include "fd_cache.h"
+#include "sysfs.h"
+#include "watcher.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+static const char *USB_DEVICES_PATH = "/sys/bus/usb/devices";
+static const char *BLOCK_DEVICES_PATH = "/sys/dev/block";
+static const char *MOUNTINFO_PATH = "/proc/self/mountinfo";
+static const char *DISK_BY_UUID_PATH = "/dev/disk/by-uuid";
+static const char *DISK_BY_LABEL_PATH = "/dev/disk/by-label";
+
+namespace USBDriver
+{
+  typedef struct MountEntry {
+    std::string mountPoint;
+    dev_t device;             // Mounted block device.
+  } MountEntry;
+
+  // USB device sysfs name (e.g. "1-2.4") to its mount
+  typedef std::unordered_map<std::string, MountEntry> MountMap;
+
+  typedef struct FilesystemInfo {
+    std::string uuid;
+    std::string label;
+  } FilesystemInfo;
+
+  // Block device to the file system it holds
+  typedef std::unordered_map<dev_t, FilesystemInfo> FilesystemMap;
+
+  typedef struct BusEntry {
+    std::string name;  // sysfs name, e.g. "1-2.4".
+    ino_t inode;       // kernfs inode, new whenever the device is re-enumerated.
+
+    bool operator<(const BusEntry &other) const { return name < other.name; }
+  } BusEntry;
+
+  typedef struct ScannedDevice {
+    ino_t inode;            // kernfs inode the attributes were read under.
+    bool changed;           // A hotplug event asked to read it again.
+    Sysfs::Device device;
+
+    ScannedDevice() : inode(0), changed(false) {}
+  } ScannedDevice;
+
+  // Result of the last full scan, returned while the bus doesn't change
+  static std::mutex gSnapshotMutex;
+  static uint64_t gSnapshotFingerprint = 0;
+  static std::vector<USBDevicePtr> gSnapshot;
+  // Attributes read by earlier scans, by sysfs name. They don't change
+  // until the device is re-enumerated, which gives it a new inode.
+  static std::unordered_map<std::string, ScannedDevice> gScanned;
+  // sysfs name of every registered device, by UID, to re-read it alone
+  static std::unordered_map<std::string, std::string> gDeviceNames;
+
+  /**
+   * Count changes to the mount table. The kernel flags an open
+   * mountinfo descriptor with POLLPRI whenever a mount is added or
+   * removed, so checking costs a single poll().
+   */
+  static unsigned long _mountGeneration()
+  {
+    static int fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    static unsigned long generation = 0;
+
+    // Can't tell, assume it changed
+    if(fd < 0)
+      return ++generation;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+
+    if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+      ++generation;
+
+    return generation;
+  }
+
+  /**
+   * Hash the sorted bus listing together with the mount generation, the
+   * volume capacity generation and the options changing what a scan reads.
+   * Re-plugging a device gives it a new inode even under the same name.
+   */
+  static uint64_t _busFingerprint(const std::vector<BusEntry> &entries, unsigned long mountGeneration,
+                                  bool filesystemInfo, bool capacityInfo, unsigned long capacityGeneration)
+  {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    auto mix = [&hash](const void *data, size_t len) {
+      const unsigned char *p = static_cast<const unsigned char *>(data);
+
+      for(size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+      }
+    };
+
+    for(auto &entry : entries) {
+      mix(entry.name.c_str(), entry.name.size() + 1);
+      mix(&entry.inode, sizeof(entry.inode));
+    }
+
+    mix(&mountGeneration, sizeof(mountGeneration));
+    mix(&filesystemInfo, sizeof(filesystemInfo));
+    mix(&capacityInfo, sizeof(capacityInfo));
+    mix(&capacityGeneration, sizeof(capacityGeneration));
+
+    return hash;
+  }
+
+  /**
+   * Build a location ID the way IOKit does: the bus number in the top
+   * byte followed by one nibble per hub port, read from the sysfs
+   * device name "<bus>-<port>.<port>...".
+   */
+  static int _locationIDFromName(const char *name)
+  {
+    char *end;
+    unsigned long bus = strtoul(name, &end, 10);
+    unsigned int locationID = static_cast<unsigned int>(bus & 0xff) << 24;
+    int shift = 20;
+
+    if(*end != '-')
+      return static_cast<int>(locationID);
+
+    do {
+      unsigned long port = strtoul(end + 1, &end, 10);
+
+      if(shift >= 0) {
+        locationID |= static_cast<unsigned int>(port & 0xf) << shift;
+        shift -= 4;
+      }
+    } while(*end == '.');
+
+    return static_cast<int>(locationID);
+  }
+
+  // True for "<bus>-<ports>:<config>.<interface>"
+  static bool _isInterfaceName(const std::string &component)
+  {
+    size_t colon = component.find(':');
+
+    return colon != std::string::npos && colon > 0 &&
+      component.find('-') < colon && component.find('.', colon) != std::string::npos;
+  }
+
+  /**
+   * Find the USB device a block device belongs to, from its sysfs path:
+   * .../usb1/1-2/1-2:1.0/host2/target2:0:0/2:0:0:0/block/sdb/sdb1
+   */
+  static std::string _usbNameFromBlockPath(const std::string &path)
+  {
+    std::string previous;
+    size_t start = 0;
+
+    while(start < path.size()) {
+      size_t end = path.find('/', start);
+
+      if(end == std::string::npos)
+        end = path.size();
+
+      std::string component = path.substr(start, end - start);
+
+      if(_isInterfaceName(component))
+        return previous;
+
+      previous = component;
+      start = end + 1;
+    }
+
+    return "";
+  }
+
+  // Undo the octal escaping of spaces, tabs and newlines in mountinfo
+  static std::string _unescapeMountPath(const char *path)
+  {
+    std::string unescaped;
+
+    for(const char *p = path; *p != '\0'; ++p) {
+      if(p[0] == '\\' && p[1] >= '0' && p[1] <= '7' && p[2] >= '0' && p[2] <= '7' &&
+         p[3] >= '0' && p[3] <= '7') {
+        unescaped.push_back(static_cast<char>((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0')));
+        p += 3;
+      } else {
+        unescaped.push_back(*p);
+      }
+    }
+
+    return unescaped;
+  }
+
+  /**
+   * Map every mounted block device to the USB device it lives on. The
+   * mount table already carries the device numbers, so only mounted
+   * block devices need a readlink.
+   */
+  static MountMap _usbMounts()
+  {
+    CORE_TRACE_SCOPE("enumeration", "_usbMounts");
+
+    MountMap mounts;
+    FILE *mountinfo = fopen(MOUNTINFO_PATH, "re");
+
+    if(mountinfo == NULL) {
+      CORE_ERROR("Failed to open " + std::string(MOUNTINFO_PATH) + ": " + strerror(errno));
+      return mounts;
+    }
+
+    char *line = NULL;
+    size_t lineLen = 0;
+
+    while(getline(&line, &lineLen, mountinfo) != -1) {
+      unsigned int major, minor;
+      char mountPoint[PATH_MAX];
+
+      // <id> <parent> <major>:<minor> <root> <mount point> ...
+      if(sscanf(line, "%*d %*d %u:%u %*s %4095s", &major, &minor, mountPoint) != 3)
+        continue;
+
+      // Virtual file systems
+      if(major == 0)
+        continue;
+
+      char linkPath[64];
+      char target[PATH_MAX];
+
+      snprintf(linkPath, sizeof(linkPath), "%s/%u:%u", BLOCK_DEVICES_PATH, major, minor);
+
+      ssize_t n = readlink(linkPath, target, sizeof(target) - 1);
+
+      if(n < 0)
+        continue;
+
+      target[n] = '\0';
+
+      std::string name = _usbNameFromBlockPath(target);
+
+      // Not on USB, or a device with several mounted partitions we already have
+      if(name.empty() || mounts.count(name))
+        continue;
+
+      MountEntry &mount = mounts[name];
+
+      mount.mountPoint = _unescapeMountPath(mountPoint);
+      mount.device = makedev(major, minor);
+    }
+
+    free(line);
+    fclose(mountinfo);
+
+    return mounts;
+  }
+
+  // Undo udev's "\x20" escaping of the names in /dev/disk
+  static std::string _unescapeDiskLink(const char *name)
+  {
+    std::string unescaped;
+
+    for(const char *p = name; *p != '\0'; ++p) {
+      if(p[0] == '\\' && p[1] == 'x' && isxdigit(p[2]) && isxdigit(p[3])) {
+        char hex[3] = { p[2], p[3], '\0' };
+
+        unescaped.push_back(static_cast<char>(strtoul(hex, NULL, 16)));
+        p += 3;
+      } else {
+        unescaped.push_back(*p);
+      }
+    }
+
+    return unescaped;
+  }
+
+  static void _indexDiskLinks(const char *path, FilesystemMap &filesystems, std::string FilesystemInfo::*field)
+  {
+    DIR *dir = opendir(path);
+
+    // No file system carries a UUID or label
+    if(dir == NULL)
+      return;
+
+    struct dirent *entry;
+
+    while((entry = readdir(dir)) != NULL) {
+      struct stat st;
+
+      if(entry->d_name[0] == '.')
+        continue;
+
+      if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISBLK(st.st_mode))
+        continue;
+
+      filesystems[st.st_rdev].*field = _unescapeDiskLink(entry->d_name);
+    }
+
+    closedir(dir);
+  }
+
+  /**
+   * Index the UUID and label of every block device in one pass over the
+   * links udev maintains, instead of probing each mounted device.
+   */
+  static FilesystemMap _filesystems()
+  {
+    CORE_TRACE_SCOPE("enumeration", "_filesystems");
+
+    FilesystemMap filesystems;
+
+    _indexDiskLinks(DISK_BY_UUID_PATH, filesystems, &FilesystemInfo::uuid);
+    _indexDiskLinks(DISK_BY_LABEL_PATH, filesystems, &FilesystemInfo::label);
+
+    return filesystems;
+  }
+
+  static USBDevicePtr _deviceRecord(const Sysfs::Device &device, const MountMap &mounts,
+                                    const FilesystemMap &filesystems)
+  {
+    const Sysfs::DeviceDescriptor &desc = device.desc;
+
+    USBDevicePtr usbInfo(new USBDevice);
+
+    usbInfo->locationID   = _locationIDFromName(device.name.c_str());
+    usbInfo->vendorID     = desc.vendorID;
+    usbInfo->productID    = desc.productID;
+    usbInfo->serialNumber = device.serialNumber;
+    usbInfo->product      = device.product;
+    usbInfo->vendor       = device.vendor;
+    usbInfo->speed        = strtod(device.speed.c_str(), NULL);
+
+    // "<bus>-<port path>"
+    size_t dash = device.name.find('-');
+
+    if(dash != std::string::npos) {
+      usbInfo->busNumber = atoi(device.name.c_str());
+      usbInfo->portPath  = device.name.substr(dash + 1);
+    }
+
+    auto mount = mounts.find(device.name);
+
+    if(mount != mounts.end()) {
+      usbInfo->mountPoint = mount->second.mountPoint;
+
+      auto filesystem = filesystems.find(mount->second.device);
+
+      if(filesystem != filesystems.end()) {
+        usbInfo->filesystemUUID  = filesystem->second.uuid;
+        usbInfo->filesystemLabel = filesystem->second.label;
+      }
+    }
+
+    return usbInfo;
+  }
+
+  static USBDevicePtr _registerDevice(USBDevicePtr usbInfo, const Sysfs::Device &device)
+  {
+    USBDevicePtr previous = DeviceRegistry::instance().findAttached(usbInfo->locationID, usbInfo->vendorID,
+                                                                    usbInfo->productID, device.serialNumber);
+
+    if(previous == nullptr)
+      CORE_DEBUG("USB device not found, creating a new one...");
+
+    usbInfo = mergeDevice(previous, usbInfo);
+
+    DeviceRegistry::instance().insert(usbInfo);
+    gDeviceNames[usbInfo->uid] = device.name;
+
+    return usbInfo;
+  }
+
+  std::vector<USBDevicePtr> enumerateDevices()
+  {
+    CORE_TRACE_SCOPE("enumeration", "enumerateDevices");
+
+    std::vector<USBDevicePtr> devices;
+
+    DIR *dir = opendir(USB_DEVICES_PATH);
+
+    if(dir == NULL) {
+      CORE_ERROR("Failed to open " + std::string(USB_DEVICES_PATH) + ": " + strerror(errno));
+      return devices;
+    }
+
+    std::vector<BusEntry> busEntries;
+    struct dirent *entry;
+
+    while((entry = readdir(dir)) != NULL) {
+      const char *name = entry->d_name;
+
+      // Skip ".", "..", interfaces ("1-2:1.0") and root hubs ("usb1")
+      if(name[0] < '0' || name[0] > '9' || strchr(name, ':') != NULL)
+        continue;
+
+      BusEntry busEntry;
+      busEntry.name = name;
+      busEntry.inode = entry->d_ino;
+
+      busEntries.push_back(busEntry);
+    }
+
+    closedir(dir);
+
+    std::sort(busEntries.begin(), busEntries.end());
+
+    std::lock_guard<std::mutex> lock(gSnapshotMutex);
+
+    unsigned long mountGeneration = _mountGeneration();
+    bool filesystemInfo = options().filesystemInfo;
+    bool capacityInfo = options().capacityInfo;
+    unsigned long capacityGeneration = 0;
+
+    // Volumes of the last scan, to notice their capacity changing
+    if(capacityInfo) {
+      std::vector<std::string> mountPoints;
+
+      for(auto &device : gSnapshot) {
+        if(!device->mountPoint.empty())
+          mountPoints.push_back(device->mountPoint.str());
+      }
+
+      capacityGeneration = VolumeStats::instance().refresh(mountPoints);
+    }
+
+    // Nothing was plugged, unplugged, mounted, unmounted or written since the last scan
+    uint64_t fingerprint = _busFingerprint(busEntries, mountGeneration, filesystemInfo, capacityInfo,
+                                           capacityGeneration);
+
+    if(fingerprint == gSnapshotFingerprint) {
+      CORE_DEBUG("Bus fingerprint unchanged, returning the previous scan");
+
+      // Verified as current without reading them
+      DeviceRegistry::instance().touch();
+
+      return gSnapshot;
+    }
+
+    CORE_TRACE_SCOPE("enumeration", "fullScan");
+
+    ++stats().scans;
+
+    // Only new, re-enumerated or invalidated devices are read
+    std::vector<Sysfs::Device> sysfsDevices;
+    std::vector<ino_t> inodes;
+    std::unordered_set<std::string> names;
+
+    AttributeFdCache &fdCache = AttributeFdCache::instance();
+
+    for(auto &busEntry : busEntries) {
+      names.insert(busEntry.name);
+
+      auto scanned = gScanned.find(busEntry.name);
+
+      if(scanned != gScanned.end() && scanned->second.inode == busEntry.inode && !scanned->second.changed)
+        continue;
+
+      // Re-enumerated, the cached descriptors are those of the previous device
+      if(scanned != gScanned.end() && scanned->second.inode != busEntry.inode)
+        fdCache.invalidateDevice(busEntry.name);
+
+      Sysfs::Device device;
+      device.name = busEntry.name;
+
+      sysfsDevices.push_back(device);
+      inodes.push_back(busEntry.inode);
+    }
+
+    // Drop descriptors of unplugged devices before reading through them
+    if(options().attributeFdBudget > 0) {
+      fdCache.beginPoll();
+      fdCache.retainDevices(names);
+    } else {
+      fdCache.clear();
+    }
+
+    MountMap mounts = _usbMounts();
+    FilesystemMap filesystems;
+
+    // Only when asked for, and only if something is mounted
+    if(filesystemInfo && !mounts.empty())
+      filesystems = _filesystems();
+
+    Sysfs::readDevices(USB_DEVICES_PATH, sysfsDevices);
+
+    stats().deviceReads += sysfsDevices.size();
+
+    for(size_t i = 0; i < sysfsDevices.size(); ++i) {
+      // Try again next time
+      if(!sysfsDevices[i].readable) {
+        gScanned.erase(sysfsDevices[i].name);
+        continue;
+      }
+
+      ScannedDevice &scanned = gScanned[sysfsDevices[i].name];
+
+      scanned.inode = inodes[i];
+      scanned.changed = false;
+      scanned.device = sysfsDevices[i];
+    }
+
+    for(auto it = gScanned.begin(); it != gScanned.end();) {
+      if(names.count(it->first))
+        ++it;
+      else
+        it = gScanned.erase(it);
+    }
+
+    std::vector<USBDevicePtr> records;
+    std::vector<const Sysfs::Device *> sources;
+
+    for(auto &busEntry : busEntries) {
+      auto scanned = gScanned.find(busEntry.name);
+
+      if(scanned == gScanned.end()) {
+        CORE_ERROR("Failed to read descriptors of " + busEntry.name);
+        continue;
+      }
+
+      records.push_back(_deviceRecord(scanned->second.device, mounts, filesystems));
+      sources.push_back(&scanned->second.device);
+    }
+
+    // Mostly cached by the check above, only new mounts are probed
+    if(capacityInfo) {
+      VolumeStats::instance().fill(records);
+      capacityGeneration = VolumeStats::instance().generation();
+    }
+
+    gDeviceNames.clear();
+
+    DeviceRegistry::instance().beginUpdate();
+
+    for(size_t i = 0; i < records.size(); ++i) {
+      CORE_TRACE_SCOPE("enumeration", "_registerDevice");
+
+      devices.push_back(_registerDevice(records[i], *sources[i]));
+    }
+
+    // Forget about everything that is no longer attached
+    DeviceRegistry::instance().endUpdate();
+
+    gSnapshotFingerprint = _busFingerprint(busEntries, mountGeneration, filesystemInfo, capacityInfo,
+                                           capacityGeneration);
+    gSnapshot = devices;
+
+    return devices;
+  }
+
+  USBDevicePtr readDevice(const USBDevicePtr &device)
+  {
+    std::lock_guard<std::mutex> lock(gSnapshotMutex);
+
+    auto name = gDeviceNames.find(device->uid);
+
+    // Not from a scan of ours, e.g. registered by the shared table
+    if(name == gDeviceNames.end())
+      return device;
+
+    Sysfs::Device sysfsDevice;
+    sysfsDevice.name = name->second;
+    sysfsDevice.readable = false;
+
+    // Same inode as the bus listing, which doesn't follow the links either
+    std::string path = std::string(USB_DEVICES_PATH) + "/" + sysfsDevice.name;
+    struct stat st;
+    bool attached = lstat(path.c_str(), &st) == 0;
+    auto previous = gScanned.find(sysfsDevice.name);
+
+    // Unplugged or re-enumerated, don't read through the old descriptors
+    if(!attached || (previous != gScanned.end() && previous->second.inode != st.st_ino))
+      AttributeFdCache::instance().invalidateDevice(sysfsDevice.name);
+
+    std::vector<Sysfs::Device> sysfsDevices(1, sysfsDevice);
+
+    if(attached) {
+      Sysfs::readDevices(USB_DEVICES_PATH, sysfsDevices);
+      ++stats().deviceReads;
+    }
+
+    USBDevicePtr fresh;
+
+    if(sysfsDevices[0].readable) {
+      MountMap mounts = _usbMounts();
+      FilesystemMap filesystems;
+
+      if(options().filesystemInfo && mounts.count(sysfsDevice.name))
+        filesystems = _filesystems();
+
+      fresh = _deviceRecord(sysfsDevices[0], mounts, filesystems);
+
+      if(options().capacityInfo) {
+        std::vector<USBDevicePtr> records(1, fresh);
+        VolumeStats::instance().fill(records);
+      }
+    }
+
+    USBDevicePtr current = updateDevice(device, fresh);
+
+    if(current == nullptr) {
+      // Let the next poll find out what happened to the port
+      gDeviceNames.erase(name);
+      gScanned.erase(sysfsDevice.name);
+      gSnapshotFingerprint = 0;
+
+      return nullptr;
+    }
+
+    ScannedDevice &scanned = gScanned[sysfsDevice.name];
+
+    scanned.inode = st.st_ino;
+    scanned.changed = false;
+    scanned.device = sysfsDevices[0];
+
+    // Polls keep returning the snapshot while the bus doesn't change
+    std::replace(gSnapshot.begin(), gSnapshot.end(), device, current);
+
+    return current;
+  }
+
+  /**
+   * Make the next poll rescan, re-reading the given device (a sysfs name)
+   * even if its inode didn't change. Empty to only rescan. A device still
+   * on the bus is re-read through its cached descriptors, scans drop
+   * those of removed and re-enumerated devices.
+   */
+  static void _invalidateDevice(const std::string &device)
+  {
+    std::lock_guard<std::mutex> lock(gSnapshotMutex);
+
+    gSnapshotFingerprint = 0;
+
+    auto scanned = gScanned.find(device);
+
+    // Kept, so the next scan still sees if it was re-enumerated
+    if(scanned != gScanned.end())
+      scanned->second.changed = true;
+  }
+
+  void invalidateDevices()
+  {
+    _invalidateDevice("");
+  }
+
+  const char *watchDevices(const std::function<void()> &onEvent)
+  {
+    return HotplugWatcher::instance().start([onEvent](const std::string &device) {
+        ++stats().watcherEvents;
+
+        if(TimelineRecorder::instance().isRecording())
+          TimelineRecorder::instance().recordEvent(device);
+
+        _invalidateDevice(device);
+        onEvent();
+      });
+  }
+
+  void unwatchDevices()
+  {
+    HotplugWatcher::instance().stop();
+  }
+
+  bool unmount(const std::string &uid)
+  {
+    USBDevicePtr usbInfo = getDevice(uid);
+
+    // Only unmount if we're actually mounted
+    if(usbInfo == nullptr || usbInfo->mountPoint.empty())
+      return false;
+
+    if(umount2(usbInfo->mountPoint.c_str(), 0) != 0) {
+      CORE_ERROR("Failed to unmount " + std::string(usbInfo->mountPoint.c_str()) + ": " +
+                 strerror(errno));
+      return false;
+    }
+
+    // Pick up the unmount, and any other partition still mounted
+    refreshDevice(uid);
+
+    return true;
+  }
+}
@@ -0,0 +1,406 @@
+#include "watcher.h"
+#include "../utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+static const char *BUS_USB_PATH = "/dev/bus/usb";
+static const char *CHAR_DEVICES_PATH = "/sys/dev/char";
+static const char *DISK_LINK_PATHS[] = { "/dev/disk/by-id", "/dev/disk/by-path" };
+static const char *UID_MAP_PATH = "/proc/self/uid_map";
+
+// Major number of the /dev/bus/usb device nodes
+static const int USB_DEVICE_MAJOR = 189;
+// The kernel's uevent multicast group, as opposed to udev's
+static const unsigned int UEVENT_KERNEL_GROUP = 1;
+
+namespace USBDriver
+{
+  /**
+   * The kernel only broadcasts uevents to network namespaces owned by the
+   * initial user namespace. Elsewhere the socket opens fine but stays silent.
+   */
+  static bool _inInitialUserNamespace()
+  {
+    FILE *uidMap = fopen(UID_MAP_PATH, "re");
+
+    // Kernels without user namespaces
+    if(uidMap == NULL)
+      return true;
+
+    unsigned long inside, outside, count;
+    int fields = fscanf(uidMap, "%lu %lu %lu", &inside, &outside, &count);
+    bool initial = fields == 3 && inside == 0 && outside == 0 && count == 4294967295UL;
+
+    // A second range means a user namespace as well
+    if(initial && fscanf(uidMap, "%lu", &inside) == 1)
+      initial = false;
+
+    fclose(uidMap);
+
+    return initial;
+  }
+
+  // "../../devices/pci0000:00/0000:00:14.0/usb1/1-2" -> "1-2"
+  static std::string _deviceNameFromNode(int bus, int address)
+  {
+    char linkPath[64];
+    char target[PATH_MAX];
+
+    snprintf(linkPath, sizeof(linkPath), "%s/%d:%d", CHAR_DEVICES_PATH, USB_DEVICE_MAJOR,
+             (bus - 1) * 128 + (address - 1));
+
+    ssize_t n = readlink(linkPath, target, sizeof(target) - 1);
+
+    if(n < 0)
+      return "";
+
+    target[n] = '\0';
+
+    const char *name = strrchr(target, '/');
+
+    return name != NULL ? name + 1 : target;
+  }
+
+  HotplugWatcher::HotplugWatcher()
+    : m_source("poll"), m_fd(-1), m_stopFd(-1), m_busRootWatch(-1)
+  {
+  }
+
+  HotplugWatcher::~HotplugWatcher()
+  {
+    stop();
+  }
+
+  const char *HotplugWatcher::start(const EventCallback &onEvent)
+  {
+    return start(onEvent, -1);
+  }
+
+  const char *HotplugWatcher::start(const EventCallback &onEvent, int sourceFd)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_fd >= 0) {
+      if(sourceFd >= 0)
+        close(sourceFd);
+
+      return m_source;
+    }
+
+    m_stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if(m_stopFd < 0) {
+      CORE_WARNING("eventfd() failed, not watching for hotplug events: " + std::string(strerror(errno)));
+
+      if(sourceFd >= 0)
+        close(sourceFd);
+
+      return m_source = "poll";
+    }
+
+    if(sourceFd >= 0 && openSource(sourceFd)) {
+      m_source = "injected";
+    } else if(sourceFd < 0 && openNetlink()) {
+      m_source = "netlink";
+    } else if(sourceFd < 0 && openInotify()) {
+      m_source = "inotify";
+    } else {
+      close(m_stopFd);
+      m_stopFd = -1;
+
+      return m_source = "poll";
+    }
+
+    CORE_INFO("Watching for hotplug events through " + std::string(m_source));
+
+    m_onEvent = onEvent;
+    m_thread = std::thread(&HotplugWatcher::run, this);
+
+    return m_source;
+  }
+
+  void HotplugWatcher::stop()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_fd < 0)
+      return;
+
+    uint64_t one = 1;
+
+    if(write(m_stopFd, &one, sizeof(one)) != sizeof(one))
+      CORE_ERROR("Failed to signal the hotplug watcher: " + std::string(strerror(errno)));
+
+    m_thread.join();
+
+    close(m_fd);
+    close(m_stopFd);
+
+    m_fd = -1;
+    m_stopFd = -1;
+    m_busRootWatch = -1;
+    m_busWatches.clear();
+    m_onEvent = nullptr;
+    m_source = "poll";
+  }
+
+  bool HotplugWatcher::openNetlink()
+  {
+    if(!_inInitialUserNamespace()) {
+      CORE_INFO("Running in a user namespace, kernel uevents are not delivered");
+      return false;
+    }
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+
+    if(fd < 0) {
+      CORE_INFO("uevent socket unavailable: " + std::string(strerror(errno)));
+      return false;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_KERNEL_GROUP;
+
+    if(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+      CORE_INFO("Failed to bind the uevent socket: " + std::string(strerror(errno)));
+      close(fd);
+      return false;
+    }
+
+    m_fd = fd;
+
+    return true;
+  }
+
+  bool HotplugWatcher::openSource(int sourceFd)
+  {
+    int flags = fcntl(sourceFd, F_GETFL);
+
+    // Reads drain the source until it would block
+    if(flags < 0 || fcntl(sourceFd, F_SETFL, flags | O_NONBLOCK) != 0) {
+      CORE_ERROR("Failed to use the injected event source: " + std::string(strerror(errno)));
+      close(sourceFd);
+      return false;
+    }
+
+    m_fd = sourceFd;
+
+    return true;
+  }
+
+  bool HotplugWatcher::openInotify()
+  {
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+    if(fd < 0) {
+      CORE_INFO("inotify unavailable: " + std::string(strerror(errno)));
+      return false;
+    }
+
+    // Device nodes live in one directory per bus, new buses are rare
+    m_busRootWatch = inotify_add_watch(fd, BUS_USB_PATH, IN_CREATE | IN_ONLYDIR);
+
+    if(m_busRootWatch < 0) {
+      CORE_INFO("Can't watch " + std::string(BUS_USB_PATH) + ": " + strerror(errno));
+      close(fd);
+      return false;
+    }
+
+    m_fd = fd;
+
+    DIR *dir = opendir(BUS_USB_PATH);
+
+    if(dir != NULL) {
+      struct dirent *entry;
+
+      while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] != '.')
+          addBusWatch(entry->d_name);
+      }
+
+      closedir(dir);
+    }
+
+    // Partitions showing up, to notice mounts that follow quickly
+    for(const char *path : DISK_LINK_PATHS)
+      inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+
+    return true;
+  }
+
+  void HotplugWatcher::addBusWatch(const std::string &name)
+  {
+    int bus = atoi(name.c_str());
+
+    if(bus <= 0)
+      return;
+
+    std::string path = std::string(BUS_USB_PATH) + "/" + name;
+    int watch = inotify_add_watch(m_fd, path.c_str(), IN_CREATE | IN_DELETE | IN_ONLYDIR);
+
+    if(watch < 0) {
+      CORE_WARNING("Can't watch " + path + ": " + strerror(errno));
+      return;
+    }
+
+    m_busWatches[watch] = bus;
+  }
+
+  void HotplugWatcher::run()
+  {
+    struct pollfd fds[2];
+
+    fds[0].fd = m_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopFd;
+    fds[1].events = POLLIN;
+
+    while(true) {
+      fds[0].revents = 0;
+      fds[1].revents = 0;
+
+      if(::poll(fds, 2, -1) < 0) {
+        if(errno == EINTR)
+          continue;
+
+        CORE_ERROR("Hotplug watcher poll() failed: " + std::string(strerror(errno)));
+        return;
+      }
+
+      if(fds[1].revents)
+        return;
+
+      if(fds[0].revents & POLLIN) {
+        if(strcmp(m_source, "inotify") == 0)
+          readInotify();
+        else
+          readUevents();
+      }
+    }
+  }
+
+  void HotplugWatcher::readUevents()
+  {
+    bool kernel = strcmp(m_source, "netlink") == 0;
+    char buf[8192];
+    struct sockaddr_nl sender;
+    socklen_t senderLen = sizeof(sender);
+    ssize_t len;
+
+    while((len = recvfrom(m_fd, buf, sizeof(buf) - 1, 0,
+                          reinterpret_cast<struct sockaddr *>(&sender), &senderLen)) > 0) {
+      std::string device;
+
+      buf[len] = '\0';
+      senderLen = sizeof(sender);
+
+      // Only trust the kernel
+      if(kernel && sender.nl_pid != 0)
+        continue;
+
+      if(parseUevent(buf, static_cast<size_t>(len), device))
+        m_onEvent(device);
+    }
+
+    // A burst overflowed the socket buffer, something changed anyway
+    if(len < 0 && errno == ENOBUFS)
+      m_onEvent("");
+  }
+
+  bool HotplugWatcher::parseUevent(const char *msg, size_t len, std::string &device)
+  {
+    // "<action>@<devpath>\0KEY=value\0KEY=value..."
+    const char *end = msg + len;
+    const char *devPath = NULL;
+    const char *subsystem = NULL;
+    const char *devType = NULL;
+
+    // Messages relayed by udev carry a binary header instead
+    if(memchr(msg, '@', strnlen(msg, len)) == NULL)
+      return false;
+
+    for(const char *p = msg + strnlen(msg, len) + 1; p < end; p += strnlen(p, end - p) + 1) {
+      if(strncmp(p, "DEVPATH=", 8) == 0)
+        devPath = p + 8;
+      else if(strncmp(p, "SUBSYSTEM=", 10) == 0)
+        subsystem = p + 10;
+      else if(strncmp(p, "DEVTYPE=", 8) == 0)
+        devType = p + 8;
+    }
+
+    if(subsystem == NULL)
+      return false;
+
+    if(strcmp(subsystem, "block") == 0) {
+      device.clear();
+      return true;
+    }
+
+    // Interfaces come and go together with their device
+    if(strcmp(subsystem, "usb") != 0 || devType == NULL || strcmp(devType, "usb_device") != 0)
+      return false;
+
+    const char *name = devPath != NULL ? strrchr(devPath, '/') : NULL;
+
+    if(name != NULL)
+      device = name + 1;
+    else
+      device.clear();
+
+    return true;
+  }
+
+  void HotplugWatcher::readInotify()
+  {
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+
+    while((len = read(m_fd, buf, sizeof(buf))) > 0) {
+      for(char *p = buf; p < buf + len;) {
+        const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+        p += sizeof(struct inotify_event) + event->len;
+
+        if(event->mask & IN_Q_OVERFLOW) {
+          m_onEvent("");
+          continue;
+        }
+
+        if(event->mask & IN_IGNORED) {
+          m_busWatches.erase(event->wd);
+          continue;
+        }
+
+        if(event->wd == m_busRootWatch) {
+          if(event->len > 0)
+            addBusWatch(event->name);
+
+          continue;
+        }
+
+        auto bus = m_busWatches.find(event->wd);
+
+        // A new device node is named after its address on the bus
+        if(bus != m_busWatches.end() && (event->mask & IN_CREATE) && event->len > 0)
+          m_onEvent(_deviceNameFromNode(bus->second, atoi(event->name)));
+        else
+          m_onEvent("");
+      }
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef _USB_DRIVER_LINUX_WATCHER_H__
+#define _USB_DRIVER_LINUX_WATCHER_H__
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace USBDriver
+{
+  /**
+   * Reports USB hotplug events from a background thread, so that the poll
+   * scheduler can react right away instead of waiting for its next poll.
+   *
+   * Kernel uevents are used when they can be received. Unprivileged
+   * containers, whose user namespace never gets uevents, fall back to
+   * inotify on the device nodes in /dev/bus/usb and the links in
+   * /dev/disk.
+   */
+  class HotplugWatcher
+  {
+  public:
+    /**
+     * Called with the sysfs name of the USB device that changed (e.g.
+     * "1-2.4"), or an empty string if it is not known, e.g. for a removed
+     * device or a new partition.
+     */
+    typedef std::function<void(const std::string &device)> EventCallback;
+
+    static HotplugWatcher &instance()
+    {
+      static HotplugWatcher instance;
+      return instance;
+    }
+
+    ~HotplugWatcher();
+
+    /**
+     * Start watching. Returns the event source in use: "netlink",
+     * "inotify", or "poll" if neither is available.
+     */
+    const char *start(const EventCallback &onEvent);
+    /**
+     * Start watching messages in the kernel uevent format read from
+     * `sourceFd`, e.g. one end of a socketpair, instead of the system's
+     * events. Used to benchmark and replay hotplug events. Takes ownership
+     * of `sourceFd`. Returns "injected".
+     */
+    const char *start(const EventCallback &onEvent, int sourceFd);
+    void stop();
+
+    /**
+     * Parse a kernel uevent message. Returns false for events that don't
+     * concern USB devices or block devices.
+     */
+    static bool parseUevent(const char *msg, size_t len, std::string &device);
+
+  private:
+    HotplugWatcher();
+    HotplugWatcher(const HotplugWatcher &);
+    HotplugWatcher &operator=(const HotplugWatcher &);
+
+    bool openNetlink();
+    bool openSource(int sourceFd);
+    bool openInotify();
+    void addBusWatch(const std::string &name);
+
+    void run();
+    void readUevents();
+    void readInotify();
+
+    std::mutex m_mutex;
+    std::thread m_thread;
+    EventCallback m_onEvent;
+    const char *m_source;
+    int m_fd;
+    int m_stopFd;
+    int m_busRootWatch;
+    std::unordered_map<int, int> m_busWatches;   // inotify watch to bus number.
+  };
+}
+
+#endif // _USB_DRIVER_LINUX_WATCHER_H__
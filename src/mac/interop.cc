@@ -6,7 +6,8 @@ char *cfStringRefToCString(CFStringRef cfString)
 {
   if (!cfString) return "";
 
-  static char string[2048];
+  // Per thread, devices are read in parallel
+  static thread_local char string[2048];
 
   string[0] = '\0';
   CFStringGetCString(cfString,
@@ -25,8 +26,11 @@ char *cfTypeToCString(CFTypeRef cfString)
 
   // Attempt to convert it to a string
   CFStringRef stringRef = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@"), cfString);
+  char *str = cfStringRefToCString(stringRef);
 
-  return cfStringRefToCString(stringRef);
+  CFRelease(stringRef);
+
+  return str;
 }
 
 int cfTypeToInteger(CFTypeRef cfNumber)
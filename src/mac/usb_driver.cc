@@ -1,10 +1,14 @@
 #include "../usb_driver.h"
 #include "../usb_common.h"
+#include "../usb_registry.h"
+#include "../volume_stats.h"
 #include "../utils.h"
+#include "../utils/work_pool.h"
 #include "interop.h"
 
 #include <sys/param.h>
 
+#include <mutex>
 #include <stdio.h>
 
 #include <mach/mach_error.h>
@@ -18,8 +22,6 @@
 
 #include <DiskArbitration/DiskArbitration.h>
 
-#include <unordered_map>
-
 
 // The current OSX version
 const auto CURRENT_SUPPORTED_VERSION = __MAC_OS_X_VERSION_MAX_ALLOWED;
@@ -27,14 +29,11 @@ const auto CURRENT_SUPPORTED_VERSION = __MAC_OS_X_VERSION_MAX_ALLOWED;
 const auto EL_CAPITAN = 101100;
 // IOUSBDevice has become IOUSBHostDevice in El Capitan
 const char *SERVICE_MATCHER = CURRENT_SUPPORTED_VERSION < EL_CAPITAN ? "IOUSBDevice" : "IOUSBHostDevice";
+// Devices whose properties are read at once
+const size_t MAX_EXTRACTION_THREADS = 8;
 
 namespace USBDriver
 {
-  typedef std::unordered_map<std::string, USBDevicePtr> DeviceMap;
-
-  // TODO: Remove me!
-  static DeviceMap gAllDevices;
-
   bool unmount(const std::string &uid)
   {
     USBDevicePtr usbInfo = getDevice(uid);
@@ -63,8 +62,13 @@ namespace USBDriver
           DADiskUnmount(disk, kDADiskUnmountOptionDefault, nullptr, NULL);
           CFRelease(disk);
 
-          // Rewrite mount as empty
-          usbInfo->mountPoint = "";
+          // Records are shared, so register an unmounted copy instead
+          USBDevicePtr unmounted(new USBDevice(*usbInfo));
+          unmounted->mountPoint = "";
+          unmounted->filesystemUUID = "";
+          unmounted->filesystemLabel = "";
+
+          DeviceRegistry::instance().insert(unmounted);
 
           return true;
         }
@@ -76,28 +80,40 @@ namespace USBDriver
     return false;
   }
 
-  USBDevicePtr getDevice(const std::string &uid)
-  {
-    return gAllDevices[uid];
-  }
+  // Mbit/s of the kUSBDeviceSpeed* values reported as "Device Speed"
+  static const double DEVICE_SPEEDS[] = { 1.5, 12, 480, 5000, 10000, 20000 };
 
-  static USBDevicePtr _findDeviceByLocationID(const DeviceMap &map, int locationID)
+  /**
+   * Read the hub ports of a location ID: the bus number in the top byte
+   * followed by one nibble per port, up to the first zero nibble.
+   */
+  static std::string _portPathFromLocationID(int locationID)
   {
-    for(auto it = map.begin(); it != map.end(); ++it) {
-      auto device = it->second;
+    std::string portPath;
 
-      if(device->locationID == locationID) {
-        return device;
-      }
+    for (int shift = 20; shift >= 0; shift -= 4) {
+      unsigned int port = (static_cast<unsigned int>(locationID) >> shift) & 0xf;
+
+      if (port == 0)
+        break;
+
+      if (!portPath.empty())
+        portPath += '.';
+
+      portPath += std::to_string(port);
     }
 
-    return nullptr;
+    return portPath;
   }
 
-  // TODO: Make this referentialy transparent, in the way that it
-  // TODO: doesn't modify gAllDevices.
+  /**
+   * Read the properties and mount point of a device. Runs on the
+   * extraction pool, so it must not touch the registry.
+   */
   static USBDevicePtr usbServiceObject(io_service_t usbService)
   {
+    CORE_TRACE_SCOPE("enumeration", "usbServiceObject");
+
     CFMutableDictionaryRef properties;
     kern_return_t kr = IORegistryEntryCreateCFProperties(usbService,
                                                          &properties,
@@ -116,27 +132,29 @@ namespace USBDriver
 
     CORE_DEBUG("Received location ID: " + std::to_string(locationID));
 
-    // Attempt to receive the device
-    USBDevicePtr usbInfo = _findDeviceByLocationID(gAllDevices, locationID);
+    int vendorID = PROP_VAL_INT(properties, kUSBVendorID);
+    int productID = PROP_VAL_INT(properties, kUSBProductID);
+    std::string serialNumber = PROP_VAL_STR(properties, kUSBSerialNumberString);
 
-    if (usbInfo == nullptr) {
-      CORE_DEBUG("USB device not found, creating a new one...");
-      // We don't have one, so create a new one
-      usbInfo = USBDevicePtr(new USBDevice);
-    }
+    USBDevicePtr usbInfo(new USBDevice);
 
     usbInfo->locationID    = locationID;
-    usbInfo->vendorID      = PROP_VAL_INT(properties, kUSBVendorID);
-    usbInfo->productID     = PROP_VAL_INT(properties, kUSBProductID);
-    usbInfo->serialNumber  = PROP_VAL_STR(properties, kUSBSerialNumberString);
+    usbInfo->vendorID      = vendorID;
+    usbInfo->productID     = productID;
+    usbInfo->serialNumber  = serialNumber;
     usbInfo->product       = PROP_VAL_STR(properties, kUSBProductString);
     usbInfo->vendor        = PROP_VAL_STR(properties, kUSBVendorString);
-    usbInfo->uid           = uniqueDeviceID(usbInfo);
+    usbInfo->busNumber     = (static_cast<unsigned int>(locationID) >> 24) & 0xff;
+    usbInfo->portPath      = _portPathFromLocationID(locationID);
 
-    CFRelease(properties);
+    if (CFDictionaryContainsKey(properties, CFSTR(kUSBDevicePropertySpeed))) {
+      int speed = PROP_VAL_INT(properties, kUSBDevicePropertySpeed);
 
-    // Register in storage
-    gAllDevices[usbInfo->uid] = usbInfo;
+      if (speed >= 0 && speed < static_cast<int>(sizeof(DEVICE_SPEEDS) / sizeof(DEVICE_SPEEDS[0])))
+        usbInfo->speed = DEVICE_SPEEDS[speed];
+    }
+
+    CFRelease(properties);
 
     CORE_DEBUG("Attempting to access BSD name...");
 
@@ -146,8 +164,11 @@ namespace USBDriver
                                                                        kCFAllocatorDefault,
                                                                        kIORegistryIterateRecursively);
     if (bsdName != nullptr) {
+      CORE_TRACE_SCOPE("enumeration", "resolveMountPoint");
+
       char bsdNameBuf[4096];
       sprintf( bsdNameBuf, "/dev/%ss1", cfStringRefToCString(bsdName));
+      CFRelease(bsdName);
       char* bsdNameC = &bsdNameBuf[0];
 
       CORE_INFO("Found BSD Name: " + std::string(bsdNameC));
@@ -181,19 +202,63 @@ namespace USBDriver
               CORE_INFO("Found volume path: " + std::string(volumePath));
           }
 
+          // Already in the description, but only wanted on request
+          if(options().filesystemInfo && !usbInfo->mountPoint.empty()) {
+            CFUUIDRef uuid = static_cast<CFUUIDRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumeUUIDKey));
+            CFStringRef name = static_cast<CFStringRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumeNameKey));
+
+            if(uuid != nullptr) {
+              CFStringRef uuidStr = CFUUIDCreateString(kCFAllocatorDefault, uuid);
+
+              usbInfo->filesystemUUID = cfStringRefToCString(uuidStr);
+              CFRelease(uuidStr);
+            }
+
+            if(name != nullptr)
+              usbInfo->filesystemLabel = cfStringRefToCString(name);
+          }
+
           CFRelease(desc);
         }
 
         CFRelease(disk);
-        CFRelease(daSession);
       }
+
+      CFRelease(daSession);
     }
 
     return usbInfo;
   }
 
-  std::vector<USBDevicePtr> getDevices()
+  static USBDevicePtr _registerDevice(USBDevicePtr usbInfo)
+  {
+    // Attempt to receive the device
+    USBDevicePtr previous = DeviceRegistry::instance().findAttached(usbInfo->locationID, usbInfo->vendorID,
+                                                                    usbInfo->productID,
+                                                                    usbInfo->serialNumber.c_str());
+
+    if (previous == nullptr)
+      CORE_DEBUG("USB device not found, creating a new one...");
+
+    usbInfo = mergeDevice(previous, usbInfo);
+
+    // Register in storage
+    DeviceRegistry::instance().insert(usbInfo);
+
+    return usbInfo;
+  }
+
+  static Utils::WorkPool gExtractionPool(Utils::WorkPool::defaultThreads(MAX_EXTRACTION_THREADS) - 1);
+
+  // Polls from JS and from the scheduler thread take turns
+  static std::mutex gEnumerationMutex;
+
+  std::vector<USBDevicePtr> enumerateDevices()
   {
+    CORE_TRACE_SCOPE("enumeration", "enumerateDevices");
+
+    std::lock_guard<std::mutex> lock(gEnumerationMutex);
+
     mach_port_t masterPort;
     kern_return_t kr = IOMasterPort(MACH_PORT_NULL, &masterPort);
 
@@ -216,21 +281,44 @@ namespace USBDriver
       }
     else
       {
+        ++stats().scans;
+
+        // Discovery is cheap, reading properties and mounts is what blocks
+        std::vector<io_service_t> usbServices;
         io_service_t usbService;
 
         while ((usbService = IOIteratorNext(iter)) != 0) {
           CORE_DEBUG("IOIteratorNext found USB device");
+          usbServices.push_back(usbService);
+        }
+
+        IOObjectRelease(iter);
 
-          USBDevicePtr usbInfo = usbServiceObject(usbService);
+        std::vector<USBDevicePtr> extracted(usbServices.size());
 
-          if (usbInfo != nullptr) {
+        gExtractionPool.run(usbServices.size(), [&usbServices, &extracted](size_t i) {
+            extracted[i] = usbServiceObject(usbServices[i]);
+          });
+
+        if (options().capacityInfo)
+          VolumeStats::instance().fill(extracted);
+
+        DeviceRegistry::instance().beginUpdate();
+
+        // Register in discovery order
+        for (size_t i = 0; i < usbServices.size(); ++i) {
+          if (extracted[i] != nullptr) {
             CORE_DEBUG("Adding USB info to cache");
-            devices.push_back(usbInfo);
+            devices.push_back(_registerDevice(extracted[i]));
+            ++stats().deviceReads;
           }
 
           CORE_DEBUG("Releasing USB service resources");
-          IOObjectRelease(usbService);
+          IOObjectRelease(usbServices[i]);
         }
+
+        // Forget about everything that is no longer attached
+        DeviceRegistry::instance().endUpdate();
       }
 
 
@@ -240,4 +328,55 @@ namespace USBDriver
     return devices;
   }
 
+  USBDevicePtr readDevice(const USBDevicePtr &device)
+  {
+    std::lock_guard<std::mutex> lock(gEnumerationMutex);
+
+    CFMutableDictionaryRef usbMatching = IOServiceMatching(SERVICE_MATCHER);
+
+    assert(usbMatching != nullptr);
+
+    // The location ID is unique while the device stays on its port
+    SInt32 locationID = device->locationID;
+    CFNumberRef locationNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &locationID);
+
+    CFDictionarySetValue(usbMatching, CFSTR(kUSBDevicePropertyLocationID), locationNumber);
+    CFRelease(locationNumber);
+
+    // Consumes the matching dictionary
+    io_service_t usbService = IOServiceGetMatchingService(kIOMasterPortDefault, usbMatching);
+    USBDevicePtr usbInfo;
+
+    if (usbService != 0) {
+      usbInfo = usbServiceObject(usbService);
+      ++stats().deviceReads;
+
+      IOObjectRelease(usbService);
+    }
+
+    if (usbInfo != nullptr && options().capacityInfo) {
+      std::vector<USBDevicePtr> records(1, usbInfo);
+      VolumeStats::instance().fill(records);
+    }
+
+    return updateDevice(device, usbInfo);
+  }
+
+  // Every enumeration registers all devices, nothing to forget
+  void invalidateDevices()
+  {
+  }
+
+  /**
+   * No hotplug events on Mac, `onEvent` is never called and the poll
+   * scheduler only polls at its interval.
+   */
+  const char *watchDevices(const std::function<void()> &)
+  {
+    return "poll";
+  }
+
+  void unwatchDevices()
+  {
+  }
 }
@@ -0,0 +1,154 @@
+#include "poll_scheduler.h"
+#include "usb_common.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace USBDriver
+{
+  PollScheduler::PollScheduler()
+    : m_changeCount(0), m_running(false), m_stopping(false), m_woken(false)
+  {
+  }
+
+  PollScheduler::~PollScheduler()
+  {
+    stop();
+  }
+
+  bool PollScheduler::start(const ChangeCallback &onChange)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if(m_running)
+        return false;
+
+      m_onChange = onChange;
+      m_devices.clear();
+      m_changeCount = 0;
+      m_running = true;
+      m_stopping = false;
+      m_woken = false;
+      m_thread = std::thread(&PollScheduler::run, this);
+    }
+
+    // Hotplug events cut the wait short, the backoff still catches
+    // anything they miss
+    stats().watcher = watchDevices([this]() { wake(); });
+
+    return true;
+  }
+
+  void PollScheduler::stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if(!m_running)
+        return;
+
+      m_stopping = true;
+    }
+
+    unwatchDevices();
+    stats().watcher = "none";
+
+    m_condition.notify_all();
+    m_thread.join();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_onChange = nullptr;
+    m_running = false;
+  }
+
+  bool PollScheduler::isRunning() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_running;
+  }
+
+  void PollScheduler::wake()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_woken = true;
+    }
+
+    m_condition.notify_all();
+  }
+
+  std::vector<USBDevicePtr> PollScheduler::devices(unsigned long *changeCount) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(changeCount != nullptr)
+      *changeCount = m_changeCount;
+
+    return m_devices;
+  }
+
+  void PollScheduler::run()
+  {
+    bool first = true;
+    int interval = 0;
+
+    while(true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // The initial set is read right away
+        if(!first) {
+          m_condition.wait_for(lock, std::chrono::milliseconds(interval),
+                               [this]() { return m_stopping || m_woken; });
+        }
+
+        if(m_stopping)
+          return;
+
+        if(m_woken)
+          interval = 0;
+
+        m_woken = false;
+      }
+
+      std::vector<USBDevicePtr> devices;
+
+      {
+        CORE_TRACE_SCOPE_ARG("scheduler", "poll", "interval", interval);
+
+        devices = getDevices();
+      }
+
+      // Bounds may be reconfigured while polling
+      int minInterval = std::max(1, options().pollIntervalMin.load());
+      int maxInterval = std::max(minInterval, options().pollIntervalMax.load());
+
+      unsigned long changeCount;
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Back off while idle
+        if(!first && sameDevices(devices, m_devices)) {
+          interval = interval > maxInterval / 2 ? maxInterval : std::max(minInterval, interval * 2);
+          continue;
+        }
+
+        m_devices.swap(devices);
+        changeCount = ++m_changeCount;
+      }
+
+      CORE_TRACE_ASYNC_BEGIN("scheduler", "deviceChange", changeCount);
+
+      first = false;
+      interval = minInterval;
+
+      m_onChange();
+    }
+  }
+}
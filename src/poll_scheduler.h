@@ -0,0 +1,78 @@
+#ifndef _USB_DRIVER_POLL_SCHEDULER_H__
+#define _USB_DRIVER_POLL_SCHEDULER_H__
+
+#include "usb_driver.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace USBDriver
+{
+  /**
+   * Polls getDevices() on a background thread. The interval starts at
+   * options().pollIntervalMin after every change and doubles on each idle
+   * poll up to options().pollIntervalMax.
+   *
+   * Hotplug events reported by watchDevices() trigger a poll right away.
+   * The change callback only runs when the device set differs from the
+   * previous poll, so an idle bus costs nothing on the JS side.
+   */
+  class PollScheduler
+  {
+  public:
+    typedef std::function<void()> ChangeCallback;
+
+    static PollScheduler &instance()
+    {
+      static PollScheduler instance;
+      return instance;
+    }
+
+    ~PollScheduler();
+
+    /**
+     * Start the polling thread. `onChange` is called on that thread for
+     * the initial device set and after every change, and should only hand
+     * off to the thread consuming devices(). Returns false if already running.
+     */
+    bool start(const ChangeCallback &onChange);
+    /**
+     * Stop the polling thread. No callback runs once this returns.
+     */
+    void stop();
+    bool isRunning() const;
+
+    /**
+     * Poll right away and restart from the shortest interval.
+     */
+    void wake();
+
+    /**
+     * The device set as of the latest change. `changeCount` receives the
+     * number of changes seen since start(), if given.
+     */
+    std::vector<USBDevicePtr> devices(unsigned long *changeCount = nullptr) const;
+
+  private:
+    PollScheduler();
+    PollScheduler(const PollScheduler &);
+    PollScheduler &operator=(const PollScheduler &);
+
+    void run();
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::thread m_thread;
+    ChangeCallback m_onChange;
+    std::vector<USBDevicePtr> m_devices;
+    unsigned long m_changeCount;
+    bool m_running;
+    bool m_stopping;
+    bool m_woken;
+  };
+}
+
+#endif // _USB_DRIVER_POLL_SCHEDULER_H__
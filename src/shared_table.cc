@@ -0,0 +1,478 @@
+#include "shared_table.h"
+#include "usb_common.h"
+#include "usb_registry.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <thread>
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// "USBT"
+static const uint32_t SHARED_TABLE_MAGIC = 0x54425355;
+// Bump whenever the layout below changes
+static const uint32_t SHARED_TABLE_VERSION = 4;
+// Copies attempted before giving up on an owner that died mid-write
+static const int MAX_READ_ATTEMPTS = 1000;
+
+namespace USBDriver
+{
+  typedef struct SharedDevice {
+    int32_t locationID;
+    int32_t productID;
+    int32_t vendorID;
+    int32_t busNumber;
+    double speed;
+    uint64_t totalBytes;
+    uint64_t freeBytes;
+    uint64_t totalInodes;
+    uint64_t freeInodes;
+    char uid[128];
+    char product[128];
+    char vendor[128];
+    char serialNumber[128];
+    char mountPoint[512];
+    char filesystemUUID[48];
+    char filesystemLabel[128];
+    char portPath[64];
+  } SharedDevice;
+
+  typedef struct SharedHeader {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> sequence;   // Odd while the owner writes.
+    uint32_t capacity;
+    uint32_t count;
+    int32_t ownerPID;                 // 0 once the owner detached, only informative.
+  } SharedHeader;
+
+  // The sequence number is shared between processes
+  static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared tables need lock free atomics");
+
+  static const size_t SHARED_TABLE_SIZE = sizeof(SharedHeader) + SHARED_TABLE_CAPACITY * sizeof(SharedDevice);
+
+  static inline SharedHeader *_header(void *map)
+  {
+    return static_cast<SharedHeader *>(map);
+  }
+
+  static inline SharedDevice *_entries(void *map)
+  {
+    return reinterpret_cast<SharedDevice *>(static_cast<char *>(map) + sizeof(SharedHeader));
+  }
+
+  // Copy a string into a fixed size field, truncating it if needed
+  template<size_t N>
+    static void _copyField(char (&field)[N], const char *str, size_t len)
+    {
+      len = std::min(len, N - 1);
+
+      memcpy(field, str, len);
+      field[len] = '\0';
+    }
+
+  SharedTable::SharedTable()
+    : m_role(NONE), m_fd(-1), m_lockFd(-1), m_map(nullptr), m_size(0), m_sequence(0)
+  {
+  }
+
+  SharedTable::~SharedTable()
+  {
+    detach();
+  }
+
+#ifndef _WIN32
+
+  bool SharedTable::map(const std::string &name, bool owner)
+  {
+    m_fd = shm_open(name.c_str(), owner ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+
+    if(m_fd < 0) {
+      CORE_ERROR("Failed to open the shared table " + name + ": " + strerror(errno));
+      return false;
+    }
+
+    struct stat st;
+
+    if(fstat(m_fd, &st) != 0) {
+      CORE_ERROR("Failed to stat the shared table " + name + ": " + strerror(errno));
+      unmap();
+      return false;
+    }
+
+    if(static_cast<size_t>(st.st_size) < SHARED_TABLE_SIZE) {
+      // Nobody published yet
+      if(!owner) {
+        CORE_ERROR("The shared table " + name + " was not initialized by its owner");
+        unmap();
+        return false;
+      }
+
+      if(ftruncate(m_fd, SHARED_TABLE_SIZE) != 0) {
+        CORE_ERROR("Failed to size the shared table " + name + ": " + strerror(errno));
+        unmap();
+        return false;
+      }
+    }
+
+    m_size = SHARED_TABLE_SIZE;
+    m_map = mmap(nullptr, m_size, owner ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, m_fd, 0);
+
+    if(m_map == MAP_FAILED) {
+      m_map = nullptr;
+      CORE_ERROR("Failed to map the shared table " + name + ": " + strerror(errno));
+      unmap();
+      return false;
+    }
+
+    return true;
+  }
+
+  void SharedTable::unmap()
+  {
+    if(m_map != nullptr)
+      munmap(m_map, m_size);
+    if(m_fd >= 0)
+      close(m_fd);
+    // Closing the lock file releases ownership
+    if(m_lockFd >= 0)
+      close(m_lockFd);
+
+    m_map = nullptr;
+    m_fd = -1;
+    m_lockFd = -1;
+    m_size = 0;
+  }
+
+  bool SharedTable::lockOwner(const std::string &name)
+  {
+    // Beside the segment rather than on it, flock() doesn't work on shared memory everywhere
+    std::string path = "/tmp" + name + ".lock";
+
+    m_lockFd = open(path.c_str(), O_RDONLY | O_CREAT, 0644);
+
+    if(m_lockFd < 0) {
+      CORE_ERROR("Failed to open the lock file " + path + ": " + strerror(errno));
+      return false;
+    }
+
+    if(flock(m_lockFd, LOCK_EX | LOCK_NB) != 0) {
+      if(errno == EWOULDBLOCK)
+        CORE_ERROR("The shared table " + name + " is owned by another process");
+      else
+        CORE_ERROR("Failed to lock " + path + ": " + strerror(errno));
+
+      close(m_lockFd);
+      m_lockFd = -1;
+
+      return false;
+    }
+
+    return true;
+  }
+
+  bool SharedTable::own(const std::string &name)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(role() != NONE) {
+      CORE_ERROR("Already using a shared table");
+      return false;
+    }
+
+    // Held until detach() or exit, so no other process writes meanwhile,
+    // whatever layout version it uses
+    if(!lockOwner(name))
+      return false;
+
+    if(!map(name, true)) {
+      unmap();
+      return false;
+    }
+
+    SharedHeader *header = _header(m_map);
+    bool initialized = header->magic == SHARED_TABLE_MAGIC && header->version == SHARED_TABLE_VERSION;
+
+    if(!initialized) {
+      header->sequence.store(0, std::memory_order_relaxed);
+      header->count = 0;
+      header->capacity = SHARED_TABLE_CAPACITY;
+      header->version = SHARED_TABLE_VERSION;
+      // Readers check the magic last
+      std::atomic_thread_fence(std::memory_order_release);
+      header->magic = SHARED_TABLE_MAGIC;
+    } else {
+      uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+
+      // The previous owner died mid-write. Drop what it left half written
+      // and get the sequence even again, or every write would look odd.
+      if(sequence & 1) {
+        CORE_WARNING("The previous owner of the shared table " + name + " died while writing to it");
+
+        header->count = 0;
+        header->sequence.store(sequence + 1, std::memory_order_release);
+      }
+    }
+
+    header->ownerPID = getpid();
+
+    // Publish the next poll whatever the table holds
+    m_devices.clear();
+    m_role.store(OWNER, std::memory_order_release);
+
+    return true;
+  }
+
+  bool SharedTable::attach(const std::string &name)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(role() != NONE) {
+      CORE_ERROR("Already using a shared table");
+      return false;
+    }
+
+    if(!map(name, false))
+      return false;
+
+    SharedHeader *header = _header(m_map);
+
+    if(header->magic != SHARED_TABLE_MAGIC || header->version != SHARED_TABLE_VERSION ||
+       header->capacity != SHARED_TABLE_CAPACITY) {
+      CORE_ERROR("The shared table " + name + " has an incompatible layout");
+      unmap();
+      return false;
+    }
+
+    // An odd sequence never matches a complete write, so the first poll reads the table
+    m_sequence = header->sequence.load(std::memory_order_acquire) | 1;
+    m_devices.clear();
+    m_role.store(READER, std::memory_order_release);
+
+    return true;
+  }
+
+  void SharedTable::detach()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Role current = role();
+
+    if(current == NONE)
+      return;
+
+    m_role.store(NONE, std::memory_order_release);
+
+    // Let readers know the devices are no longer tracked
+    if(current == OWNER) {
+      SharedHeader *header = _header(m_map);
+      uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+
+      header->sequence.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      header->count = 0;
+      header->ownerPID = 0;
+
+      header->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    m_devices.clear();
+
+    unmap();
+
+    // The registry holds the table's devices, the next poll must replace
+    // them even if the bus didn't change since the last local one
+    if(current == READER)
+      invalidateDevices();
+  }
+
+#else // No POSIX shared memory
+
+  bool SharedTable::map(const std::string &, bool)
+  {
+    return false;
+  }
+
+  void SharedTable::unmap()
+  {
+  }
+
+  bool SharedTable::lockOwner(const std::string &)
+  {
+    return false;
+  }
+
+  bool SharedTable::own(const std::string &)
+  {
+    CORE_ERROR("Shared tables are not supported on this platform");
+    return false;
+  }
+
+  bool SharedTable::attach(const std::string &)
+  {
+    CORE_ERROR("Shared tables are not supported on this platform");
+    return false;
+  }
+
+  void SharedTable::detach()
+  {
+  }
+
+#endif
+
+  void SharedTable::publish(const std::vector<USBDevicePtr> &devices)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(role() != OWNER || sameDevices(devices, m_devices))
+      return;
+
+    CORE_TRACE_SCOPE("shared", "publish");
+
+    SharedHeader *header = _header(m_map);
+    SharedDevice *entries = _entries(m_map);
+    uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+    uint32_t count = static_cast<uint32_t>(std::min<size_t>(devices.size(), SHARED_TABLE_CAPACITY));
+
+    if(count < devices.size())
+      CORE_WARNING("Only sharing the first " + std::to_string(count) + " devices");
+
+    header->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for(uint32_t i = 0; i < count; ++i) {
+      const USBDevicePtr &device = devices[i];
+      SharedDevice &entry = entries[i];
+
+      entry.locationID = device->locationID;
+      entry.productID  = device->productID;
+      entry.vendorID   = device->vendorID;
+      entry.busNumber  = device->busNumber;
+      entry.speed      = device->speed;
+      entry.totalBytes  = device->totalBytes;
+      entry.freeBytes   = device->freeBytes;
+      entry.totalInodes = device->totalInodes;
+      entry.freeInodes  = device->freeInodes;
+
+      _copyField(entry.uid, device->uid.c_str(), device->uid.size());
+      _copyField(entry.product, device->product.c_str(), device->product.size());
+      _copyField(entry.vendor, device->vendor.c_str(), device->vendor.size());
+      _copyField(entry.serialNumber, device->serialNumber.c_str(), device->serialNumber.size());
+      _copyField(entry.mountPoint, device->mountPoint.c_str(), device->mountPoint.size());
+      _copyField(entry.filesystemUUID, device->filesystemUUID.c_str(), device->filesystemUUID.size());
+      _copyField(entry.filesystemLabel, device->filesystemLabel.c_str(), device->filesystemLabel.size());
+      _copyField(entry.portPath, device->portPath.c_str(), device->portPath.size());
+    }
+
+    header->count = count;
+    header->sequence.store(sequence + 2, std::memory_order_release);
+
+    m_devices = devices;
+  }
+
+  std::vector<USBDevicePtr> SharedTable::devices()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(role() != READER)
+      return m_devices;
+
+    const SharedHeader *header = _header(m_map);
+
+    // Nothing was published since the last read
+    if(header->sequence.load(std::memory_order_acquire) == m_sequence)
+      return m_devices;
+
+    CORE_TRACE_SCOPE("shared", "read");
+
+    std::vector<SharedDevice> entries(SHARED_TABLE_CAPACITY);
+    uint32_t sequence = 0;
+    uint32_t count = 0;
+    int attempt = 0;
+
+    for(; attempt < MAX_READ_ATTEMPTS; ++attempt) {
+      sequence = header->sequence.load(std::memory_order_acquire);
+
+      if(sequence & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      count = std::min(header->count, SHARED_TABLE_CAPACITY);
+      memcpy(entries.data(), _entries(m_map), count * sizeof(SharedDevice));
+
+      // The copy is only valid if no write started in the meantime
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if(header->sequence.load(std::memory_order_relaxed) == sequence)
+        break;
+    }
+
+    if(attempt == MAX_READ_ATTEMPTS) {
+      CORE_WARNING("The shared table owner did not finish writing, keeping the previous devices");
+      return m_devices;
+    }
+
+    std::vector<USBDevicePtr> devices;
+    devices.reserve(count);
+
+    for(uint32_t i = 0; i < count; ++i) {
+      const SharedDevice &entry = entries[i];
+      USBDevicePtr device(new USBDevice);
+
+      device->uid             = entry.uid;
+      device->locationID      = entry.locationID;
+      device->productID       = entry.productID;
+      device->vendorID        = entry.vendorID;
+      device->product         = entry.product;
+      device->vendor          = entry.vendor;
+      device->serialNumber    = entry.serialNumber;
+      device->mountPoint      = entry.mountPoint;
+      device->filesystemUUID  = entry.filesystemUUID;
+      device->filesystemLabel = entry.filesystemLabel;
+      device->busNumber       = entry.busNumber;
+      device->portPath        = entry.portPath;
+      device->speed           = entry.speed;
+      device->totalBytes      = entry.totalBytes;
+      device->freeBytes       = entry.freeBytes;
+      device->totalInodes     = entry.totalInodes;
+      device->freeInodes      = entry.freeInodes;
+
+      USBDevicePtr previous;
+
+      for(auto &known : m_devices) {
+        if(known->uid == device->uid) {
+          previous = known;
+          break;
+        }
+      }
+
+      devices.push_back(mergeDevice(previous, device));
+    }
+
+    // Serve getDevice() from the registry as usual
+    DeviceRegistry &registry = DeviceRegistry::instance();
+
+    registry.beginUpdate();
+
+    for(auto &device : devices)
+      registry.insert(device);
+
+    registry.endUpdate();
+
+    m_sequence = sequence;
+    m_devices = devices;
+
+    return devices;
+  }
+}
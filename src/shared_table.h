@@ -0,0 +1,96 @@
+#ifndef _USB_DRIVER_SHARED_TABLE_H__
+#define _USB_DRIVER_SHARED_TABLE_H__
+
+#include "usb_driver.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace USBDriver
+{
+  // Devices a shared table has room for. Further devices are not shared.
+  static const uint32_t SHARED_TABLE_CAPACITY = 128;
+
+  /**
+   * Device list shared between the processes of one host through a POSIX
+   * shared memory segment. One process owns the table and publishes the
+   * result of its polls. The others attach read-only and serve their
+   * polls from the table instead of enumerating devices themselves.
+   *
+   * Writes are protected by a seqlock: the sequence number is odd while
+   * the owner writes, and readers retry if it changed while they copied.
+   * Reading an unchanged table is a single atomic load.
+   */
+  class SharedTable
+  {
+  public:
+    enum Role {
+      NONE,
+      OWNER,
+      READER
+    };
+
+    static SharedTable &instance()
+    {
+      static SharedTable instance;
+      return instance;
+    }
+
+    ~SharedTable();
+
+    /**
+     * Create or take over the segment `name` (e.g. "/usb-driver") and
+     * publish to it. Ownership is an exclusive flock() on
+     * "/tmp<name>.lock", held until detach() or exit. Fails if another
+     * process holds it.
+     */
+    bool own(const std::string &name);
+    /**
+     * Attach to the segment `name` published by another process.
+     */
+    bool attach(const std::string &name);
+    /**
+     * Go back to enumerating devices locally. An owner empties the table,
+     * a reader makes its next poll register every local device again.
+     */
+    void detach();
+
+    inline Role role() const
+    {
+      return static_cast<Role>(m_role.load(std::memory_order_acquire));
+    }
+
+    /**
+     * Owner: write `devices` to the table, unless it already holds them.
+     */
+    void publish(const std::vector<USBDevicePtr> &devices);
+    /**
+     * Reader: the devices in the table. Records are only rebuilt, and
+     * registered, after the owner published a change.
+     */
+    std::vector<USBDevicePtr> devices();
+
+  private:
+    SharedTable();
+    SharedTable(const SharedTable &);
+    SharedTable &operator=(const SharedTable &);
+
+    bool map(const std::string &name, bool owner);
+    void unmap();
+    bool lockOwner(const std::string &name);
+
+    std::mutex m_mutex;
+    std::atomic<int> m_role;
+    int m_fd;
+    int m_lockFd;                         // Owner: the lock file.
+    void *m_map;
+    size_t m_size;
+    uint32_t m_sequence;                  // Reader: sequence m_devices was read at.
+    std::vector<USBDevicePtr> m_devices;  // Last published or read devices.
+  };
+}
+
+#endif // _USB_DRIVER_SHARED_TABLE_H__
@@ -0,0 +1,452 @@
+#include "timeline.h"
+#include "poll_scheduler.h"
+#include "usb_common.h"
+#include "usb_registry.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <string.h>
+
+static const char TIMELINE_MAGIC[4] = { 'U', 'S', 'B', 'R' };
+// Bump whenever the entry layout changes
+static const unsigned char TIMELINE_VERSION = 4;
+
+static const unsigned char TIMELINE_EVENT = 1;
+static const unsigned char TIMELINE_SNAPSHOT = 2;
+
+// Milliseconds between checks that the poll scheduler still runs, while
+// waiting for it to consume a snapshot
+static const int CONSUME_CHECK_INTERVAL = 100;
+
+namespace USBDriver
+{
+  using std::chrono::steady_clock;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Recording
+  ////////////////////////////////////////////////////////////////////////////////
+  TimelineRecorder::TimelineRecorder()
+    : m_recording(false), m_file(NULL)
+  {
+  }
+
+  TimelineRecorder::~TimelineRecorder()
+  {
+    stop();
+  }
+
+  bool TimelineRecorder::start(const std::string &path)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_file != NULL) {
+      CORE_ERROR("Already recording a timeline");
+      return false;
+    }
+
+    m_file = fopen(path.c_str(), "wb");
+
+    if(m_file == NULL) {
+      CORE_ERROR("Failed to open " + path + ": " + strerror(errno));
+      return false;
+    }
+
+    fwrite(TIMELINE_MAGIC, 1, sizeof(TIMELINE_MAGIC), m_file);
+    fputc(TIMELINE_VERSION, m_file);
+
+    m_last = steady_clock::now();
+    m_devices.clear();
+    m_recording.store(true, std::memory_order_release);
+
+    return true;
+  }
+
+  void TimelineRecorder::stop()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_file == NULL)
+      return;
+
+    m_recording.store(false, std::memory_order_release);
+
+    if(ferror(m_file) || fclose(m_file) != 0)
+      CORE_ERROR("Failed to write the timeline, the recording is incomplete");
+
+    m_file = NULL;
+    m_devices.clear();
+  }
+
+  void TimelineRecorder::writeVarint(uint64_t value)
+  {
+    while(value >= 0x80) {
+      fputc(static_cast<int>((value & 0x7f) | 0x80), m_file);
+      value >>= 7;
+    }
+
+    fputc(static_cast<int>(value), m_file);
+  }
+
+  void TimelineRecorder::writeString(const char *str, size_t len)
+  {
+    writeVarint(len);
+    fwrite(str, 1, len, m_file);
+  }
+
+  void TimelineRecorder::writeHeader(unsigned char type)
+  {
+    auto now = steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last);
+
+    fputc(type, m_file);
+    writeVarint(static_cast<uint64_t>(elapsed.count()));
+
+    m_last = now;
+  }
+
+  void TimelineRecorder::recordEvent(const std::string &device)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_file == NULL)
+      return;
+
+    writeHeader(TIMELINE_EVENT);
+    writeString(device.c_str(), device.size());
+  }
+
+  void TimelineRecorder::recordSnapshot(const std::vector<USBDevicePtr> &devices)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_file == NULL || sameDevices(devices, m_devices))
+      return;
+
+    writeHeader(TIMELINE_SNAPSHOT);
+    writeVarint(devices.size());
+
+    for(auto &device : devices) {
+      size_t index = 0;
+
+      // Records are immutable, an unchanged device only costs its index
+      while(index < m_devices.size() && m_devices[index] != device)
+        ++index;
+
+      if(index < m_devices.size()) {
+        writeVarint(index + 1);
+        continue;
+      }
+
+      writeVarint(0);
+      writeString(device->uid.c_str(), device->uid.size());
+      writeVarint(static_cast<uint32_t>(device->locationID));
+      writeVarint(static_cast<uint32_t>(device->vendorID));
+      writeVarint(static_cast<uint32_t>(device->productID));
+      writeString(device->product.c_str(), device->product.size());
+      writeString(device->vendor.c_str(), device->vendor.size());
+      writeString(device->serialNumber.c_str(), device->serialNumber.size());
+      writeString(device->mountPoint.c_str(), device->mountPoint.size());
+      writeString(device->filesystemUUID.c_str(), device->filesystemUUID.size());
+      writeString(device->filesystemLabel.c_str(), device->filesystemLabel.size());
+      writeVarint(static_cast<uint32_t>(device->busNumber));
+      writeString(device->portPath.c_str(), device->portPath.size());
+      writeVarint(static_cast<uint64_t>(device->speed * 1000 + 0.5));
+      writeVarint(device->totalBytes);
+      writeVarint(device->freeBytes);
+      writeVarint(device->totalInodes);
+      writeVarint(device->freeInodes);
+    }
+
+    m_devices = devices;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Replay
+  ////////////////////////////////////////////////////////////////////////////////
+  typedef struct TimelineReader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    bool ok;
+  } TimelineReader;
+
+  static uint64_t _readVarint(TimelineReader &reader)
+  {
+    uint64_t value = 0;
+
+    for(int shift = 0; shift < 64; shift += 7) {
+      if(reader.pos == reader.end)
+        break;
+
+      unsigned char byte = *reader.pos++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+      if(!(byte & 0x80))
+        return value;
+    }
+
+    reader.ok = false;
+    return 0;
+  }
+
+  static std::string _readString(TimelineReader &reader)
+  {
+    uint64_t len = _readVarint(reader);
+
+    if(!reader.ok || len > static_cast<uint64_t>(reader.end - reader.pos)) {
+      reader.ok = false;
+      return std::string();
+    }
+
+    std::string str(reinterpret_cast<const char *>(reader.pos), static_cast<size_t>(len));
+    reader.pos += len;
+
+    return str;
+  }
+
+  static bool _readFile(const std::string &path, std::vector<unsigned char> &data)
+  {
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if(file == NULL) {
+      CORE_ERROR("Failed to open " + path + ": " + strerror(errno));
+      return false;
+    }
+
+    unsigned char buf[8192];
+    size_t len;
+
+    while((len = fread(buf, 1, sizeof(buf), file)) > 0)
+      data.insert(data.end(), buf, buf + len);
+
+    bool failed = ferror(file) != 0;
+    fclose(file);
+
+    if(failed) {
+      CORE_ERROR("Failed to read " + path);
+      return false;
+    }
+
+    return true;
+  }
+
+  TimelineReplayer::TimelineReplayer()
+    : m_replaying(false), m_cancelled(false), m_polls(0), m_applied(0), m_consumed(0)
+  {
+  }
+
+  void TimelineReplayer::apply(const std::vector<USBDevicePtr> &devices)
+  {
+    DeviceRegistry &registry = DeviceRegistry::instance();
+
+    registry.beginUpdate();
+
+    for(auto &device : devices)
+      registry.insert(device);
+
+    registry.endUpdate();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_devices = devices;
+    ++m_applied;
+  }
+
+  bool TimelineReplayer::replay(const std::string &path, double speed, ReplayResult &result)
+  {
+    result.events = 0;
+    result.snapshots = 0;
+    result.milliseconds = 0;
+
+    std::vector<unsigned char> data;
+
+    if(!_readFile(path, data))
+      return false;
+
+    if(data.size() < sizeof(TIMELINE_MAGIC) + 1 ||
+       memcmp(data.data(), TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC)) != 0 ||
+       data[sizeof(TIMELINE_MAGIC)] != TIMELINE_VERSION) {
+      CORE_ERROR(path + " is not a timeline recorded by this version");
+      return false;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if(isReplaying()) {
+        CORE_ERROR("Already replaying a timeline");
+        return false;
+      }
+
+      m_cancelled = false;
+      m_devices.clear();
+      m_applied = m_consumed = 0;
+      m_replaying.store(true, std::memory_order_release);
+
+      // No poll starts enumerating from now on, let those that did finish with the registry
+      m_condition.wait(lock, [this]() { return m_polls == 0; });
+    }
+
+    CORE_TRACE_SCOPE("timeline", "replay");
+
+    TimelineReader reader = { data.data() + sizeof(TIMELINE_MAGIC) + 1, data.data() + data.size(), true };
+    std::vector<USBDevicePtr> previous;
+    auto start = steady_clock::now();
+    auto due = start;
+
+    while(reader.ok && reader.pos < reader.end) {
+      unsigned char type = *reader.pos++;
+      uint64_t elapsed = _readVarint(reader);
+
+      if(speed > 0) {
+        due += std::chrono::duration_cast<steady_clock::duration>(
+          std::chrono::duration<double, std::micro>(elapsed / speed));
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if(m_condition.wait_until(lock, due, [this]() { return m_cancelled; }))
+          break;
+      } else {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if(m_cancelled)
+          break;
+      }
+
+      if(type == TIMELINE_EVENT) {
+        _readString(reader);
+        ++result.events;
+      } else if(type == TIMELINE_SNAPSHOT) {
+        uint64_t count = _readVarint(reader);
+        std::vector<USBDevicePtr> devices;
+
+        for(uint64_t i = 0; reader.ok && i < count; ++i) {
+          uint64_t index = _readVarint(reader);
+
+          if(index > 0) {
+            if(index > previous.size()) {
+              reader.ok = false;
+              break;
+            }
+
+            devices.push_back(previous[index - 1]);
+            continue;
+          }
+
+          USBDevicePtr device(new USBDevice);
+
+          device->uid             = _readString(reader);
+          device->locationID      = static_cast<int>(_readVarint(reader));
+          device->vendorID        = static_cast<int>(_readVarint(reader));
+          device->productID       = static_cast<int>(_readVarint(reader));
+          device->product         = _readString(reader);
+          device->vendor          = _readString(reader);
+          device->serialNumber    = _readString(reader);
+          device->mountPoint      = _readString(reader);
+          device->filesystemUUID  = _readString(reader);
+          device->filesystemLabel = _readString(reader);
+          device->busNumber       = static_cast<int>(_readVarint(reader));
+          device->portPath        = _readString(reader);
+          device->speed           = _readVarint(reader) / 1000.0;
+          device->totalBytes      = _readVarint(reader);
+          device->freeBytes       = _readVarint(reader);
+          device->totalInodes     = _readVarint(reader);
+          device->freeInodes      = _readVarint(reader);
+
+          USBDevicePtr known;
+
+          for(auto &other : previous) {
+            if(other->uid == device->uid) {
+              known = other;
+              break;
+            }
+          }
+
+          devices.push_back(mergeDevice(known, device));
+        }
+
+        if(!reader.ok)
+          break;
+
+        apply(devices);
+        previous.swap(devices);
+        ++result.snapshots;
+      } else {
+        reader.ok = false;
+        break;
+      }
+
+      // As a hotplug event would
+      PollScheduler::instance().wake();
+
+      // As fast as the scheduler's polls go, so they don't skip a snapshot
+      if(speed <= 0 && type == TIMELINE_SNAPSHOT) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while(m_consumed != m_applied && !m_cancelled && PollScheduler::instance().isRunning())
+          m_condition.wait_for(lock, std::chrono::milliseconds(CONSUME_CHECK_INTERVAL));
+      }
+    }
+
+    if(!reader.ok)
+      CORE_ERROR(path + " is truncated or corrupt, stopped replaying");
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_devices.clear();
+      m_replaying.store(false, std::memory_order_release);
+    }
+
+    // Back to the devices actually attached, which the replay evicted from
+    // the registry even if the bus didn't change
+    invalidateDevices();
+    PollScheduler::instance().wake();
+
+    result.milliseconds = std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+
+    return reader.ok;
+  }
+
+  void TimelineReplayer::cancel()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_cancelled = true;
+    }
+
+    m_condition.notify_all();
+  }
+
+  std::vector<USBDevicePtr> TimelineReplayer::devices()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(m_consumed != m_applied) {
+      m_consumed = m_applied;
+      m_condition.notify_all();
+    }
+
+    return m_devices;
+  }
+
+  bool TimelineReplayer::beginPoll()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(isReplaying())
+      return false;
+
+    ++m_polls;
+
+    return true;
+  }
+
+  void TimelineReplayer::endPoll()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(--m_polls == 0)
+      m_condition.notify_all();
+  }
+}
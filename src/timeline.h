@@ -0,0 +1,145 @@
+#ifndef _USB_DRIVER_TIMELINE_H__
+#define _USB_DRIVER_TIMELINE_H__
+
+#include "usb_driver.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace USBDriver
+{
+  /**
+   * Records hotplug events and the device sets returned by getDevices()
+   * to a compact binary log, to be fed back later by TimelineReplayer.
+   *
+   * The log starts with "USBR" and a version byte. Each entry is a type
+   * byte, the microseconds since the previous entry and a payload, all
+   * integers being unsigned LEB128 varints and strings length prefixed:
+   *  - TIMELINE_EVENT: the device named by the event.
+   *  - TIMELINE_SNAPSHOT: the device count, then for each device either
+   *    1 + the index of the same record in the previous snapshot, or 0
+   *    followed by uid, locationID, vendorID, productID, product, vendor,
+   *    serialNumber, mountPoint, filesystemUUID, filesystemLabel,
+   *    busNumber, portPath, speed in kbit/s, totalBytes, freeBytes,
+   *    totalInodes and freeInodes.
+   *
+   * Only device sets that differ from the previous one are written.
+   */
+  class TimelineRecorder
+  {
+  public:
+    static TimelineRecorder &instance()
+    {
+      static TimelineRecorder instance;
+      return instance;
+    }
+
+    ~TimelineRecorder();
+
+    /**
+     * Start recording to `path`, replacing any existing file.
+     */
+    bool start(const std::string &path);
+    void stop();
+
+    inline bool isRecording() const
+    {
+      return m_recording.load(std::memory_order_acquire);
+    }
+
+    void recordEvent(const std::string &device);
+    void recordSnapshot(const std::vector<USBDevicePtr> &devices);
+
+  private:
+    TimelineRecorder();
+    TimelineRecorder(const TimelineRecorder &);
+    TimelineRecorder &operator=(const TimelineRecorder &);
+
+    void writeHeader(unsigned char type);
+    void writeVarint(uint64_t value);
+    void writeString(const char *str, size_t len);
+
+    std::mutex m_mutex;
+    std::atomic<bool> m_recording;
+    FILE *m_file;
+    std::chrono::steady_clock::time_point m_last;   // Time of the previous entry.
+    std::vector<USBDevicePtr> m_devices;            // Last recorded snapshot.
+  };
+
+  typedef struct ReplayResult {
+    unsigned long events;      // Events replayed.
+    unsigned long snapshots;   // Device sets replayed.
+    double milliseconds;       // Time the replay took.
+  } ReplayResult;
+
+  /**
+   * Feeds a timeline written by TimelineRecorder back through the device
+   * registry. While replaying, getDevices() returns the replayed device
+   * sets instead of enumerating, and every entry wakes the poll scheduler
+   * as a hotplug event would.
+   *
+   * Polls that enumerate bracket their registry updates with beginPoll()
+   * and endPoll(), and a replay waits for those in flight before it
+   * writes to the registry itself.
+   */
+  class TimelineReplayer
+  {
+  public:
+    static TimelineReplayer &instance()
+    {
+      static TimelineReplayer instance;
+      return instance;
+    }
+
+    /**
+     * Replay the timeline in `path`, blocking until it ends or cancel()
+     * is called. `speed` scales the recorded pace, e.g. 1 for the
+     * original timing, or 0 to replay as fast as possible. While the poll
+     * scheduler runs, each snapshot is then held until a poll returned
+     * it, so its consumers see every change.
+     */
+    bool replay(const std::string &path, double speed, ReplayResult &result);
+    void cancel();
+
+    inline bool isReplaying() const
+    {
+      return m_replaying.load(std::memory_order_acquire);
+    }
+
+    /**
+     * The replayed device set as of now.
+     */
+    std::vector<USBDevicePtr> devices();
+
+    /**
+     * Start a poll that enumerates, unless replaying. Returns false, and
+     * the poll must return devices() instead, while replaying.
+     */
+    bool beginPoll();
+    void endPoll();
+
+  private:
+    TimelineReplayer();
+    TimelineReplayer(const TimelineReplayer &);
+    TimelineReplayer &operator=(const TimelineReplayer &);
+
+    void apply(const std::vector<USBDevicePtr> &devices);
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::atomic<bool> m_replaying;
+    bool m_cancelled;
+    unsigned m_polls;                     // Enumerating polls in flight.
+    unsigned long m_applied;              // Snapshots replayed so far.
+    unsigned long m_consumed;             // Latest snapshot a poll returned.
+    std::vector<USBDevicePtr> m_devices;
+  };
+}
+
+#endif // _USB_DRIVER_TIMELINE_H__
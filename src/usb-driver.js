@@ -1,5 +1,8 @@
 var USBNativeDriver = require('../build/Release/usb_driver.node');
 
+// Default shared memory segment for shareDevices() and attachDevices()
+var SHARED_TABLE_NAME = '/usb-driver';
+
 /*
 Device Object
 {
@@ -16,10 +19,31 @@ Device Object
 function usbDriverFactory() {
   var self = {};
 
-  self.pollDevices  = pollDevices;
-  self.get          = get;
-  self.unmount      = unmount;
-  self.setLogFile   = setLogFile;
+  self.pollDevices      = pollDevices;
+  self.get              = get;
+  self.refresh          = refresh;
+  self.findDevices      = findDevices;
+  self.getDeviceByMount = getDeviceByMount;
+  self.getParent        = getParent;
+  self.getDescendants   = getDescendants;
+  self.unmount          = unmount;
+  self.setLogFile       = setLogFile;
+  self.configure        = configure;
+  self.startPolling     = startPolling;
+  self.stopPolling      = stopPolling;
+  self.events           = events;
+  self.getStats         = getStats;
+  self.getHistory       = getHistory;
+  self.shareDevices     = shareDevices;
+  self.attachDevices    = attachDevices;
+  self.detachDevices    = detachDevices;
+  self.startTracing     = startTracing;
+  self.stopTracing      = stopTracing;
+  self.dumpTrace        = dumpTrace;
+  self.startRecording   = startRecording;
+  self.stopRecording    = stopRecording;
+  self.replay           = replay;
+  self.cancelReplay     = cancelReplay;
 
   return self;
 
@@ -35,6 +59,36 @@ function usbDriverFactory() {
     });
   }
 
+  function refresh(id) {
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.refreshDevice(id));
+    });
+  }
+
+  function findDevices(query) {
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.findDevices(query || {}));
+    });
+  }
+
+  function getDeviceByMount(mountPoint) {
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.getDeviceByMount(mountPoint));
+    });
+  }
+
+  function getParent(id) {
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.getParent(id));
+    });
+  }
+
+  function getDescendants(id) {
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.getDescendants(id));
+    });
+  }
+
   function unmount(id) {
     return new Promise(function(resolve, reject) {
       if(USBNativeDriver.unmount(id)) {
@@ -49,6 +103,215 @@ function usbDriverFactory() {
     // TODO: Validate file path
     USBNativeDriver.setLogFile(filepath);
   }
+
+  function configure(options) {
+    USBNativeDriver.configure(options || {});
+  }
+
+  // Poll on a native thread and call `callback` with the device list on
+  // start and whenever it changed. `options` are passed to configure().
+  function startPolling(options, callback) {
+    if(typeof options === 'function') {
+      callback = options;
+      options = {};
+    }
+
+    USBNativeDriver.configure(options || {});
+    USBNativeDriver.startPolling(callback);
+  }
+
+  function stopPolling() {
+    USBNativeDriver.stopPolling();
+  }
+
+  // Async iterator of {type: 'attach'|'detach'|'change', device} events.
+  // At most `options.highWaterMark` events wait for the consumer; past that
+  // `options.overflow` drops the oldest ('drop-oldest'), merges events of
+  // the same device ('coalesce') or fails the iterator ('error').
+  function events(options) {
+    options = options || {};
+
+    var buffered = [];
+    var waiting = [];   // Pending next() calls, settled in order
+    var overflowed = false;
+    var closed = false;
+    var counts = { dropped: 0, coalesced: 0 };
+
+    var id = USBNativeDriver.openEvents(options.highWaterMark || 1024,
+                                        options.overflow || 'drop-oldest',
+                                        onReadable);
+
+    var iterator = {
+      next: next,
+      return: close,
+      stats: stats
+    };
+
+    if(typeof Symbol !== 'undefined' && Symbol.asyncIterator) {
+      iterator[Symbol.asyncIterator] = function() { return iterator; };
+    }
+
+    return iterator;
+
+    // Events are only pulled from the native queue once these are consumed
+    function read() {
+      var result = USBNativeDriver.readEvents(id);
+
+      buffered = buffered.concat(result.events);
+      counts.dropped = result.dropped;
+      counts.coalesced = result.coalesced;
+      overflowed = result.overflowed;
+    }
+
+    function settle(resolve, reject) {
+      if(closed) {
+        resolve({ value: undefined, done: true });
+        return true;
+      }
+
+      if(buffered.length === 0) {
+        read();
+      }
+
+      if(buffered.length > 0) {
+        resolve({ value: buffered.shift(), done: false });
+        return true;
+      }
+
+      if(overflowed) {
+        unsubscribe();
+        reject(new Error('Device event queue overflowed, ' + counts.dropped + ' events dropped'));
+        return true;
+      }
+
+      return false;
+    }
+
+    function onReadable() {
+      while(waiting.length > 0 && settle(waiting[0].resolve, waiting[0].reject)) {
+        waiting.shift();
+      }
+    }
+
+    function next() {
+      return new Promise(function(resolve, reject) {
+        // Earlier calls get the earlier events
+        if(waiting.length > 0 || !settle(resolve, reject)) {
+          waiting.push({ resolve: resolve, reject: reject });
+        }
+      });
+    }
+
+    function unsubscribe() {
+      if(!closed) {
+        closed = true;
+        buffered = [];
+        USBNativeDriver.closeEvents(id);
+      }
+    }
+
+    function close() {
+      unsubscribe();
+
+      waiting.splice(0).forEach(function(pending) {
+        pending.resolve({ value: undefined, done: true });
+      });
+
+      return Promise.resolve({ value: undefined, done: true });
+    }
+
+    // Events dropped and coalesced as of the last read
+    function stats() {
+      return { dropped: counts.dropped, coalesced: counts.coalesced, buffered: buffered.length };
+    }
+  }
+
+  // Counters describing the work done by the driver so far.
+  function getStats() {
+    return USBNativeDriver.getStats();
+  }
+
+  // When devices were attached, detached, mounted and unmounted, oldest
+  // first.
+  function getHistory(options) {
+    options = options || {};
+
+    // Dates convert to milliseconds
+    var since = +options.since || 0;
+    var until = +options.until || 0;
+
+    return new Promise(function(resolve) {
+      resolve(USBNativeDriver.getHistory(options, since, until));
+    });
+  }
+
+  // Enumerate devices for the other processes of this host, publishing
+  // every poll to the shared memory segment `name`.
+  function shareDevices(name) {
+    USBNativeDriver.shareDevices(name || SHARED_TABLE_NAME);
+  }
+
+  // Serve polls from the devices shared by another process instead of
+  // enumerating them.
+  function attachDevices(name) {
+    USBNativeDriver.attachDevices(name || SHARED_TABLE_NAME);
+  }
+
+  function detachDevices() {
+    USBNativeDriver.detachDevices();
+  }
+
+  // Record enumeration spans into a buffer holding at most `capacity` events.
+  function startTracing(capacity) {
+    USBNativeDriver.startTracing(capacity || 65536);
+  }
+
+  function stopTracing() {
+    USBNativeDriver.stopTracing();
+  }
+
+  // Write the recorded spans as Chrome trace-event JSON.
+  function dumpTrace(filepath) {
+    return new Promise(function(resolve, reject) {
+      if(USBNativeDriver.dumpTrace(filepath)) {
+        resolve();
+      } else {
+        reject(new Error('Failed to write trace to ' + filepath));
+      }
+    });
+  }
+
+  // Record hotplug events and device changes to a binary timeline.
+  function startRecording(filepath) {
+    USBNativeDriver.startRecording(filepath);
+  }
+
+  function stopRecording() {
+    USBNativeDriver.stopRecording();
+  }
+
+  // Feed a recorded timeline back as if it happened on this host.
+  // `options.speed` scales the recorded pace: 1 (default) for the original
+  // timing, 0 for as fast as possible.
+  function replay(filepath, options) {
+    options = options || {};
+
+    var speed = options.speed === undefined ? 1 : options.speed;
+
+    return new Promise(function(resolve, reject) {
+      USBNativeDriver.replay(filepath, speed, function(err, result) {
+        if(err) {
+          reject(err);
+        } else {
+          resolve(result);
+        }
+      });
+    });
+  }
+
+  function cancelReplay() {
+    USBNativeDriver.cancelReplay();
+  }
 };
 
 //USBDriver.prototype.on = function(event, callback) {
@@ -1,33 +1,124 @@
 #include "usb_common.h"
+#include "usb_registry.h"
+#include "utils/formatters.h"
+#include "utils/object_pool.h"
 
-static const size_t BUF_SIZE = 100;
+// Serial numbers come from string descriptors of at most 126 UTF-16 units,
+// so even fully expanded to UTF-8 and with all numbers they fit
+static const size_t UID_SIZE = 512;
 
 namespace USBDriver
 {
-  std::string uniqueDeviceID(const USBDevicePtr device)
+  typedef Utils::ObjectPool<sizeof(USBDevice)> DevicePool;
+
+  static DevicePool &_devicePool()
+  {
+    // Never destroyed, records held by other statics are released after it would be
+    static DevicePool *pool = new DevicePool;
+    return *pool;
+  }
+
+  void *USBDevice::operator new(size_t size)
+  {
+    // Derived types don't fit the pool slots
+    if(size != sizeof(USBDevice))
+      return ::operator new(size);
+
+    return _devicePool().allocate();
+  }
+
+  void USBDevice::operator delete(void *ptr, size_t size)
+  {
+    if(size != sizeof(USBDevice))
+      return ::operator delete(ptr);
+
+    _devicePool().deallocate(ptr);
+  }
+
+  Options &options()
+  {
+    static Options options;
+    return options;
+  }
+
+  Stats &stats()
+  {
+    static Stats stats;
+    return stats;
+  }
+
+  std::string uniqueDeviceID(const USBDevicePtr &device)
   {
     static unsigned long uniqueID = 0;
-    std::string uid = device->uid;
 
-    if(uid.empty()) {
-      uid.append(std::to_string(device->vendorID));
-      uid.append("-");
-      uid.append(std::to_string(device->productID));
+    if(!device->uid.empty())
+      return device->uid;
 
-      if(!device->serialNumber.empty()) {
-        uid.append("-");
-        uid.append(device->serialNumber);
-      }
+    Utils::FormatBuffer<UID_SIZE> uid;
 
-      // Always generate unique ID data
-      char buf[BUF_SIZE];
+    uid << device->vendorID << '-' << device->productID;
 
-      snprintf(buf, sizeof(buf), "%lu", uniqueID++);
+    if(!device->serialNumber.empty())
+      uid << '-' << device->serialNumber;
 
-      uid.append("-");
-      uid.append(buf);
+    // Always generate unique ID data
+    uid << '-' << uniqueID++;
+
+    return uid.str();
+  }
+
+  USBDevicePtr mergeDevice(const USBDevicePtr &previous, const USBDevicePtr &device)
+  {
+    if(previous == nullptr) {
+      device->uid = uniqueDeviceID(device);
+      return device;
     }
 
-    return uid;
+    if(previous->locationID == device->locationID && previous->vendorID == device->vendorID &&
+       previous->productID == device->productID && previous->product == device->product &&
+       previous->vendor == device->vendor && previous->serialNumber == device->serialNumber &&
+       previous->mountPoint == device->mountPoint && previous->filesystemUUID == device->filesystemUUID &&
+       previous->filesystemLabel == device->filesystemLabel && previous->busNumber == device->busNumber &&
+       previous->portPath == device->portPath && previous->speed == device->speed &&
+       previous->totalBytes == device->totalBytes && previous->freeBytes == device->freeBytes &&
+       previous->totalInodes == device->totalInodes && previous->freeInodes == device->freeInodes) {
+      return previous;
+    }
+
+    // Known devices keep their UID
+    device->uid = previous->uid;
+
+    return device;
+  }
+
+  bool sameDevices(const std::vector<USBDevicePtr> &a, const std::vector<USBDevicePtr> &b)
+  {
+    if(a.size() != b.size())
+      return false;
+
+    for(size_t i = 0; i < a.size(); ++i) {
+      if(a[i] != b[i])
+        return false;
+    }
+
+    return true;
+  }
+
+  USBDevicePtr updateDevice(const USBDevicePtr &previous, const USBDevicePtr &device)
+  {
+    DeviceRegistry &registry = DeviceRegistry::instance();
+
+    // Unplugged, or another device took its port
+    if(device == nullptr || device->vendorID != previous->vendorID ||
+       device->productID != previous->productID || device->serialNumber != previous->serialNumber) {
+      registry.remove(previous->uid);
+      return nullptr;
+    }
+
+    USBDevicePtr current = mergeDevice(previous, device);
+
+    registry.insert(current);
+
+    return current;
   }
 }
@@ -6,7 +6,47 @@
 
 namespace USBDriver
 {
-  std::string uniqueDeviceID(const USBDevicePtr device);
+  /**
+   * Generate the UID for a device, or return its existing one.
+   */
+  std::string uniqueDeviceID(const USBDevicePtr &device);
+  /**
+   * Reconcile a freshly read device with the record registered for it by
+   * an earlier poll, or nullptr for a new device. The previous record is
+   * returned as is when nothing changed, otherwise the fresh one takes
+   * over its UID.
+   */
+  USBDevicePtr mergeDevice(const USBDevicePtr &previous, const USBDevicePtr &device);
+  /**
+   * Whether two polls returned the same devices. Unchanged devices keep
+   * their record across polls, so comparing the records is enough.
+   */
+  bool sameDevices(const std::vector<USBDevicePtr> &a, const std::vector<USBDevicePtr> &b);
+  /**
+   * Register the result of re-reading a single device, nullptr if it
+   * couldn't be read. Returns the current record, or nullptr if the
+   * device is gone or another one took its place, which drops it from
+   * the registry.
+   */
+  USBDevicePtr updateDevice(const USBDevicePtr &previous, const USBDevicePtr &device);
+
+  /**
+   * Enumerate the attached devices through the OS. Implemented by each
+   * platform, getDevices() calls it unless devices come from a shared table.
+   */
+  std::vector<USBDevicePtr> enumerateDevices();
+  /**
+   * Re-read a device registered by an earlier enumeration, through what
+   * that enumeration recorded to find it again. Implemented by each
+   * platform, refreshDevice() calls it.
+   */
+  USBDevicePtr readDevice(const USBDevicePtr &device);
+  /**
+   * Forget what the last enumeration cached, so the next one registers
+   * every attached device again. Implemented by each platform, called
+   * after something other than enumerateDevices() filled the registry.
+   */
+  void invalidateDevices();
 }
 
 #endif // _USB_DRIVER_USB_COMMON_H__
@@ -0,0 +1,130 @@
+#include "usb_driver.h"
+#include "usb_common.h"
+#include "usb_registry.h"
+#include "poll_scheduler.h"
+#include "shared_table.h"
+#include "timeline.h"
+#include "utils.h"
+
+namespace USBDriver
+{
+  // Pick up anything the owner published since the last poll
+  static void _syncSharedTable()
+  {
+    if(SharedTable::instance().role() == SharedTable::READER)
+      SharedTable::instance().devices();
+  }
+
+  std::vector<USBDevicePtr> getDevices()
+  {
+    CORE_TRACE_SCOPE("enumeration", "getDevices");
+
+    ++stats().polls;
+
+    TimelineReplayer &replayer = TimelineReplayer::instance();
+
+    if(!replayer.beginPoll())
+      return replayer.devices();
+
+    SharedTable &table = SharedTable::instance();
+    std::vector<USBDevicePtr> devices;
+
+    // Another process enumerates for us
+    if(table.role() == SharedTable::READER) {
+      devices = table.devices();
+    } else {
+      devices = enumerateDevices();
+
+      if(table.role() == SharedTable::OWNER)
+        table.publish(devices);
+    }
+
+    TimelineRecorder &recorder = TimelineRecorder::instance();
+
+    if(recorder.isRecording())
+      recorder.recordSnapshot(devices);
+
+    replayer.endPoll();
+
+    return devices;
+  }
+
+  USBDevicePtr getDevice(const std::string &uid)
+  {
+    _syncSharedTable();
+
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    int ttl = options().deviceTTL;
+
+    if(ttl > 0 && registry.age(uid).count() >= ttl)
+      return refreshDevice(uid);
+
+    return registry.find(uid);
+  }
+
+  USBDevicePtr refreshDevice(const std::string &uid)
+  {
+    CORE_TRACE_SCOPE("enumeration", "refreshDevice");
+
+    TimelineReplayer &replayer = TimelineReplayer::instance();
+
+    // Replayed devices and devices another process enumerates can't be re-read here
+    if(SharedTable::instance().role() == SharedTable::READER || !replayer.beginPoll())
+      return DeviceRegistry::instance().find(uid);
+
+    USBDevicePtr device = DeviceRegistry::instance().find(uid);
+
+    if(device == nullptr) {
+      replayer.endPoll();
+      return nullptr;
+    }
+
+    ++stats().refreshes;
+
+    USBDevicePtr current = readDevice(device);
+
+    replayer.endPoll();
+
+    // Let the next poll deliver and publish the change
+    if(current != device)
+      PollScheduler::instance().wake();
+
+    return current;
+  }
+
+  std::vector<USBDevicePtr> findDevices(const DeviceQuery &query)
+  {
+    _syncSharedTable();
+
+    return DeviceRegistry::instance().query(query);
+  }
+
+  USBDevicePtr getDeviceByMount(const std::string &mountPoint)
+  {
+    if(mountPoint.empty())
+      return nullptr;
+
+    DeviceQuery query;
+    query.mountPoint = mountPoint;
+
+    _syncSharedTable();
+
+    std::vector<USBDevicePtr> devices = DeviceRegistry::instance().query(query);
+
+    return devices.empty() ? nullptr : devices[0];
+  }
+
+  USBDevicePtr getParent(const std::string &uid)
+  {
+    _syncSharedTable();
+
+    return DeviceRegistry::instance().parent(uid);
+  }
+
+  std::vector<USBDevicePtr> getDescendants(const std::string &uid)
+  {
+    _syncSharedTable();
+
+    return DeviceRegistry::instance().descendants(uid);
+  }
+}
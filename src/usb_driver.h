@@ -1,41 +1,147 @@
 #ifndef SRC_USB_DRIVER_H_
 #define SRC_USB_DRIVER_H_
 
+#include "utils/intrusive_ptr.h"
+#include "utils/strings.h"
+
+#include <atomic>
+#include <functional>
 #include <string>
 #include <vector>
-#include <memory>
+#include <stdint.h>
 
 namespace USBDriver
 {
-  typedef struct USBDevice {
-    std::string uid;           // Unique ID for each device.
-    int locationID;            // USB Location ID data.
-    int productID;             // USB product ID data.
-    int vendorID;              // USB vendor ID data.
-    std::string product;       // The product name.
-    std::string serialNumber;  // the full serial number. Can be empty.
-    std::string vendor;        // The vendor name.
-    std::string mountPoint;    // The disk mount point. Can be empty.
+  typedef struct USBDevice : public Utils::RefCounted<USBDevice> {
+    std::string uid;                          // Unique ID for each device.
+    int locationID;                           // USB Location ID data.
+    int productID;                            // USB product ID data.
+    int vendorID;                             // USB vendor ID data.
+    Utils::InternedString product;            // The product name.
+    Utils::SmallString<32> serialNumber;      // the full serial number. Can be empty.
+    Utils::InternedString vendor;             // The vendor name.
+    Utils::SmallString<64> mountPoint;        // The disk mount point. Can be empty.
+    Utils::SmallString<40> filesystemUUID;    // UUID of the mounted file system, see Options.
+    Utils::SmallString<32> filesystemLabel;   // Label of the mounted file system, see Options.
+    int busNumber;                            // The USB bus, 0 if the topology is unknown.
+    Utils::SmallString<16> portPath;          // Hub ports from the root hub down, e.g. "2.4".
+    double speed;                             // Negotiated link speed in Mbit/s, 0 if unknown.
+    uint64_t totalBytes;                      // Size of the mounted volume, see Options.
+    uint64_t freeBytes;                       // Bytes available on the mounted volume, see Options.
+    uint64_t totalInodes;                     // Inodes of the mounted volume, see Options.
+    uint64_t freeInodes;                      // Inodes available on the mounted volume, see Options.
+
+    USBDevice() : locationID(0), productID(0), vendorID(0), busNumber(0), speed(0), totalBytes(0),
+                  freeBytes(0), totalInodes(0), freeInodes(0) {}
+
+    // Records are allocated from a pool, see usb_common.cc
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
   } USBDevice;
 
-  // Shared resource to the USB device
-  // TODO: Make all of this const
-  typedef std::shared_ptr<USBDevice> USBDevicePtr;
+  // Shared resource to the USB device. Registered records are never
+  // modified, a device that changed gets a new record, so they can be
+  // read from any thread.
+  typedef Utils::IntrusivePtr<USBDevice> USBDevicePtr;
+
+  /**
+   * Runtime settings shared by all platforms. Settings that don't apply
+   * to the current platform are ignored.
+   */
+  typedef struct Options {
+    std::atomic<bool> ioUring;            // Linux: batch sysfs reads through io_uring when available.
+    std::atomic<int> attributeFdBudget;   // Linux: sysfs attribute files kept open across polls.
+    std::atomic<int> pollIntervalMin;     // Scheduler interval right after a change, in milliseconds.
+    std::atomic<int> pollIntervalMax;     // Scheduler interval once idle, in milliseconds.
+    std::atomic<bool> filesystemInfo;     // Read the UUID and label of mounted file systems.
+    std::atomic<int> deviceTTL;           // getDevice() re-reads devices older than this, in milliseconds.
+    std::atomic<bool> capacityInfo;       // Read the size and free space of mounted volumes.
+    std::atomic<int> capacityTTL;         // Milliseconds a volume capacity is cached for.
+    std::atomic<int> capacityTimeout;     // Milliseconds a poll waits for a volume capacity.
+
+    Options() : ioUring(false), attributeFdBudget(256), pollIntervalMin(100), pollIntervalMax(2000),
+                filesystemInfo(false), deviceTTL(0), capacityInfo(false), capacityTTL(5000),
+                capacityTimeout(200) {}
+  } Options;
+
+  Options &options();
+
+  /**
+   * Counters describing the work done so far, see getStats() in JS.
+   */
+  typedef struct Stats {
+    std::atomic<const char *> watcher;         // Hotplug event source of the poll scheduler.
+    std::atomic<unsigned long> polls;          // Calls to getDevices().
+    std::atomic<unsigned long> scans;          // Polls which had to enumerate devices.
+    std::atomic<unsigned long> deviceReads;    // Devices whose attributes were read from the OS.
+    std::atomic<unsigned long> watcherEvents;  // Hotplug events received by the watcher.
+    std::atomic<unsigned long> refreshes;      // Single devices re-read by refreshDevice().
+
+    Stats() : watcher("none"), polls(0), scans(0), deviceReads(0), watcherEvents(0), refreshes(0) {}
+  } Stats;
+
+  Stats &stats();
+
+  /**
+   * Criteria for findDevices(). Devices must match all criteria given.
+   */
+  typedef struct DeviceQuery {
+    int vendorID;               // -1 for any.
+    int productID;              // -1 for any.
+    std::string serialNumber;   // Empty for any.
+    std::string mountPoint;     // Empty for any.
+
+    DeviceQuery() : vendorID(-1), productID(-1) {}
+  } DeviceQuery;
 
   /**
    * Get data for all connected devices.
    */
   std::vector<USBDevicePtr> getDevices();
   /**
-   * Get a device with the given UID.
+   * Get a device with the given UID. Devices last read longer ago than
+   * options().deviceTTL are refreshed first.
    */
   USBDevicePtr getDevice(const std::string &uid);
+  /**
+   * Re-read the attributes and mount of a single device, without
+   * enumerating the others. Returns nullptr if it is no longer attached.
+   */
+  USBDevicePtr refreshDevice(const std::string &uid);
+  /**
+   * Get the devices seen by the last poll matching `query`, without
+   * enumerating.
+   */
+  std::vector<USBDevicePtr> findDevices(const DeviceQuery &query);
+  /**
+   * Get the device mounted at the given path, as reported in its
+   * mountPoint, or nullptr.
+   */
+  USBDevicePtr getDeviceByMount(const std::string &mountPoint);
+  /**
+   * Get the hub the device with the given UID is plugged into, or nullptr
+   * if it is plugged into a root hub or its topology is unknown.
+   */
+  USBDevicePtr getParent(const std::string &uid);
+  /**
+   * Get every device plugged in below the hub with the given UID, parents
+   * before their children.
+   */
+  std::vector<USBDevicePtr> getDescendants(const std::string &uid);
 
   /**
    * Unmount the device with the given UID.
    */
   bool unmount(const std::string &uid);
 
+  /**
+   * Call `onEvent` from a background thread whenever the platform reports
+   * a device being attached, detached or partitioned. Returns the name of
+   * the event source in use, or "poll" if there is none.
+   */
+  const char *watchDevices(const std::function<void()> &onEvent);
+  void unwatchDevices();
+
   // TODO: Add a Mount function
 }
 
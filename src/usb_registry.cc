@@ -0,0 +1,335 @@
+#include "usb_registry.h"
+#include "journal.h"
+
+using std::chrono::steady_clock;
+
+namespace USBDriver
+{
+  template<typename Index, typename Key>
+  static void _eraseFromIndex(Index &index, const Key &key, const std::string &uid)
+  {
+    auto range = index.equal_range(key);
+
+    for(auto it = range.first; it != range.second; ++it) {
+      if(it->second == uid) {
+        index.erase(it);
+        return;
+      }
+    }
+  }
+
+  // "<bus>-<port path>", empty if the topology is unknown
+  static std::string _portKey(const USBDevicePtr &device)
+  {
+    if(device->busNumber <= 0 || device->portPath.empty())
+      return std::string();
+
+    return std::to_string(device->busNumber) + "-" + device->portPath.str();
+  }
+
+  // The key of the hub above, empty for devices on a root hub
+  static std::string _parentKey(const std::string &key)
+  {
+    size_t dot = key.rfind('.');
+
+    return dot == std::string::npos ? std::string() : key.substr(0, dot);
+  }
+
+  /**
+   * Journal what changed between two records of a device, nullptr for
+   * none before an attach or after a detach.
+   */
+  static void _journalChange(const USBDevicePtr &previous, const USBDevicePtr &device)
+  {
+    DeviceJournal &journal = DeviceJournal::instance();
+
+    if(previous == nullptr)
+      journal.record(JournalEntry::ATTACH, device);
+
+    if(previous != nullptr && !previous->mountPoint.empty() &&
+       (device == nullptr || previous->mountPoint != device->mountPoint))
+      journal.record(JournalEntry::UNMOUNT, previous);
+
+    if(device != nullptr && !device->mountPoint.empty() &&
+       (previous == nullptr || previous->mountPoint != device->mountPoint))
+      journal.record(JournalEntry::MOUNT, device);
+
+    if(device == nullptr)
+      journal.record(JournalEntry::DETACH, previous);
+  }
+
+  static bool _matches(const USBDevicePtr &device, const DeviceQuery &query)
+  {
+    return (query.vendorID < 0 || device->vendorID == query.vendorID) &&
+      (query.productID < 0 || device->productID == query.productID) &&
+      (query.serialNumber.empty() || device->serialNumber == query.serialNumber) &&
+      (query.mountPoint.empty() || device->mountPoint == query.mountPoint);
+  }
+
+  DeviceRegistry::DeviceRegistry()
+    : m_generation(0)
+  {
+  }
+
+  USBDevicePtr DeviceRegistry::find(const std::string &uid) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_devices.find(uid);
+
+    return it != m_devices.end() ? it->second.device : nullptr;
+  }
+
+  USBDevicePtr DeviceRegistry::findAttached(int locationID, int vendorID, int productID,
+                                            const std::string &serialNumber) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto range = m_locations.equal_range(locationID);
+
+    for(auto location = range.first; location != range.second; ++location) {
+      auto it = m_devices.find(location->second);
+
+      if(it == m_devices.end() || it->second.generation == m_generation)
+        continue;
+
+      const USBDevicePtr &device = it->second.device;
+
+      if(device->locationID == locationID && device->vendorID == vendorID &&
+         device->productID == productID && device->serialNumber == serialNumber) {
+        return device;
+      }
+    }
+
+    return nullptr;
+  }
+
+  std::vector<USBDevicePtr> DeviceRegistry::query(const DeviceQuery &query) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<USBDevicePtr> devices;
+
+    auto collect = [this, &query, &devices](const std::string &uid) {
+      auto it = m_devices.find(uid);
+
+      if(it != m_devices.end() && _matches(it->second.device, query))
+        devices.push_back(it->second.device);
+    };
+
+    // Most selective first
+    if(!query.mountPoint.empty()) {
+      auto range = m_mountPoints.equal_range(query.mountPoint);
+
+      for(auto it = range.first; it != range.second; ++it)
+        collect(it->second);
+    } else if(!query.serialNumber.empty()) {
+      auto range = m_serialNumbers.equal_range(query.serialNumber);
+
+      for(auto it = range.first; it != range.second; ++it)
+        collect(it->second);
+    } else if(query.productID >= 0) {
+      auto range = m_products.equal_range(query.productID);
+
+      for(auto it = range.first; it != range.second; ++it)
+        collect(it->second);
+    } else if(query.vendorID >= 0) {
+      auto range = m_vendors.equal_range(query.vendorID);
+
+      for(auto it = range.first; it != range.second; ++it)
+        collect(it->second);
+    } else {
+      for(auto &entry : m_devices)
+        devices.push_back(entry.second.device);
+    }
+
+    return devices;
+  }
+
+  USBDevicePtr DeviceRegistry::parent(const std::string &uid) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_devices.find(uid);
+
+    if(it == m_devices.end())
+      return nullptr;
+
+    auto port = m_ports.find(_parentKey(_portKey(it->second.device)));
+
+    if(port == m_ports.end())
+      return nullptr;
+
+    auto parent = m_devices.find(port->second);
+
+    return parent != m_devices.end() ? parent->second.device : nullptr;
+  }
+
+  std::vector<USBDevicePtr> DeviceRegistry::descendants(const std::string &uid) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<USBDevicePtr> devices;
+    auto it = m_devices.find(uid);
+
+    if(it == m_devices.end())
+      return devices;
+
+    std::string key = _portKey(it->second.device);
+
+    if(key.empty())
+      return devices;
+
+    std::vector<std::string> hubs(1, key);
+
+    // Devices found so far double as the queue
+    for(size_t next = 0; next < hubs.size(); ++next) {
+      auto range = m_children.equal_range(hubs[next]);
+
+      for(auto child = range.first; child != range.second; ++child) {
+        auto device = m_devices.find(child->second);
+
+        if(device == m_devices.end())
+          continue;
+
+        devices.push_back(device->second.device);
+        hubs.push_back(_portKey(device->second.device));
+      }
+    }
+
+    return devices;
+  }
+
+  void DeviceRegistry::beginUpdate()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    ++m_generation;
+  }
+
+  void DeviceRegistry::insert(const USBDevicePtr &device)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Entry &entry = m_devices[device->uid];
+
+    // New, or changed since the last poll
+    if(entry.device != device) {
+      if(entry.device != nullptr)
+        unindex(entry.device);
+
+      index(device);
+      _journalChange(entry.device, device);
+    }
+
+    entry.device = device;
+    entry.generation = m_generation;
+    entry.refreshed = steady_clock::now();
+  }
+
+  void DeviceRegistry::endUpdate()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for(auto it = m_devices.begin(); it != m_devices.end();) {
+      if(it->second.generation == m_generation) {
+        ++it;
+        continue;
+      }
+
+      unindex(it->second.device);
+      _journalChange(it->second.device, nullptr);
+
+      it = m_devices.erase(it);
+    }
+  }
+
+  void DeviceRegistry::remove(const std::string &uid)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_devices.find(uid);
+
+    if(it == m_devices.end())
+      return;
+
+    unindex(it->second.device);
+    _journalChange(it->second.device, nullptr);
+
+    m_devices.erase(it);
+  }
+
+  void DeviceRegistry::touch()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto now = steady_clock::now();
+
+    for(auto &device : m_devices)
+      device.second.refreshed = now;
+  }
+
+  std::chrono::milliseconds DeviceRegistry::age(const std::string &uid) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_devices.find(uid);
+
+    if(it == m_devices.end())
+      return std::chrono::milliseconds(-1);
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - it->second.refreshed);
+  }
+
+  void DeviceRegistry::index(const USBDevicePtr &device)
+  {
+    m_locations.emplace(device->locationID, device->uid);
+    m_vendors.emplace(device->vendorID, device->uid);
+    m_products.emplace(device->productID, device->uid);
+
+    if(!device->serialNumber.empty())
+      m_serialNumbers.emplace(device->serialNumber.str(), device->uid);
+
+    if(!device->mountPoint.empty())
+      m_mountPoints.emplace(device->mountPoint.str(), device->uid);
+
+    std::string key = _portKey(device);
+
+    if(!key.empty()) {
+      m_ports[key] = device->uid;
+      m_children.emplace(_parentKey(key), device->uid);
+    }
+  }
+
+  void DeviceRegistry::unindex(const USBDevicePtr &device)
+  {
+    _eraseFromIndex(m_locations, device->locationID, device->uid);
+    _eraseFromIndex(m_vendors, device->vendorID, device->uid);
+    _eraseFromIndex(m_products, device->productID, device->uid);
+
+    if(!device->serialNumber.empty())
+      _eraseFromIndex(m_serialNumbers, device->serialNumber.str(), device->uid);
+
+    if(!device->mountPoint.empty())
+      _eraseFromIndex(m_mountPoints, device->mountPoint.str(), device->uid);
+
+    std::string key = _portKey(device);
+
+    if(!key.empty()) {
+      auto port = m_ports.find(key);
+
+      // The port may already belong to a device inserted by this poll
+      if(port != m_ports.end() && port->second == device->uid)
+        m_ports.erase(port);
+
+      _eraseFromIndex(m_children, _parentKey(key), device->uid);
+    }
+  }
+
+  size_t DeviceRegistry::size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_devices.size();
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef _USB_DRIVER_USB_REGISTRY_H__
+#define _USB_DRIVER_USB_REGISTRY_H__
+
+#include "usb_driver.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace USBDriver
+{
+  /**
+   * Registry of the devices seen by the last poll, shared by the platform
+   * implementations.
+   *
+   * Each poll is bracketed by beginUpdate() and endUpdate(). Devices which
+   * were not inserted in between are evicted, so the registry only ever
+   * holds attached devices regardless of how often they are re-plugged.
+   *
+   * Devices are also indexed by location, vendor, product, serial number
+   * and mount point, and devices with a known topology form a tree keyed
+   * by their port. Records are immutable, so the indices are only touched
+   * when a device gets a new record.
+   */
+  class DeviceRegistry
+  {
+  public:
+    static DeviceRegistry &instance()
+    {
+      static DeviceRegistry instance;
+      return instance;
+    }
+
+    /**
+     * Get the device with the given UID, or nullptr if it is not attached.
+     */
+    USBDevicePtr find(const std::string &uid) const;
+    /**
+     * Get the device previously seen at the given location, if it still
+     * has the same identity. A different device plugged into the same port
+     * yields nullptr so that it receives its own UID. Devices already
+     * inserted by the current poll are never returned twice.
+     */
+    USBDevicePtr findAttached(int locationID, int vendorID, int productID,
+                              const std::string &serialNumber) const;
+    /**
+     * Get the attached devices matching all given criteria, in no
+     * particular order. Only the devices sharing the most selective
+     * criterion are looked at.
+     */
+    std::vector<USBDevicePtr> query(const DeviceQuery &query) const;
+    /**
+     * Get the hub a device is plugged into, if it is attached.
+     */
+    USBDevicePtr parent(const std::string &uid) const;
+    /**
+     * Get the devices below a hub, breadth first. Only the subtree is
+     * visited.
+     */
+    std::vector<USBDevicePtr> descendants(const std::string &uid) const;
+
+    void beginUpdate();
+    /**
+     * Register a device as seen by the current poll.
+     */
+    void insert(const USBDevicePtr &device);
+    /**
+     * Evict all devices that were not seen since beginUpdate().
+     */
+    void endUpdate();
+
+    /**
+     * Forget a device outside of a poll, e.g. when a refresh found it gone.
+     */
+    void remove(const std::string &uid);
+    /**
+     * Mark every device as just read, for polls that verified nothing
+     * changed without reading devices again.
+     */
+    void touch();
+    /**
+     * How long ago the device was last read from the OS, or a negative
+     * duration if it is not attached.
+     */
+    std::chrono::milliseconds age(const std::string &uid) const;
+
+    size_t size() const;
+
+  private:
+    DeviceRegistry();
+    DeviceRegistry(const DeviceRegistry &);
+    DeviceRegistry &operator=(const DeviceRegistry &);
+
+    void index(const USBDevicePtr &device);
+    void unindex(const USBDevicePtr &device);
+
+    typedef struct Entry {
+      USBDevicePtr device;       // The record the indices point at.
+      unsigned long generation;  // The last poll this device was seen in.
+      std::chrono::steady_clock::time_point refreshed;   // When it was last read.
+    } Entry;
+
+    typedef std::unordered_map<std::string, Entry> DeviceMap;
+    // Secondary keys to UIDs. Location IDs can collide too, e.g. Linux
+    // ports above 15 don't fit a nibble.
+    typedef std::unordered_multimap<int, std::string> NumberIndex;
+    typedef std::unordered_multimap<std::string, std::string> StringIndex;
+
+    mutable std::mutex m_mutex;
+    DeviceMap m_devices;
+    NumberIndex m_locations;
+    NumberIndex m_vendors;
+    NumberIndex m_products;
+    StringIndex m_serialNumbers;   // Devices with a serial number only.
+    StringIndex m_mountPoints;     // Mounted devices only.
+    // Topology, by port key "<bus>-<port path>" as in Linux sysfs names
+    std::unordered_map<std::string, std::string> m_ports;
+    StringIndex m_children;        // Port key of the parent hub to UIDs.
+    unsigned long m_generation;
+  };
+}
+
+#endif // _USB_DRIVER_USB_REGISTRY_H__
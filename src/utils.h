@@ -3,5 +3,6 @@
 
 #include "utils/logger.h"
 #include "utils/formatters.h"
+#include "utils/tracer.h"
 
 #endif // _USB_DRIVER_UTILS_H__
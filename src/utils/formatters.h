@@ -1,8 +1,11 @@
 #ifndef _USB_DRIVER_UTILS_FORMATTERS_H__
 #define _USB_DRIVER_UTILS_FORMATTERS_H__
 
+#include "strings.h"
+
 #include <string>
-#include <stdlib.h>
+#include <type_traits>
+#include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Formatters
@@ -11,15 +14,156 @@ namespace USBDriver
 {
   namespace Utils
   {
+    /**
+     * Integer written in lower case hexadecimal, without a prefix, zero
+     * padded to at least Width digits. See hex().
+     */
+    template<unsigned Width, typename T>
+      struct HexSpec {
+        T value;
+      };
+
+    /**
+     * Format `value` in hexadecimal, e.g. `buf << hex<4>(productID)`. Non
+     * integers and widths the type can't fill are rejected at compile time.
+     */
+    template<unsigned Width = 0, typename T>
+      HexSpec<Width, T> hex(T value)
+      {
+        static_assert(std::is_integral<T>::value && !std::is_same<T, bool>::value,
+                      "hex() only formats integers");
+        static_assert(Width <= 2 * sizeof(T), "hex() width is wider than the type");
+
+        HexSpec<Width, T> spec = { value };
+        return spec;
+      }
+
+    // Integers formatted in decimal, characters and booleans aren't
+    template<typename T>
+      struct IsFormattedInteger {
+        static const bool value = std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+          !std::is_same<T, char>::value;
+      };
+
+    /**
+     * Text formatted into an inline buffer of N - 1 characters, never
+     * touching the heap. Anything past the capacity is dropped, see
+     * truncated(). Values are appended with operator<<, which takes
+     * strings, characters, integers and hex() specs only, so passing
+     * anything else fails to compile instead of formatting garbage.
+     */
+    template<size_t N>
+      class FormatBuffer
+      {
+      public:
+        FormatBuffer() : m_size(0), m_truncated(false) { m_data[0] = '\0'; }
+
+        FormatBuffer &append(const char *str, size_t len)
+        {
+          size_t room = N - 1 - m_size;
+
+          if(len > room) {
+            len = room;
+            m_truncated = true;
+          }
+
+          memcpy(m_data + m_size, str, len);
+          m_size += len;
+          m_data[m_size] = '\0';
+
+          return *this;
+        }
+
+        FormatBuffer &operator<<(const char *str) { return append(str, strlen(str)); }
+        FormatBuffer &operator<<(const std::string &str) { return append(str.data(), str.size()); }
+        FormatBuffer &operator<<(const InternedString &str) { return append(str.c_str(), str.size()); }
+
+        template<size_t M>
+          FormatBuffer &operator<<(const SmallString<M> &str) { return append(str.c_str(), str.size()); }
+
+        // A template, so numbers don't silently convert to characters
+        template<typename T>
+          typename std::enable_if<std::is_same<T, char>::value, FormatBuffer &>::type operator<<(T c)
+          {
+            return append(&c, 1);
+          }
+
+        template<typename T>
+          typename std::enable_if<IsFormattedInteger<T>::value, FormatBuffer &>::type operator<<(T value)
+          {
+            typedef typename std::make_unsigned<T>::type Unsigned;
+
+            bool negative = isNegative(value, std::is_signed<T>());
+            Unsigned magnitude = negative ? Unsigned(0) - Unsigned(value) : Unsigned(value);
+
+            // Enough for 64 bit values
+            char digits[20];
+            size_t first = sizeof(digits);
+
+            do {
+              digits[--first] = static_cast<char>('0' + magnitude % 10);
+              magnitude /= 10;
+            } while(magnitude != 0);
+
+            if(negative)
+              append("-", 1);
+
+            return append(digits + first, sizeof(digits) - first);
+          }
+
+        template<unsigned Width, typename T>
+          FormatBuffer &operator<<(const HexSpec<Width, T> &spec)
+          {
+            static const char DIGITS[] = "0123456789abcdef";
+
+            typename std::make_unsigned<T>::type value = spec.value;
+            char digits[2 * sizeof(T)];
+            size_t first = sizeof(digits);
+
+            do {
+              digits[--first] = DIGITS[value & 0xf];
+              value >>= 4;
+            } while(value != 0);
+
+            while(sizeof(digits) - first < Width)
+              digits[--first] = '0';
+
+            return append(digits + first, sizeof(digits) - first);
+          }
+
+        void clear()
+        {
+          m_size = 0;
+          m_truncated = false;
+          m_data[0] = '\0';
+        }
+
+        const char *c_str() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        // Whether something didn't fit
+        bool truncated() const { return m_truncated; }
+        std::string str() const { return std::string(m_data, m_size); }
+
+      private:
+        template<typename T>
+          static bool isNegative(T value, std::true_type) { return value < 0; }
+        template<typename T>
+          static bool isNegative(T, std::false_type) { return false; }
+
+        char m_data[N];
+        size_t m_size;
+        bool m_truncated;
+      };
+
     template<typename T>
       std::string hexify(T val)
       {
-        std::string str = std::to_string(val);
+        FormatBuffer<2 * sizeof(T) + 3> str;
 
-        char tmp[str.size()];
-        snprintf(tmp, sizeof(tmp), "0x%lx", atol(str.c_str()));
+        str << "0x" << hex(val);
 
-        return tmp;
+        return str.str();
       }
   }
 }
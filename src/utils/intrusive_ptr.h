@@ -0,0 +1,98 @@
+#ifndef _USB_DRIVER_UTILS_INTRUSIVE_PTR_H__
+#define _USB_DRIVER_UTILS_INTRUSIVE_PTR_H__
+
+#include <atomic>
+#include <cstddef>
+
+////////////////////////////////////////////////////////////////////////////////
+// Reference counting
+////////////////////////////////////////////////////////////////////////////////
+namespace USBDriver
+{
+  namespace Utils
+  {
+    /**
+     * Base for objects owned through IntrusivePtr. Keeping the count inside
+     * the object avoids the separate control block of std::shared_ptr.
+     */
+    template<typename T>
+      class RefCounted
+      {
+      public:
+        RefCounted() : m_refCount(0) {}
+        // Copies are new objects, so they start without owners
+        RefCounted(const RefCounted &) : m_refCount(0) {}
+        RefCounted &operator=(const RefCounted &) { return *this; }
+
+        void retain() const
+        {
+          m_refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release() const
+        {
+          if(m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete static_cast<const T *>(this);
+        }
+
+      private:
+        mutable std::atomic<int> m_refCount;
+      };
+
+    template<typename T>
+      class IntrusivePtr
+      {
+      public:
+        IntrusivePtr() : m_ptr(nullptr) {}
+        IntrusivePtr(std::nullptr_t) : m_ptr(nullptr) {}
+
+        explicit IntrusivePtr(T *ptr) : m_ptr(ptr)
+        {
+          if(m_ptr)
+            m_ptr->retain();
+        }
+
+        IntrusivePtr(const IntrusivePtr &other) : m_ptr(other.m_ptr)
+        {
+          if(m_ptr)
+            m_ptr->retain();
+        }
+
+        IntrusivePtr(IntrusivePtr &&other) : m_ptr(other.m_ptr)
+        {
+          other.m_ptr = nullptr;
+        }
+
+        ~IntrusivePtr()
+        {
+          if(m_ptr)
+            m_ptr->release();
+        }
+
+        IntrusivePtr &operator=(IntrusivePtr other)
+        {
+          T *tmp = m_ptr;
+          m_ptr = other.m_ptr;
+          other.m_ptr = tmp;
+
+          return *this;
+        }
+
+        T *get() const { return m_ptr; }
+        T *operator->() const { return m_ptr; }
+        T &operator*() const { return *m_ptr; }
+
+        explicit operator bool() const { return m_ptr != nullptr; }
+
+        bool operator==(const IntrusivePtr &other) const { return m_ptr == other.m_ptr; }
+        bool operator!=(const IntrusivePtr &other) const { return m_ptr != other.m_ptr; }
+        bool operator==(std::nullptr_t) const { return m_ptr == nullptr; }
+        bool operator!=(std::nullptr_t) const { return m_ptr != nullptr; }
+
+      private:
+        T *m_ptr;
+      };
+  }
+}
+
+#endif // _USB_DRIVER_UTILS_INTRUSIVE_PTR_H__
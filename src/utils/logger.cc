@@ -1,9 +1,31 @@
 #include "logger.h"
+#include "formatters.h"
+
+#include <functional>
 
 #include <errno.h>
 #include <string.h>
 
+using std::chrono::steady_clock;
+
+// Messages tracked for repeats at most, further ones are always written
+static const size_t MAX_REPEATS = 256;
+
+// FNV-1a, std::hash only takes whole strings
+static size_t _hashMessage(const char *msg, size_t len)
+{
+  size_t hash = static_cast<size_t>(14695981039346656037ULL);
+
+  for(size_t i = 0; i < len; ++i) {
+    hash ^= static_cast<unsigned char>(msg[i]);
+    hash *= static_cast<size_t>(1099511628211ULL);
+  }
+
+  return hash;
+}
+
 Logger::Logger()
+  : m_repeatWindow(60000), m_suppressed(0), m_repeatRecords(0)
 {
   // Default to STDOUT
   m_pLogFile = stdout;
@@ -11,6 +33,10 @@ Logger::Logger()
 
 Logger::~Logger()
 {
+  // Don't lose the count of what was left out
+  for(auto &entry : m_repeats)
+    reportRepeats(entry.second);
+
   if(m_pLogFile != stdout || m_pLogFile != stderr) {
     fclose(m_pLogFile);
   }
@@ -24,11 +50,55 @@ void Logger::setLogFile(const char *filename)
 void Logger::log(const std::string &tag, const std::string &msg,
                  const char *funcName, const char *sourceFile, unsigned int lineNum)
 {
-  std::string outputBuffer;
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  write(tag.c_str(), msg.data(), msg.size(), funcName, sourceFile, lineNum);
+}
+
+bool Logger::log(const void *site, const char *tag, const char *msg, size_t len,
+                 const char *funcName, const char *sourceFile, unsigned int lineNum)
+{
+  auto now = steady_clock::now();
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if(m_repeatWindow.count() == 0) {
+    write(tag, msg, len, funcName, sourceFile, lineNum);
+    return true;
+  }
+
+  RepeatKey key(site, _hashMessage(msg, len));
+  auto repeat = m_repeats.find(key);
+
+  if(repeat != m_repeats.end()) {
+    // A hash collision is left untracked
+    if(repeat->second.msg.compare(0, std::string::npos, msg, len) != 0) {
+      write(tag, msg, len, funcName, sourceFile, lineNum);
+      return true;
+    }
+
+    if(now - repeat->second.since < m_repeatWindow) {
+      ++repeat->second.count;
+      ++m_suppressed;
+
+      return false;
+    }
+
+    reportRepeats(repeat->second);
+    repeat->second.since = now;
+  } else {
+    if(m_repeats.size() >= MAX_REPEATS)
+      expireRepeats(now);
 
-  fillOutputBuffer(outputBuffer, tag, msg, funcName, sourceFile, lineNum);
+    if(m_repeats.size() < MAX_REPEATS) {
+      Repeat fresh = { tag, std::string(msg, len), now, 0 };
 
-  fprintf(m_pLogFile, "%s", outputBuffer.c_str());
+      m_repeats.insert(std::make_pair(key, std::move(fresh)));
+    }
+  }
+
+  write(tag, msg, len, funcName, sourceFile, lineNum);
+
+  return true;
 }
 
 void Logger::flush()
@@ -36,31 +106,70 @@ void Logger::flush()
   fflush(m_pLogFile);
 }
 
-void Logger::fillOutputBuffer(std::string &outputBuffer, const std::string &tag,
-                              const std::string &msg, const char *funcName,
-                              const char *sourceFile,  unsigned int lineNum)
+void Logger::setRepeatWindow(unsigned int milliseconds)
 {
-  if(!tag.empty())
-    outputBuffer = "[" + tag + "] ";
+  std::lock_guard<std::mutex> lock(m_mutex);
 
-  outputBuffer += msg;
+  m_repeatWindow = std::chrono::milliseconds(milliseconds);
 
-  if(funcName != NULL) {
-    outputBuffer += "\nFunction: ";
-    outputBuffer += funcName;
-  }
+  if(milliseconds == 0) {
+    for(auto &entry : m_repeats)
+      reportRepeats(entry.second);
 
-  if(sourceFile != NULL) {
-    outputBuffer += "\nSource File: ";
-    outputBuffer += sourceFile;
+    m_repeats.clear();
   }
+}
 
-  if(lineNum != 0) {
-    outputBuffer += "\nLine: ";
-    outputBuffer += std::to_string(lineNum);
-  }
+void Logger::write(const char *tag, const char *msg, size_t len, const char *funcName,
+                   const char *sourceFile, unsigned int lineNum, unsigned long repeats)
+{
+  // The message is written as is, so records of any length stay off the heap
+  USBDriver::Utils::FormatBuffer<64> prefix;
+  USBDriver::Utils::FormatBuffer<512> suffix;
+
+  if(tag[0] != '\0')
+    prefix << '[' << tag << "] ";
+
+  if(repeats != 0)
+    suffix << " (repeated " << repeats << " times)";
+
+  if(funcName != NULL)
+    suffix << "\nFunction: " << funcName;
+
+  if(sourceFile != NULL)
+    suffix << "\nSource File: " << sourceFile;
 
-  outputBuffer += "\n";
+  if(lineNum != 0)
+    suffix << "\nLine: " << lineNum;
+
+  fwrite(prefix.c_str(), 1, prefix.size(), m_pLogFile);
+  fwrite(msg, 1, len, m_pLogFile);
+  fwrite(suffix.c_str(), 1, suffix.size(), m_pLogFile);
+  fputc('\n', m_pLogFile);
+}
+
+void Logger::reportRepeats(Repeat &repeat)
+{
+  if(repeat.count == 0)
+    return;
+
+  write(repeat.tag.c_str(), repeat.msg.data(), repeat.msg.size(), NULL, NULL, 0, repeat.count);
+
+  repeat.count = 0;
+  ++m_repeatRecords;
+}
+
+void Logger::expireRepeats(steady_clock::time_point now)
+{
+  for(auto it = m_repeats.begin(); it != m_repeats.end();) {
+    if(now - it->second.since < m_repeatWindow) {
+      ++it;
+      continue;
+    }
+
+    reportRepeats(it->second);
+    it = m_repeats.erase(it);
+  }
 }
 
 FILE *Logger::loadFileStream(FILE *stream, const char *filename)
@@ -1,8 +1,14 @@
 #ifndef _USB_DRIVER_UTILS_LOGGER_H__
 #define _USB_DRIVER_UTILS_LOGGER_H__
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <stdio.h>
+#include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Logging
@@ -23,8 +29,45 @@ class Logger
   void log(const std::string &tag, const std::string &msg,
            const char *funcName, const char *sourceFile, unsigned int lineNum);
 
+  /**
+   * Log on behalf of the call site `site`, any address unique to it. The
+   * same message from the same site is only written once per repeat
+   * window, later ones are counted and reported in a single "repeated N
+   * times" record once the window is over. Returns whether anything was
+   * written. Neither looking a repeat up nor writing allocates.
+   */
+  bool log(const void *site, const char *tag, const char *msg, size_t len,
+           const char *funcName, const char *sourceFile, unsigned int lineNum);
+
+  bool log(const void *site, const char *tag, const char *msg,
+           const char *funcName, const char *sourceFile, unsigned int lineNum)
+  {
+    return log(site, tag, msg, strlen(msg), funcName, sourceFile, lineNum);
+  }
+
+  /**
+   * Any message with c_str() and size(): a std::string, or a
+   * Utils::FormatBuffer to keep formatting the message off the heap.
+   */
+  template<typename Message>
+    bool log(const void *site, const char *tag, const Message &msg,
+             const char *funcName, const char *sourceFile, unsigned int lineNum)
+    {
+      return log(site, tag, msg.c_str(), msg.size(), funcName, sourceFile, lineNum);
+    }
+
   void flush();
 
+  /**
+   * Set the repeat window in milliseconds, 0 writes every message.
+   */
+  void setRepeatWindow(unsigned int milliseconds);
+
+  // Messages left out as repeats
+  unsigned long suppressed() const { return m_suppressed.load(); }
+  // "repeated N times" records written in their place
+  unsigned long repeatRecords() const { return m_repeatRecords.load(); }
+
  protected:
   Logger();
 
@@ -32,15 +75,35 @@ class Logger
   Logger(const Logger &logger);
   Logger &operator=(const Logger &);
 
-  void fillOutputBuffer(std::string &outputBuffer, const std::string &tag,
-                        const std::string &msg, const char *funcName,
-                        const char *sourceFile,  unsigned int lineNum);
-
   inline FILE *loadFileStream(FILE *stream, const char *filename);
 
+  typedef struct Repeat {
+    std::string tag;
+    std::string msg;
+    std::chrono::steady_clock::time_point since;  // When the message was last written.
+    unsigned long count;                          // Left out since.
+  } Repeat;
+
+  // Call site and hash of the message, so lookups don't copy it
+  typedef std::pair<const void *, size_t> RepeatKey;
+
+  void write(const char *tag, const char *msg, size_t len, const char *funcName,
+             const char *sourceFile, unsigned int lineNum, unsigned long repeats = 0);
+  void reportRepeats(Repeat &repeat);
+  void expireRepeats(std::chrono::steady_clock::time_point now);
+
   FILE *m_pLogFile;
+
+  std::mutex m_mutex;
+  std::chrono::milliseconds m_repeatWindow;
+  std::map<RepeatKey, Repeat> m_repeats;
+  std::atomic<unsigned long> m_suppressed;
+  std::atomic<unsigned long> m_repeatRecords;
 };
 
+// Declares the call site of a suppressible log macro
+#define CORE_LOG_SITE static char _logSite
+
 #ifndef NDEBUG // If in debug mode
 
 // Define debugger break symbols
@@ -90,8 +153,9 @@ class Logger
 #define CORE_ERROR(str) \
     do \
     { \
-        Logger::instance().log("ERROR",str, __FUNCTION__, __FILE__, __LINE__); \
-        Logger::instance().flush(); \
+        CORE_LOG_SITE; \
+        if(Logger::instance().log(&_logSite, "ERROR",str, __FUNCTION__, __FILE__, __LINE__)) \
+            Logger::instance().flush(); \
     } \
     while(0)\
 
@@ -99,8 +163,9 @@ class Logger
 #define CORE_WARNING(str) \
     do \
     { \
-        Logger::instance().log("WARNING", str, __FUNCTION__, __FILE__, __LINE__);\
-        Logger::instance().flush(); \
+        CORE_LOG_SITE; \
+        if(Logger::instance().log(&_logSite, "WARNING", str, __FUNCTION__, __FILE__, __LINE__))\
+            Logger::instance().flush(); \
     } \
     while(0)\
 
@@ -108,24 +173,27 @@ class Logger
 #define CORE_DEBUG(str) \
     do \
     { \
-        Logger::instance().log("DEBUG", str, NULL, NULL, 0); \
-        Logger::instance().flush(); \
+        CORE_LOG_SITE; \
+        if(Logger::instance().log(&_logSite, "DEBUG", str, NULL, NULL, 0)) \
+            Logger::instance().flush(); \
     } \
     while(0) \
 
-#define CORE_LOG(tag, str)                              \
-  do                                                    \
-    {                                                   \
-      Logger::instance().log(tag, str, NULL, NULL, 0);  \
-      Logger::instance().flush();                       \
-    }                                                   \
-  while(0)                                              \
+#define CORE_LOG(tag, str)                                        \
+  do                                                              \
+    {                                                             \
+      CORE_LOG_SITE;                                              \
+      if(Logger::instance().log(&_logSite, tag, str, NULL, NULL, 0)) \
+        Logger::instance().flush();                               \
+    }                                                             \
+  while(0)                                                        \
 
 
 #define CORE_VERBOSE(str)                                               \
   do                                                                    \
     {                                                                   \
-      Logger::instance().log("VERBOSE", str, __FUNCTION__, __FILE__, __LINE__); \
+      CORE_LOG_SITE;                                                    \
+      Logger::instance().log(&_logSite, "VERBOSE", str, __FUNCTION__, __FILE__, __LINE__); \
     }                                                                   \
   while(0)                                                              \
 
@@ -142,20 +210,22 @@ class Logger
   while(0)                                                  \
 
 
-#define CORE_ERROR(str)                                   \
-  do                                                      \
-    {                                                     \
-      Logger::instance().log("ERROR",str, NULL, NULL, 0); \
-      Logger::instance().flush();                         \
-    }                                                     \
-  while(0)                                                \
+#define CORE_ERROR(str)                                              \
+  do                                                                 \
+    {                                                                \
+      CORE_LOG_SITE;                                                 \
+      if(Logger::instance().log(&_logSite, "ERROR",str, NULL, NULL, 0)) \
+        Logger::instance().flush();                                  \
+    }                                                                \
+  while(0)                                                           \
 
-#define CORE_WARNING(str)                                     \
-  do                                                          \
-    {                                                         \
-      Logger::instance().log("WARNING", str, NULL, NULL, 0);  \
-    }                                                         \
-  while(0)                                                    \
+#define CORE_WARNING(str)                                               \
+  do                                                                    \
+    {                                                                   \
+      CORE_LOG_SITE;                                                    \
+      Logger::instance().log(&_logSite, "WARNING", str, NULL, NULL, 0); \
+    }                                                                   \
+  while(0)                                                              \
 
 // Release mode definitions of macros. Defined in such a way as to be
 // ignored completelly by the compiler
@@ -166,11 +236,12 @@ class Logger
 
 #endif
 
-#define CORE_INFO(str)                                    \
-  do                                                      \
-    {                                                     \
-      Logger::instance().log("INFO", str, NULL, NULL, 0); \
-    }                                                     \
-  while(0)                                                \
+#define CORE_INFO(str)                                               \
+  do                                                                 \
+    {                                                                \
+      CORE_LOG_SITE;                                                 \
+      Logger::instance().log(&_logSite, "INFO", str, NULL, NULL, 0); \
+    }                                                                \
+  while(0)                                                           \
 
 #endif // _USB_DRIVER_UTILS_LOGGER_H__
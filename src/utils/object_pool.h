@@ -0,0 +1,91 @@
+#ifndef _USB_DRIVER_UTILS_OBJECT_POOL_H__
+#define _USB_DRIVER_UTILS_OBJECT_POOL_H__
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Pooled allocation
+////////////////////////////////////////////////////////////////////////////////
+namespace USBDriver
+{
+  namespace Utils
+  {
+    /**
+     * Fixed size allocator handing out slots from slabs of SlabSize
+     * objects. Freed slots go back on a free list, so steady polling
+     * doesn't touch the heap. Slabs are kept until the pool dies, which
+     * bounds the pool to the peak number of live objects.
+     */
+    template<size_t ObjectSize, size_t SlabSize = 64>
+      class ObjectPool
+      {
+      public:
+        ObjectPool() : m_freeList(nullptr) {}
+
+        ~ObjectPool()
+        {
+          for(auto slab : m_slabs)
+            free(slab);
+        }
+
+        void *allocate()
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+
+          if(m_freeList == nullptr)
+            grow();
+
+          Slot *slot = m_freeList;
+          m_freeList = slot->next;
+
+          return slot;
+        }
+
+        void deallocate(void *ptr)
+        {
+          if(ptr == nullptr)
+            return;
+
+          std::lock_guard<std::mutex> lock(m_mutex);
+
+          Slot *slot = static_cast<Slot *>(ptr);
+          slot->next = m_freeList;
+          m_freeList = slot;
+        }
+
+      private:
+        ObjectPool(const ObjectPool &);
+        ObjectPool &operator=(const ObjectPool &);
+
+        typedef union Slot {
+          Slot *next;
+          alignas(alignof(std::max_align_t)) char storage[ObjectSize];
+        } Slot;
+
+        void grow()
+        {
+          Slot *slab = static_cast<Slot *>(malloc(sizeof(Slot) * SlabSize));
+
+          if(slab == nullptr)
+            throw std::bad_alloc();
+
+          m_slabs.push_back(slab);
+
+          for(size_t i = 0; i < SlabSize; ++i) {
+            slab[i].next = m_freeList;
+            m_freeList = &slab[i];
+          }
+        }
+
+        std::mutex m_mutex;
+        Slot *m_freeList;
+        std::vector<Slot *> m_slabs;
+      };
+  }
+}
+
+#endif // _USB_DRIVER_UTILS_OBJECT_POOL_H__
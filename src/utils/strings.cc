@@ -0,0 +1,95 @@
+#include "strings.h"
+
+#include <mutex>
+
+namespace USBDriver
+{
+  namespace Utils
+  {
+    static std::mutex gInternMutex;
+
+    InternedString::Table &InternedString::table()
+    {
+      static Table *table = new Table;  // Outlives static destructors
+      return *table;
+    }
+
+    size_t InternedString::KeyHash::operator()(const Key &key) const
+    {
+      // FNV-1a
+      size_t hash = static_cast<size_t>(14695981039346656037ULL);
+
+      for(size_t i = 0; i < key.size; ++i) {
+        hash ^= static_cast<unsigned char>(key.data[i]);
+        hash *= static_cast<size_t>(1099511628211ULL);
+      }
+
+      return hash;
+    }
+
+    InternedString::Entry *InternedString::intern(const char *str, size_t len)
+    {
+      if(len == 0)
+        return nullptr;
+
+      std::lock_guard<std::mutex> lock(gInternMutex);
+
+      Key key = { str, len };
+      auto it = table().find(key);
+
+      if(it != table().end()) {
+        Entry *entry = it->second;
+        entry->refCount.fetch_add(1, std::memory_order_relaxed);
+
+        return entry;
+      }
+
+      Entry *entry = new Entry;
+      entry->value.assign(str, len);
+      entry->refCount.store(1);
+
+      // Key the table by the entry's own copy of the value
+      Key ownKey = { entry->value.data(), entry->value.size() };
+      table().emplace(ownKey, entry);
+
+      return entry;
+    }
+
+    void InternedString::release(Entry *entry)
+    {
+      if(entry == nullptr)
+        return;
+
+      // Drop references lock free unless this might be the last one
+      int count = entry->refCount.load(std::memory_order_relaxed);
+
+      while(count > 1) {
+        if(entry->refCount.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+          return;
+      }
+
+      std::lock_guard<std::mutex> lock(gInternMutex);
+
+      // Someone may have interned the same value again before we got the lock
+      if(entry->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+      Key key = { entry->value.data(), entry->value.size() };
+      table().erase(key);
+      delete entry;
+    }
+
+    const std::string &InternedString::emptyString()
+    {
+      static const std::string empty;
+      return empty;
+    }
+
+    size_t InternedString::tableSize()
+    {
+      std::lock_guard<std::mutex> lock(gInternMutex);
+
+      return table().size();
+    }
+  }
+}
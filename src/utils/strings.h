@@ -0,0 +1,170 @@
+#ifndef _USB_DRIVER_UTILS_STRINGS_H__
+#define _USB_DRIVER_UTILS_STRINGS_H__
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Compact strings
+////////////////////////////////////////////////////////////////////////////////
+namespace USBDriver
+{
+  namespace Utils
+  {
+    /**
+     * Immutable string shared through a global intern table. Identical
+     * values, like the vendor name of a fleet of identical sticks, are
+     * stored once. Entries are dropped when their last user goes away.
+     */
+    class InternedString
+    {
+    public:
+      InternedString() : m_entry(nullptr) {}
+      InternedString(const char *str) : m_entry(intern(str, strlen(str))) {}
+      InternedString(const std::string &str) : m_entry(intern(str.data(), str.size())) {}
+
+      InternedString(const InternedString &other) : m_entry(other.m_entry)
+      {
+        if(m_entry)
+          m_entry->refCount.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      ~InternedString() { release(m_entry); }
+
+      InternedString &operator=(InternedString other)
+      {
+        Entry *tmp = m_entry;
+        m_entry = other.m_entry;
+        other.m_entry = tmp;
+
+        return *this;
+      }
+
+      const std::string &str() const { return m_entry ? m_entry->value : emptyString(); }
+      const char *c_str() const { return str().c_str(); }
+      size_t size() const { return m_entry ? m_entry->value.size() : 0; }
+      bool empty() const { return m_entry == nullptr; }
+
+      // Interned values are unique, so comparing entries is enough
+      bool operator==(const InternedString &other) const { return m_entry == other.m_entry; }
+      bool operator!=(const InternedString &other) const { return m_entry != other.m_entry; }
+
+      /**
+       * Number of distinct values currently interned.
+       */
+      static size_t tableSize();
+
+    private:
+      typedef struct Entry {
+        std::string value;
+        std::atomic<int> refCount;
+      } Entry;
+
+      // Non owning key, so lookups don't allocate
+      typedef struct Key {
+        const char *data;
+        size_t size;
+
+        bool operator==(const Key &other) const
+        {
+          return size == other.size && memcmp(data, other.data, size) == 0;
+        }
+      } Key;
+
+      typedef struct KeyHash {
+        size_t operator()(const Key &key) const;
+      } KeyHash;
+
+      typedef std::unordered_map<Key, Entry *, KeyHash> Table;
+
+      static Table &table();
+      static Entry *intern(const char *str, size_t len);
+      static void release(Entry *entry);
+      static const std::string &emptyString();
+
+      Entry *m_entry;
+    };
+
+    /**
+     * Mutable string stored inline up to N - 1 characters, only touching
+     * the heap for longer values.
+     */
+    template<size_t N>
+      class SmallString
+      {
+      public:
+        SmallString() : m_data(m_inline), m_size(0) { m_inline[0] = '\0'; }
+        SmallString(const char *str) : m_data(m_inline), m_size(0) { assign(str, strlen(str)); }
+        SmallString(const std::string &str) : m_data(m_inline), m_size(0) { assign(str.data(), str.size()); }
+        SmallString(const SmallString &other) : m_data(m_inline), m_size(0) { assign(other.m_data, other.m_size); }
+
+        ~SmallString()
+        {
+          if(m_data != m_inline)
+            free(m_data);
+        }
+
+        SmallString &operator=(const SmallString &other)
+        {
+          if(this != &other)
+            assign(other.m_data, other.m_size);
+
+          return *this;
+        }
+
+        SmallString &operator=(const char *str) { assign(str, strlen(str)); return *this; }
+        SmallString &operator=(const std::string &str) { assign(str.data(), str.size()); return *this; }
+
+        void assign(const char *str, size_t len)
+        {
+          if(len >= N) {
+            char *heap = static_cast<char *>(m_data != m_inline ? realloc(m_data, len + 1) : malloc(len + 1));
+
+            if(heap == nullptr)
+              throw std::bad_alloc();
+
+            m_data = heap;
+          } else if(m_data != m_inline) {
+            free(m_data);
+            m_data = m_inline;
+          }
+
+          memmove(m_data, str, len);
+          m_data[len] = '\0';
+          m_size = len;
+        }
+
+        void clear() { assign("", 0); }
+
+        const char *c_str() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        std::string str() const { return std::string(m_data, m_size); }
+
+        bool operator==(const SmallString &other) const
+        {
+          return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+        }
+
+        bool operator!=(const SmallString &other) const { return !(*this == other); }
+
+        bool operator==(const std::string &other) const
+        {
+          return m_size == other.size() && memcmp(m_data, other.data(), m_size) == 0;
+        }
+
+        bool operator!=(const std::string &other) const { return !(*this == other); }
+
+      private:
+        char m_inline[N];
+        char *m_data;
+        size_t m_size;
+      };
+  }
+}
+
+#endif // _USB_DRIVER_UTILS_STRINGS_H__
@@ -0,0 +1,154 @@
+#include "tracer.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint64_t _nowMicroseconds()
+{
+  using namespace std::chrono;
+
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t _currentThreadID()
+{
+  static std::atomic<uint32_t> nextThreadID(1);
+  thread_local uint32_t threadID = nextThreadID.fetch_add(1, std::memory_order_relaxed);
+
+  return threadID;
+}
+
+Tracer::Tracer()
+  : m_buffer(nullptr), m_nextEvent(0), m_droppedEvents(0),
+    m_enabled(false), m_epoch(_nowMicroseconds())
+{
+}
+
+Tracer::~Tracer()
+{
+  disable();
+}
+
+void Tracer::enable(size_t capacity)
+{
+  disable();
+
+  TraceBuffer *buffer = m_buffer.load();
+
+  // Only ever grow, see m_buffers.
+  if(buffer == nullptr || buffer->capacity < capacity) {
+    buffer = new TraceBuffer;
+    buffer->capacity = capacity;
+    buffer->events.reset(new TraceEvent[capacity]);
+
+    m_buffers.push_back(std::unique_ptr<TraceBuffer>(buffer));
+  }
+
+  for(size_t i = 0; i < buffer->capacity; ++i)
+    buffer->events[i].phase.store(0, std::memory_order_relaxed);
+
+  m_nextEvent.store(0);
+  m_droppedEvents.store(0);
+  m_buffer.store(buffer);
+  m_enabled.store(true);
+}
+
+void Tracer::disable()
+{
+  m_enabled.store(false);
+}
+
+void Tracer::begin(const char *name, const char *category, const char *argName, int64_t argValue)
+{
+  record('B', name, category, argName, argValue);
+}
+
+void Tracer::end(const char *name, const char *category)
+{
+  record('E', name, category, NULL, 0);
+}
+
+void Tracer::asyncBegin(const char *name, const char *category, uint64_t id)
+{
+  record('b', name, category, NULL, static_cast<int64_t>(id));
+}
+
+void Tracer::asyncEnd(const char *name, const char *category, uint64_t id)
+{
+  record('e', name, category, NULL, static_cast<int64_t>(id));
+}
+
+void Tracer::record(char phase, const char *name, const char *category,
+                    const char *argName, int64_t argValue)
+{
+  TraceBuffer *buffer = m_buffer.load(std::memory_order_acquire);
+  size_t index = m_nextEvent.fetch_add(1, std::memory_order_relaxed);
+
+  if(buffer == nullptr || index >= buffer->capacity) {
+    m_droppedEvents.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  TraceEvent &event = buffer->events[index];
+
+  event.name      = name;
+  event.category  = category;
+  event.argName   = argName;
+  event.argValue  = argValue;
+  event.timestamp = _nowMicroseconds() - m_epoch;
+  event.threadID  = _currentThreadID();
+  // Publish last so dump() never sees a half written slot
+  event.phase.store(phase, std::memory_order_release);
+}
+
+size_t Tracer::droppedEvents() const
+{
+  return m_droppedEvents.load();
+}
+
+bool Tracer::dump(const char *filename)
+{
+  FILE *file = fopen(filename, "w");
+
+  if(file == NULL) {
+    CORE_ERROR("Failed to open trace file: " + std::string(filename) + "\n\t" + strerror(errno));
+    return false;
+  }
+
+  TraceBuffer *buffer = m_buffer.load();
+  size_t count = buffer ? std::min(m_nextEvent.load(), buffer->capacity) : 0;
+  bool first = true;
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  for(size_t i = 0; i < count; ++i) {
+    const TraceEvent &event = buffer->events[i];
+    char phase = event.phase.load(std::memory_order_acquire);
+
+    // Still being written by another thread
+    if(phase == 0)
+      continue;
+
+    fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u",
+            first ? "" : ",", event.name, event.category, phase,
+            static_cast<unsigned long long>(event.timestamp), event.threadID);
+
+    if(phase == 'b' || phase == 'e')
+      fprintf(file, ",\"id\":%lld", static_cast<long long>(event.argValue));
+    else if(event.argName != NULL)
+      fprintf(file, ",\"args\":{\"%s\":%lld}", event.argName,
+              static_cast<long long>(event.argValue));
+
+    fprintf(file, "}");
+    first = false;
+  }
+
+  fprintf(file, "\n],\"otherData\":{\"droppedEvents\":%llu}}\n",
+          static_cast<unsigned long long>(droppedEvents()));
+
+  return fclose(file) == 0;
+}
@@ -0,0 +1,163 @@
+#ifndef _USB_DRIVER_UTILS_TRACER_H__
+#define _USB_DRIVER_UTILS_TRACER_H__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Tracing
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * Records begin/end spans into a preallocated in-memory buffer and dumps
+ * them in the Chrome trace-event JSON format (loadable in Perfetto or
+ * chrome://tracing).
+ *
+ * Recording is lock free. When the buffer is full further events are
+ * dropped and counted rather than reallocating. When tracing is disabled
+ * the only cost of a span is a single relaxed atomic load.
+ */
+class Tracer
+{
+ public:
+  static Tracer &instance()
+  {
+    static Tracer instance;
+    return instance;
+  }
+
+  ~Tracer();
+
+  /**
+   * Start recording, preallocating room for `capacity` events. Any
+   * previously recorded events are discarded.
+   */
+  void enable(size_t capacity);
+  /**
+   * Stop recording. Recorded events are kept until the next enable().
+   */
+  void disable();
+
+  inline bool isEnabled() const
+  {
+    return m_enabled.load(std::memory_order_relaxed);
+  }
+
+  void begin(const char *name, const char *category, const char *argName, int64_t argValue);
+  void end(const char *name, const char *category);
+  /**
+   * Spans crossing threads, e.g. from a hotplug seen by the scheduler
+   * thread to its delivery on the JS thread. Both ends share `id`.
+   */
+  void asyncBegin(const char *name, const char *category, uint64_t id);
+  void asyncEnd(const char *name, const char *category, uint64_t id);
+
+  /**
+   * Write the recorded events to the given file. Returns false if the
+   * file could not be written.
+   */
+  bool dump(const char *filename);
+
+  size_t droppedEvents() const;
+
+ private:
+  Tracer();
+  Tracer(const Tracer &tracer);
+  Tracer &operator=(const Tracer &);
+
+  typedef struct TraceEvent {
+    const char *name;          // Static span name.
+    const char *category;      // Static category name.
+    const char *argName;       // Optional static argument name. Can be NULL.
+    int64_t argValue;          // Argument value, only used with argName. Async span ID otherwise.
+    uint64_t timestamp;        // Microseconds since the tracer was created.
+    uint32_t threadID;         // Small per-thread identifier.
+    std::atomic<char> phase;   // 'B', 'E', 'b' or 'e', 0 while the slot is being written.
+  } TraceEvent;
+
+  typedef struct TraceBuffer {
+    size_t capacity;
+    std::unique_ptr<TraceEvent[]> events;
+  } TraceBuffer;
+
+  void record(char phase, const char *name, const char *category,
+              const char *argName, int64_t argValue);
+
+  // Buffers are never freed while the tracer lives, so a thread which
+  // raced with enable() always writes into valid memory.
+  std::atomic<TraceBuffer *> m_buffer;
+  std::vector<std::unique_ptr<TraceBuffer> > m_buffers;
+  std::atomic<size_t> m_nextEvent;
+  std::atomic<size_t> m_droppedEvents;
+  std::atomic<bool> m_enabled;
+  uint64_t m_epoch;
+};
+
+/**
+ * RAII span, recorded only if tracing is enabled when it is opened.
+ */
+class TraceScope
+{
+ public:
+  TraceScope(const char *name, const char *category,
+             const char *argName = NULL, int64_t argValue = 0)
+    : m_name(name), m_category(category),
+      m_active(Tracer::instance().isEnabled())
+  {
+    if(m_active)
+      Tracer::instance().begin(name, category, argName, argValue);
+  }
+
+  ~TraceScope()
+  {
+    if(m_active)
+      Tracer::instance().end(m_name, m_category);
+  }
+
+ private:
+  TraceScope(const TraceScope &);
+  TraceScope &operator=(const TraceScope &);
+
+  const char *m_name;
+  const char *m_category;
+  bool m_active;
+};
+
+#define _CORE_TRACE_CONCAT_IMPL(a, b) a##b
+#define _CORE_TRACE_CONCAT(a, b) _CORE_TRACE_CONCAT_IMPL(a, b)
+
+#ifndef USB_DRIVER_NO_TRACING
+
+// Trace the enclosing scope. `name` and `category` must be string literals.
+#define CORE_TRACE_SCOPE(category, name)                                \
+  TraceScope _CORE_TRACE_CONCAT(_traceScope, __LINE__)(name, category)
+
+// Same as CORE_TRACE_SCOPE, attaching a single numeric argument to the span.
+#define CORE_TRACE_SCOPE_ARG(category, name, argName, argValue)        \
+  TraceScope _CORE_TRACE_CONCAT(_traceScope, __LINE__)(name, category, argName, \
+                                                        static_cast<int64_t>(argValue))
+
+// Open and close a span that may end on another thread.
+#define CORE_TRACE_ASYNC_BEGIN(category, name, id)                      \
+  do {                                                                  \
+    if(Tracer::instance().isEnabled())                                  \
+      Tracer::instance().asyncBegin(name, category, id);                \
+  } while(0)
+
+#define CORE_TRACE_ASYNC_END(category, name, id)                        \
+  do {                                                                  \
+    if(Tracer::instance().isEnabled())                                  \
+      Tracer::instance().asyncEnd(name, category, id);                  \
+  } while(0)
+
+#else // Tracing compiled out
+
+#define CORE_TRACE_SCOPE(category, name) do { } while(0)
+#define CORE_TRACE_SCOPE_ARG(category, name, argName, argValue) do { (void)sizeof(argValue); } while(0)
+#define CORE_TRACE_ASYNC_BEGIN(category, name, id) do { (void)sizeof(id); } while(0)
+#define CORE_TRACE_ASYNC_END(category, name, id) do { (void)sizeof(id); } while(0)
+
+#endif
+
+#endif // _USB_DRIVER_UTILS_TRACER_H__
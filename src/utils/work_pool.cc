@@ -0,0 +1,109 @@
+#include "work_pool.h"
+
+#include <algorithm>
+
+namespace USBDriver
+{
+  namespace Utils
+  {
+    WorkPool::WorkPool(size_t threads)
+      : m_size(threads), m_task(nullptr), m_count(0), m_next(0), m_active(0),
+        m_generation(0), m_stopping(false)
+    {
+    }
+
+    WorkPool::~WorkPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_stopping = true;
+      }
+
+      m_wakeup.notify_all();
+
+      for(auto &thread : m_threads)
+        thread.join();
+    }
+
+    size_t WorkPool::defaultThreads(size_t limit)
+    {
+      size_t cores = std::thread::hardware_concurrency();
+
+      return std::max<size_t>(1, std::min(cores, limit));
+    }
+
+    void WorkPool::drain(const Task &task, size_t count)
+    {
+      size_t index;
+
+      while((index = m_next.fetch_add(1, std::memory_order_relaxed)) < count)
+        task(index);
+    }
+
+    void WorkPool::run(size_t count, const Task &task)
+    {
+      // Not worth a hand-off
+      if(count < 2 || m_size == 0) {
+        for(size_t i = 0; i < count; ++i)
+          task(i);
+
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        while(m_threads.size() < m_size)
+          m_threads.push_back(std::thread(&WorkPool::work, this));
+
+        m_task = &task;
+        m_count = count;
+        m_next.store(0, std::memory_order_relaxed);
+        ++m_generation;
+      }
+
+      m_wakeup.notify_all();
+
+      drain(task, count);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      m_done.wait(lock, [this]() { return m_active == 0; });
+
+      // Threads waking up late must not pick up a finished loop
+      m_task = nullptr;
+    }
+
+    void WorkPool::work()
+    {
+      unsigned long generation = 0;
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      while(true) {
+        m_wakeup.wait(lock, [this, generation]() { return m_stopping || m_generation != generation; });
+
+        if(m_stopping)
+          return;
+
+        generation = m_generation;
+
+        if(m_task == nullptr)
+          continue;
+
+        const Task &task = *m_task;
+        size_t count = m_count;
+
+        ++m_active;
+        lock.unlock();
+
+        drain(task, count);
+
+        lock.lock();
+
+        if(--m_active == 0)
+          m_done.notify_all();
+      }
+    }
+  }
+}
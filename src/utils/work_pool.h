@@ -0,0 +1,68 @@
+#ifndef _USB_DRIVER_UTILS_WORK_POOL_H__
+#define _USB_DRIVER_UTILS_WORK_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel loops
+////////////////////////////////////////////////////////////////////////////////
+namespace USBDriver
+{
+  namespace Utils
+  {
+    /**
+     * Fixed set of threads running the iterations of one loop at a time.
+     * The calling thread takes part, so a pool of N threads runs up to
+     * N + 1 iterations at once. Threads are started on the first run and
+     * then kept, so a steady poll doesn't create any.
+     */
+    class WorkPool
+    {
+    public:
+      typedef std::function<void(size_t index)> Task;
+
+      explicit WorkPool(size_t threads);
+      ~WorkPool();
+
+      /**
+       * Call `task` for every index in [0, count) and return once all calls
+       * returned. Calls run in no particular order, callers write their
+       * results by index to keep the output deterministic.
+       */
+      void run(size_t count, const Task &task);
+
+      /**
+       * Threads to use for work that mostly blocks: one per core, but no
+       * more than `limit`.
+       */
+      static size_t defaultThreads(size_t limit);
+
+    private:
+      WorkPool(const WorkPool &);
+      WorkPool &operator=(const WorkPool &);
+
+      void work();
+      void drain(const Task &task, size_t count);
+
+      std::mutex m_mutex;
+      std::condition_variable m_wakeup;
+      std::condition_variable m_done;
+      std::vector<std::thread> m_threads;
+      size_t m_size;
+      const Task *m_task;          // Loop being run, nullptr between runs.
+      size_t m_count;
+      std::atomic<size_t> m_next;  // Next index to hand out.
+      size_t m_active;             // Threads working on the current loop.
+      unsigned long m_generation;  // Bumped for every run.
+      bool m_stopping;
+    };
+  }
+}
+
+#endif // _USB_DRIVER_UTILS_WORK_POOL_H__
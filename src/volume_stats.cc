@@ -0,0 +1,199 @@
+#include "volume_stats.h"
+#include "utils.h"
+
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/statvfs.h>
+#endif
+
+namespace USBDriver
+{
+  using std::chrono::steady_clock;
+
+  // Can block for as long as the device does
+  static bool _statVolume(const std::string &mountPoint, VolumeCapacity &capacity)
+  {
+#ifdef _WIN32
+    ULARGE_INTEGER available, total;
+    // "E:" alone is the current directory of the drive
+    std::string root = mountPoint;
+
+    if(root[root.size() - 1] != '\\')
+      root += '\\';
+
+    if(!GetDiskFreeSpaceExA(root.c_str(), &available, &total, NULL))
+      return false;
+
+    capacity.totalBytes  = total.QuadPart;
+    capacity.freeBytes   = available.QuadPart;
+    // Not a thing on NTFS and FAT
+    capacity.totalInodes = 0;
+    capacity.freeInodes  = 0;
+#else
+    struct statvfs st;
+
+    if(statvfs(mountPoint.c_str(), &st) != 0)
+      return false;
+
+    capacity.totalBytes  = static_cast<uint64_t>(st.f_blocks) * st.f_frsize;
+    capacity.freeBytes   = static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+    capacity.totalInodes = st.f_files;
+    capacity.freeInodes  = st.f_favail;
+#endif
+
+    return true;
+  }
+
+  static bool _sameCapacity(const VolumeCapacity &a, const VolumeCapacity &b)
+  {
+    return a.totalBytes == b.totalBytes && a.freeBytes == b.freeBytes &&
+      a.totalInodes == b.totalInodes && a.freeInodes == b.freeInodes;
+  }
+
+  VolumeStats::VolumeStats()
+    : m_generation(0)
+  {
+  }
+
+  void VolumeStats::start(const std::string &mountPoint, Volume &volume)
+  {
+    std::shared_ptr<Probe> probe(new Probe());
+
+    volume.pending = probe;
+
+    std::thread([this, mountPoint, probe]() {
+        VolumeCapacity capacity = VolumeCapacity();
+        bool ok = _statVolume(mountPoint, capacity);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        probe->capacity = capacity;
+        probe->ok = ok;
+        probe->done = true;
+
+        m_probed.notify_all();
+      }).detach();
+  }
+
+  void VolumeStats::collect(const std::string &mountPoint, Volume &volume)
+  {
+    if(volume.pending == nullptr || !volume.pending->done)
+      return;
+
+    const Probe &probe = *volume.pending;
+
+    if(!probe.ok) {
+      CORE_DEBUG("Failed to read the capacity of " + mountPoint);
+    } else if(!volume.known || !_sameCapacity(volume.capacity, probe.capacity)) {
+      volume.capacity = probe.capacity;
+      ++m_generation;
+    }
+
+    volume.known = volume.known || probe.ok;
+    volume.probed = steady_clock::now();
+    volume.pending.reset();
+  }
+
+  unsigned long VolumeStats::refresh(const std::vector<std::string> &mountPoints)
+  {
+    CORE_TRACE_SCOPE("enumeration", "VolumeStats::refresh");
+
+    auto now = steady_clock::now();
+    auto ttl = std::chrono::milliseconds(options().capacityTTL.load());
+    auto deadline = now + std::chrono::milliseconds(options().capacityTimeout.load());
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::vector<std::string> batch;
+
+    for(auto &mountPoint : mountPoints) {
+      Volume &volume = m_volumes[mountPoint];
+
+      volume.used = now;
+      collect(mountPoint, volume);
+
+      // Either fresh, or still stuck in an earlier probe. Failures are cached too.
+      if(volume.pending != nullptr || (volume.probed != steady_clock::time_point() && now - volume.probed < ttl))
+        continue;
+
+      start(mountPoint, volume);
+      batch.push_back(mountPoint);
+    }
+
+    auto finished = [this, &batch]() {
+      for(auto &mountPoint : batch) {
+        auto &probe = m_volumes[mountPoint].pending;
+
+        if(probe != nullptr && !probe->done)
+          return false;
+      }
+
+      return true;
+    };
+
+    if(!m_probed.wait_until(lock, deadline, finished)) {
+      for(auto &mountPoint : batch) {
+        auto &probe = m_volumes[mountPoint].pending;
+
+        if(probe != nullptr && !probe->done)
+          CORE_WARNING("Reading the capacity of " + mountPoint + " timed out, keeping the previous one");
+      }
+    }
+
+    for(auto &mountPoint : batch)
+      collect(mountPoint, m_volumes[mountPoint]);
+
+    // Forget volumes nobody asked for since they were last fresh
+    for(auto it = m_volumes.begin(); it != m_volumes.end();) {
+      if(it->second.pending == nullptr && now - it->second.used > ttl)
+        it = m_volumes.erase(it);
+      else
+        ++it;
+    }
+
+    return m_generation;
+  }
+
+  void VolumeStats::fill(std::vector<USBDevicePtr> &devices)
+  {
+    std::vector<std::string> mountPoints;
+
+    for(auto &device : devices) {
+      if(device != nullptr && !device->mountPoint.empty())
+        mountPoints.push_back(device->mountPoint.str());
+    }
+
+    if(mountPoints.empty())
+      return;
+
+    refresh(mountPoints);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for(auto &device : devices) {
+      if(device == nullptr || device->mountPoint.empty())
+        continue;
+
+      auto volume = m_volumes.find(device->mountPoint.str());
+
+      if(volume == m_volumes.end() || !volume->second.known)
+        continue;
+
+      const VolumeCapacity &capacity = volume->second.capacity;
+
+      device->totalBytes  = capacity.totalBytes;
+      device->freeBytes   = capacity.freeBytes;
+      device->totalInodes = capacity.totalInodes;
+      device->freeInodes  = capacity.freeInodes;
+    }
+  }
+
+  unsigned long VolumeStats::generation() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_generation;
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef _USB_DRIVER_VOLUME_STATS_H__
+#define _USB_DRIVER_VOLUME_STATS_H__
+
+#include "usb_driver.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace USBDriver
+{
+  typedef struct VolumeCapacity {
+    uint64_t totalBytes;
+    uint64_t freeBytes;     // Available to unprivileged users.
+    uint64_t totalInodes;
+    uint64_t freeInodes;    // Available to unprivileged users.
+  } VolumeCapacity;
+
+  /**
+   * Capacity of mounted volumes, cached for options().capacityTTL.
+   *
+   * Stale volumes are probed all at once, each on a thread of its own,
+   * and the poll waits at most options().capacityTimeout for them. A
+   * volume that didn't answer in time keeps its previous capacity and
+   * isn't probed again until its probe returns, so a hung device holds
+   * one thread and never stalls a poll for longer than the timeout.
+   */
+  class VolumeStats
+  {
+  public:
+    static VolumeStats &instance()
+    {
+      // Never destroyed, probes of hung volumes may outlive everything else
+      static VolumeStats *instance = new VolumeStats;
+      return *instance;
+    }
+
+    /**
+     * Fill the capacity fields of the mounted devices in `devices`. The
+     * records must not be registered yet. Null entries are skipped.
+     */
+    void fill(std::vector<USBDevicePtr> &devices);
+    /**
+     * Probe the stale volumes among `mountPoints`. Returns generation().
+     */
+    unsigned long refresh(const std::vector<std::string> &mountPoints);
+    /**
+     * Counter bumped whenever a probe found a capacity that differs from
+     * the cached one.
+     */
+    unsigned long generation() const;
+
+  private:
+    VolumeStats();
+    VolumeStats(const VolumeStats &);
+    VolumeStats &operator=(const VolumeStats &);
+
+    typedef struct Probe {
+      bool done;
+      bool ok;
+      VolumeCapacity capacity;
+    } Probe;
+
+    typedef struct Volume {
+      bool known;                                       // Probed successfully at least once.
+      VolumeCapacity capacity;
+      std::chrono::steady_clock::time_point probed;     // When the last probe returned.
+      std::chrono::steady_clock::time_point used;       // When it was last asked for.
+      std::shared_ptr<Probe> pending;                   // Probe still running, if any.
+
+      Volume() : known(false), capacity() {}
+    } Volume;
+
+    void start(const std::string &mountPoint, Volume &volume);
+    void collect(const std::string &mountPoint, Volume &volume);
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_probed;
+    std::unordered_map<std::string, Volume> m_volumes;
+    unsigned long m_generation;
+  };
+}
+
+#endif // _USB_DRIVER_VOLUME_STATS_H__
@@ -1,7 +1,11 @@
 #include "../usb_driver.h"
+#include "../device_id.h"
 #include "../usb_common.h"
+#include "../usb_registry.h"
+#include "../volume_stats.h"
 
 #include "../utils.h"
+#include "../utils/work_pool.h"
 
 #include <windows.h>
 #include <windowsx.h>
@@ -13,22 +17,27 @@
 #include <usbioctl.h>
 #include <cfgmgr32.h>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
-#include <unordered_map>
 #include <bitset>
+#include <mutex>
+#include <unordered_map>
 
 #define FORMAT_FLAGS (FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS)
 
 #define _PSTR(str) reinterpret_cast<PSTR>(str)
 
+// Disks opened at once
+#define MAX_EXTRACTION_THREADS 8
+
+// Pipes returned along with a hub port, as USBView sizes it
+#define MAX_CONNECTION_PIPES 30
+
 namespace USBDriver {
   typedef unsigned long ulong;
   typedef unsigned int  uint;
 
-  typedef std::unordered_map<std::string, USBDevicePtr> DeviceMap;
-
-  static DeviceMap gAllDevices;
-
   /**
    * Create a new windows SP type and automatically set the property cbSize
    * to the sizeof the type, as required by many functions in the windows
@@ -56,79 +65,20 @@ namespace USBDriver {
                                                property, NULL, (PBYTE)buf,
                                                bufLen, &nSize);
 
-    if (ok)
+    if (ok) {
       buf_str.assign(buf);
-    else
-      CORE_ERROR("Failed to get device registry property: " + std::to_string(property));
-
-    free(buf);
-
-    return ok;
-  }
-
-  static bool _parseDeviceID(const char *device_path, std::string &vid,
-                             std::string &pid, std::string &serial)
-  {
-    const char *p = device_path;
-
-    if (strncmp(p, "USB\\", 4) != 0) {
-      return false;
-    }
-    p += 4;
-
-    if (strncmp(p, "VID_", 4) != 0) {
-      return false;
-    }
-    p += 4;
-
-    vid.assign("0x");
-
-    while (*p != '&') {
-      if (*p == '\0') {
-        return false;
-      }
-      vid.push_back(tolower(*p));
-      p++;
-    }
-    p++;
-
-    if (strncmp(p, "PID_", 4) != 0) {
-      return false;
-    }
-    p += 4;
-
-    // Clear serial, just to be sure we don't have any left over state.
-    serial.clear();
-
-    pid.assign("0x");
-
-    while (*p != '\\') {
-      if (*p == '\0') {
-        return false;
-      }
-      if (*p == '&') {
-        // No serial.
-        return true;
-      }
+    } else {
+      Utils::FormatBuffer<64> msg;
 
-      pid.push_back(tolower(*p));
-      p++;
+      msg << "Failed to get device registry property: " << property;
+      CORE_ERROR(msg);
     }
-    p++;
-
-    while (*p != '\0') {
-      if (*p == '&') {
-        return true;
-      }
 
-      serial.push_back(toupper(*p));
-      p++;
-    }
+    free(buf);
 
-    return true;
+    return ok;
   }
 
-
   static ULONG _deviceNumberFromHandle(HANDLE handle)
   {
     STORAGE_DEVICE_NUMBER sdn;
@@ -148,6 +98,8 @@ namespace USBDriver {
 
   static std::string _driveForDeviceNumber(ULONG deviceNumber)
   {
+      CORE_TRACE_SCOPE_ARG("enumeration", "_driveForDeviceNumber", "deviceNumber", deviceNumber);
+
       std::bitset<32> drives(GetLogicalDrives());
 
       // We start iteration from ANSI C (65)
@@ -156,26 +108,34 @@ namespace USBDriver {
           continue;
         }
 
-        std::string path = std::string("\\\\.\\") + c + ":";
+        Utils::FormatBuffer<8> path;
+
+        path << "\\\\.\\" << c << ':';
 
         HANDLE driveHandle = CreateFileA(path.c_str(), GENERIC_READ,
                                          FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
                                          FILE_FLAG_NO_BUFFERING | FILE_FLAG_RANDOM_ACCESS, NULL);
 
         if (driveHandle == INVALID_HANDLE_VALUE) {
-          CORE_ERROR("Failed to get file handle to " + path);
+          Utils::FormatBuffer<64> msg;
+
+          msg << "Failed to get file handle to " << path.c_str();
+          CORE_ERROR(msg);
           continue;
         }
 
         ULONG num = _deviceNumberFromHandle(driveHandle);
+        CloseHandle(driveHandle);
+
         if (num == deviceNumber) {
           return std::string(1, c).append(":");
         }
-
-        CloseHandle(driveHandle);
       }
 
-      CORE_ERROR("Failed to get drive for device number: " + std::to_string(deviceNumber));
+      Utils::FormatBuffer<64> msg;
+
+      msg << "Failed to get drive for device number: " << deviceNumber;
+      CORE_ERROR(msg);
       return "";
     }
 
@@ -185,20 +145,10 @@ namespace USBDriver {
     SP_DEVICE_INTERFACE_DETAIL_DATA *interDetails;
   } SPData;
 
-  static USBDevicePtr _findDeviceByLocationID(const DeviceMap &map, int locationID) {
-    for(auto it = map.begin(); it != map.end(); ++it) {
-      auto device = it->second;
-
-      if(device->locationID == locationID) {
-        return device;
-      }
-    }
-
-    return nullptr;
-  }
-
   std::vector<DeviceSPData> _deviceSPs(HDEVINFO hDeviceInfo, const GUID *guid)
   {
+    CORE_TRACE_SCOPE("enumeration", "_deviceSPs");
+
     std::vector<DeviceSPData> sps;
 
     uint index = 0;
@@ -234,16 +184,173 @@ namespace USBDriver {
     return sps;
   }
 
-  USBDevicePtr _extractUSBDeviceData(HDEVINFO hDeviceInfo, DeviceSPData &sp)
-  {
+  typedef struct DiskCandidate {
+    std::string devicePath;   // Disk interface to open.
     std::string deviceName;
-    if (!_deviceProperty(hDeviceInfo, &sp.info, SPDRP_FRIENDLYNAME, deviceName)) {
-      return nullptr;
+    std::string vendor;
+    DeviceID id;              // From the instance ID of the USB device.
+    int busNumber;
+    std::string portPath;
+    std::string hubPath;      // Hub interface to ask for the link speed.
+    ULONG hubPort;
+
+    DiskCandidate() : busNumber(0), hubPort(0) {}
+  } DiskCandidate;
+
+  // Host controllers numbered as they're found, by location path
+  static std::unordered_map<std::string, int> gBusNumbers;
+
+  /**
+   * Read the bus and ports of a USB device from its location path, e.g.
+   * "PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)#USB(4)" for port 4 of the hub
+   * on port 2. Windows has no bus numbers, host controllers are numbered
+   * from 1 in the order they are first seen instead.
+   */
+  static bool _parseLocationPath(const char *path, DiskCandidate &candidate)
+  {
+    const char *root = strstr(path, "#USBROOT(");
+
+    if (root == NULL)
+      return false;
+
+    root = strchr(root, ')');
+
+    if (root == NULL)
+      return false;
+
+    std::string controller(path, root + 1);
+    std::string portPath;
+    ULONG port = 0;
+
+    for (const char *p = root + 1; strncmp(p, "#USB(", 5) == 0; ) {
+      char *end;
+
+      port = strtoul(p + 5, &end, 10);
+
+      if (*end != ')')
+        return false;
+
+      if (!portPath.empty())
+        portPath += '.';
+
+      portPath += std::to_string(port);
+      p = end + 1;
     }
 
-    std::string vendor;
-    if (!_deviceProperty(hDeviceInfo, &sp.info, SPDRP_MFG, vendor)) {
-      return nullptr;
+    if (portPath.empty())
+      return false;
+
+    auto bus = gBusNumbers.find(controller);
+
+    if (bus == gBusNumbers.end())
+      bus = gBusNumbers.insert(std::make_pair(controller, static_cast<int>(gBusNumbers.size()) + 1)).first;
+
+    candidate.busNumber = bus->second;
+    candidate.portPath = portPath;
+    candidate.hubPort = port;
+
+    return true;
+  }
+
+  /**
+   * Find where the USB device is plugged in, and the interface of its hub.
+   * Only uses the configuration manager, which is cheap.
+   */
+  static void _discoverTopology(DEVINST usbDevice, const char *usbDeviceID, DiskCandidate &candidate)
+  {
+    // Disks of composite devices hang off an interface
+    if (strstr(usbDeviceID, "&MI_") != NULL && CM_Get_Parent(&usbDevice, usbDevice, 0) != CR_SUCCESS)
+      return;
+
+    char paths[1024];
+    ULONG pathsLen = sizeof(paths);
+
+    if (CM_Get_DevNode_Registry_Property(usbDevice, CM_DRP_LOCATION_PATHS, NULL, paths,
+                                         &pathsLen, 0) != CR_SUCCESS)
+      return;
+
+    // A list of paths, the ACPI one can come first
+    for (const char *path = paths; *path != '\0' && path < paths + pathsLen; path += strlen(path) + 1) {
+      if (_parseLocationPath(path, candidate))
+        break;
+    }
+
+    DEVINST hub;
+    char hubID[MAX_DEVICE_ID_LEN];
+    ULONG interfacesLen = 0;
+
+    if (candidate.portPath.empty() || CM_Get_Parent(&hub, usbDevice, 0) != CR_SUCCESS ||
+        CM_Get_Device_ID(hub, _PSTR(hubID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS)
+      return;
+
+    if (CM_Get_Device_Interface_List_Size(&interfacesLen, const_cast<LPGUID>(&GUID_DEVINTERFACE_USB_HUB),
+                                          _PSTR(hubID), CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS ||
+        interfacesLen <= 1)
+      return;
+
+    std::vector<char> interfaces(interfacesLen);
+
+    if (CM_Get_Device_Interface_List(const_cast<LPGUID>(&GUID_DEVINTERFACE_USB_HUB), _PSTR(hubID),
+                                     interfaces.data(), interfacesLen,
+                                     CM_GET_DEVICE_INTERFACE_LIST_PRESENT) == CR_SUCCESS)
+      candidate.hubPath = interfaces.data();
+  }
+
+  static const double DEVICE_SPEEDS[] = { 1.5, 12, 480, 5000 };
+
+  /**
+   * Ask the hub how fast the link on `port` is, 0 if unknown. Links
+   * faster than SuperSpeed read as 5000.
+   */
+  static double _linkSpeed(const std::string &hubPath, ULONG port)
+  {
+    CORE_TRACE_SCOPE("enumeration", "_linkSpeed");
+
+    HANDLE hub = CreateFileA(hubPath.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE,
+                             NULL, OPEN_EXISTING, 0, NULL);
+
+    if (hub == INVALID_HANDLE_VALUE) {
+      CORE_WARNING("Failed to open hub " + hubPath);
+      return 0;
+    }
+
+    DWORD infoLen = sizeof(USB_NODE_CONNECTION_INFORMATION_EX) + MAX_CONNECTION_PIPES * sizeof(USB_PIPE_INFO);
+    std::vector<char> buf(infoLen);
+    auto info = reinterpret_cast<PUSB_NODE_CONNECTION_INFORMATION_EX>(buf.data());
+    DWORD bytesReturned = 0;
+
+    info->ConnectionIndex = port;
+
+    bool ok = DeviceIoControl(hub, IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX, info, infoLen,
+                              info, infoLen, &bytesReturned, NULL);
+
+    CloseHandle(hub);
+
+    if (!ok) {
+      CORE_WARNING("Failed to get the connection of port " + std::to_string(port) + " of " + hubPath);
+      return 0;
+    }
+
+    if (info->Speed < sizeof(DEVICE_SPEEDS) / sizeof(DEVICE_SPEEDS[0]))
+      return DEVICE_SPEEDS[info->Speed];
+
+    return 0;
+  }
+
+  /**
+   * Read what SetupAPI knows about a disk. SetupAPI serializes calls on a
+   * device information set, so this runs before the parallel part.
+   */
+  static bool _discoverDisk(HDEVINFO hDeviceInfo, DeviceSPData &sp, DiskCandidate &candidate)
+  {
+    CORE_TRACE_SCOPE("enumeration", "_discoverDisk");
+
+    if (!_deviceProperty(hDeviceInfo, &sp.info, SPDRP_FRIENDLYNAME, candidate.deviceName)) {
+      return false;
+    }
+
+    if (!_deviceProperty(hDeviceInfo, &sp.info, SPDRP_MFG, candidate.vendor)) {
+      return false;
     }
 
     ULONG interfaceDetailLen = MAX_PATH;
@@ -257,20 +364,77 @@ namespace USBDriver {
     if (!SetupDiGetDeviceInterfaceDetail(hDeviceInfo, &sp.inter, spDeviceInterfaceDetail,
                                          interfaceDetailLen, &interfaceDetailLen, &spDeviceInfoData)) {
       CORE_ERROR("Failed to retrieve device interface details.");
-      return nullptr;
+      free(spDeviceInterfaceDetail);
+      return false;
     }
 
-    HANDLE handle = CreateFile(spDeviceInterfaceDetail->DevicePath,
-                               0, FILE_SHARE_READ | FILE_SHARE_WRITE,
-                               NULL, OPEN_EXISTING, 0, NULL);
+    candidate.devicePath = spDeviceInterfaceDetail->DevicePath;
+
+    free(spDeviceInterfaceDetail);
+
+    DEVINST devInstParent;
+    if (CM_Get_Parent(&devInstParent, spDeviceInfoData.DevInst, 0) != CR_SUCCESS) {
+      return false;
+    }
+
+    char devInstParentID[MAX_DEVICE_ID_LEN];
+    if (CM_Get_Device_ID(devInstParent, _PSTR(devInstParentID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+      return false;
+    }
+
+    if (!parseInstanceID(devInstParentID, strnlen(devInstParentID, sizeof(devInstParentID)), candidate.id)) {
+      return false;
+    }
+
+    _discoverTopology(devInstParent, devInstParentID, candidate);
+
+    return true;
+  }
+
+  /**
+   * Read the label and volume serial number of the file system mounted on
+   * `drive`, e.g. "E:". The serial number is stored in the file system, so
+   * unlike the volume GUID it is the same on every host, and is formatted
+   * "XXXX-XXXX" as Linux shows it for FAT and exFAT.
+   */
+  static void _filesystemInfo(const std::string &drive, USBDevicePtr &pUsbDevice)
+  {
+    CORE_TRACE_SCOPE("enumeration", "_filesystemInfo");
+
+    std::string root = drive + "\\";
+    char label[MAX_PATH + 1];
+    DWORD serial;
+
+    if (!GetVolumeInformationA(root.c_str(), label, sizeof(label), &serial, NULL, NULL, NULL, 0)) {
+      CORE_WARNING("Failed to get the volume information of " + root);
+      return;
+    }
+
+    char uuid[10];
+
+    snprintf(uuid, sizeof(uuid), "%04lX-%04lX", (serial >> 16) & 0xffffUL, serial & 0xffffUL);
+
+    pUsbDevice->filesystemLabel = label;
+    pUsbDevice->filesystemUUID = uuid;
+  }
+
+  /**
+   * Open the disk to find its device number and drive letter. Runs on the
+   * extraction pool, so it must not touch the registry.
+   */
+  static USBDevicePtr _extractUSBDeviceData(const DiskCandidate &candidate)
+  {
+    CORE_TRACE_SCOPE("enumeration", "_extractUSBDeviceData");
+
+    HANDLE handle = CreateFileA(candidate.devicePath.c_str(),
+                                0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
 
     if (handle == INVALID_HANDLE_VALUE) {
       CORE_ERROR("Failed to create file handle");
       return nullptr;
     }
 
-    free(spDeviceInterfaceDetail);
-
     std::string mount;
     ULONG deviceNumber = _deviceNumberFromHandle(handle);
     if (deviceNumber != -1) {
@@ -284,56 +448,68 @@ namespace USBDriver {
         CORE_DEBUG("Found mount point: " + mount);
       }
     } else {
-      CORE_ERROR("Failed to get device number for " + deviceName);
+      CORE_ERROR("Failed to get device number for " + candidate.deviceName);
     }
 
     CloseHandle(handle);
 
-    DEVINST devInstParent;
-    if (CM_Get_Parent(&devInstParent, spDeviceInfoData.DevInst, 0) != CR_SUCCESS) {
-      return nullptr;
-    }
-
-    char devInstParentID[MAX_DEVICE_ID_LEN];
-    if (CM_Get_Device_ID(devInstParent, _PSTR(devInstParentID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
-      return nullptr;
-    }
-
-    std::string vid, pid, serial;
-    if (!_parseDeviceID(devInstParentID, vid, pid, serial)) {
-      return nullptr;
-    }
-
     int locationID = static_cast<int>(deviceNumber);
 
     CORE_DEBUG("Found location ID: " + std::to_string(locationID));
 
-    USBDevicePtr pUsbDevice = _findDeviceByLocationID(gAllDevices, locationID);
-
-    if(!pUsbDevice) {
-      CORE_DEBUG("USB device with given location ID not found, creating a new one...");
-      pUsbDevice = USBDevicePtr(new USBDevice());
-    }
+    USBDevicePtr pUsbDevice(new USBDevice());
 
     // Emulate location ID using device numbers
     pUsbDevice->locationID = locationID;
-    // Convert HEX values to integers
-    pUsbDevice->productID = std::stoi(pid, nullptr, 0);
-    pUsbDevice->vendorID = std::stoi(vid, nullptr, 0);
-    pUsbDevice->product = deviceName;
-    pUsbDevice->serialNumber = serial;
-    pUsbDevice->vendor = vendor;
+    pUsbDevice->productID = candidate.id.productID;
+    pUsbDevice->vendorID = candidate.id.vendorID;
+    pUsbDevice->product = candidate.deviceName;
+    pUsbDevice->serialNumber = candidate.id.serialNumber;
+    pUsbDevice->vendor = candidate.vendor;
     pUsbDevice->mountPoint = mount;
-    pUsbDevice->uid = uniqueDeviceID(pUsbDevice);
+    pUsbDevice->busNumber = candidate.busNumber;
+    pUsbDevice->portPath = candidate.portPath;
+
+    if (!candidate.hubPath.empty())
+      pUsbDevice->speed = _linkSpeed(candidate.hubPath, candidate.hubPort);
+
+    if (options().filesystemInfo && !mount.empty())
+      _filesystemInfo(mount, pUsbDevice);
+
+    return pUsbDevice;
+  }
+
+  static USBDevicePtr _registerDevice(USBDevicePtr pUsbDevice, const DiskCandidate &candidate)
+  {
+    USBDevicePtr pPrevious = DeviceRegistry::instance().findAttached(pUsbDevice->locationID,
+                                                                     pUsbDevice->vendorID,
+                                                                     pUsbDevice->productID,
+                                                                     candidate.id.serialNumber);
+
+    if(!pPrevious)
+      CORE_DEBUG("USB device with given location ID not found, creating a new one...");
+
+    pUsbDevice = mergeDevice(pPrevious, pUsbDevice);
 
-    // Add to global device map
-    gAllDevices[pUsbDevice->uid] = pUsbDevice;
+    // Register in storage
+    DeviceRegistry::instance().insert(pUsbDevice);
 
     return pUsbDevice;
   }
 
-  std::vector<USBDevicePtr> getDevices()
+  static Utils::WorkPool gExtractionPool(Utils::WorkPool::defaultThreads(MAX_EXTRACTION_THREADS) - 1);
+
+  // Polls from JS and from the scheduler thread take turns
+  static std::mutex gEnumerationMutex;
+  // Disk of every registered device, by UID, to re-read it alone
+  static std::unordered_map<std::string, DiskCandidate> gCandidates;
+
+  std::vector<USBDevicePtr> enumerateDevices()
   {
+    CORE_TRACE_SCOPE("enumeration", "enumerateDevices");
+
+    std::lock_guard<std::mutex> lock(gEnumerationMutex);
+
     std::vector<USBDevicePtr> ret;
 
     const GUID *guid = &GUID_DEVINTERFACE_DISK;
@@ -341,28 +517,99 @@ namespace USBDriver {
                                                (DIGCF_PRESENT | DIGCF_DEVICEINTERFACE));
 
     if (hDeviceInfo != INVALID_HANDLE_VALUE) {
+      ++stats().scans;
+
       std::vector<DeviceSPData> spsData = _deviceSPs(hDeviceInfo, guid);
+      std::vector<DiskCandidate> candidates;
 
       for (auto &sp : spsData)
         {
-          auto pDevice = _extractUSBDeviceData(hDeviceInfo, sp);
+          DiskCandidate candidate;
+
+          if (_discoverDisk(hDeviceInfo, sp, candidate))
+            candidates.push_back(candidate);
+        }
 
-          if (pDevice != nullptr) {
-            ret.push_back(pDevice);
+      SetupDiDestroyDeviceInfoList(hDeviceInfo);
+
+      // Opening disks and looking up drive letters blocks, do it in parallel
+      std::vector<USBDevicePtr> extracted(candidates.size());
+
+      gExtractionPool.run(candidates.size(), [&candidates, &extracted](size_t i) {
+          extracted[i] = _extractUSBDeviceData(candidates[i]);
+        });
+
+      if (options().capacityInfo)
+        VolumeStats::instance().fill(extracted);
+
+      gCandidates.clear();
+
+      DeviceRegistry::instance().beginUpdate();
+
+      // Register in discovery order
+      for (size_t i = 0; i < candidates.size(); ++i)
+        {
+          if (extracted[i] != nullptr) {
+            ret.push_back(_registerDevice(extracted[i], candidates[i]));
+            gCandidates[ret.back()->uid] = candidates[i];
+            ++stats().deviceReads;
           }
         }
+
+      // Forget about everything that is no longer attached
+      DeviceRegistry::instance().endUpdate();
     }
 
     return ret;
   }
 
-  USBDevicePtr getDevice(const std::string &uid)
+  USBDevicePtr readDevice(const USBDevicePtr &device)
+  {
+    std::lock_guard<std::mutex> lock(gEnumerationMutex);
+
+    auto candidate = gCandidates.find(device->uid);
+
+    if (candidate == gCandidates.end())
+      return device;
+
+    // Opening the disk fails once it's gone
+    USBDevicePtr pUsbDevice = _extractUSBDeviceData(candidate->second);
+
+    ++stats().deviceReads;
+
+    if (pUsbDevice && options().capacityInfo) {
+      std::vector<USBDevicePtr> records(1, pUsbDevice);
+      VolumeStats::instance().fill(records);
+    }
+
+    USBDevicePtr pCurrent = updateDevice(device, pUsbDevice);
+
+    if (!pCurrent)
+      gCandidates.erase(candidate);
+
+    return pCurrent;
+  }
+
+  // Every enumeration registers all devices, nothing to forget
+  void invalidateDevices()
   {
-    return gAllDevices[uid];
   }
 
   bool unmount(const std::string &uid)
   {
   	throw "Not implemented";
 	}
+
+  /**
+   * No hotplug events on Windows, `onEvent` is never called and the poll
+   * scheduler only polls at its interval.
+   */
+  const char *watchDevices(const std::function<void()> &)
+  {
+    return "poll";
+  }
+
+  void unwatchDevices()
+  {
+  }
 }  // namespace usb_driver
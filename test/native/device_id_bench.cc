@@ -0,0 +1,150 @@
+/**
+ * Throughput of the device ID parsers for each format, next to the
+ * string building and std::stoi the Windows backend used to convert
+ * instance IDs.
+ *
+ * Usage: device_id_bench [iterations]
+ */
+#include "../../src/device_id.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace USBDriver;
+
+typedef struct BenchResult {
+  double nanoseconds;
+  double megabytes;   // Per second.
+} BenchResult;
+
+// Keeps the parsed values alive so they aren't optimized away
+static volatile int gSink;
+
+static BenchResult measure(long iterations, const std::string &input, const std::function<bool()> &body)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  for(long i = 0; i < iterations; ++i) {
+    if(!body()) {
+      fprintf(stderr, "FAIL: '%s' didn't parse\n", input.c_str());
+      exit(1);
+    }
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  BenchResult result;
+
+  result.nanoseconds = elapsed.count() * 1e9 / iterations;
+  result.megabytes = input.size() * iterations / elapsed.count() / 1e6;
+
+  return result;
+}
+
+/**
+ * What the Windows backend did before the parser module.
+ */
+static bool legacyInstanceID(const char *p, std::string &vid, std::string &pid, std::string &serial)
+{
+  if(strncmp(p, "USB\\VID_", 8) != 0)
+    return false;
+
+  p += 8;
+  vid.assign("0x");
+
+  for(; *p != '&'; ++p) {
+    if(*p == '\0')
+      return false;
+
+    vid.push_back(tolower(*p));
+  }
+
+  if(strncmp(++p, "PID_", 4) != 0)
+    return false;
+
+  p += 4;
+  serial.clear();
+  pid.assign("0x");
+
+  for(; *p != '\\'; ++p) {
+    if(*p == '\0')
+      return false;
+    if(*p == '&')
+      return true;
+
+    pid.push_back(tolower(*p));
+  }
+
+  for(++p; *p != '\0' && *p != '&'; ++p)
+    serial.push_back(toupper(*p));
+
+  return true;
+}
+
+static void print(const char *name, const BenchResult &result)
+{
+  printf("%-22s %14.2f %14.2f\n", name, result.nanoseconds, result.megabytes);
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+
+  const std::string instanceID = "USB\\VID_0781&PID_5567\\4C530001230715117292";
+  const std::string modalias = "usb:v0781p5567d0100dc00dsc00dp00ic08isc06ip50in00";
+  const std::string product = "PRODUCT=781/5567/100";
+
+  DeviceID id;
+  std::string vid, pid, serial;
+
+  BenchResult legacy = measure(iterations, instanceID, [&]() {
+      if(!legacyInstanceID(instanceID.c_str(), vid, pid, serial))
+        return false;
+
+      gSink = std::stoi(vid, nullptr, 0) + std::stoi(pid, nullptr, 0);
+      return true;
+    });
+
+  BenchResult instance = measure(iterations, instanceID, [&]() {
+      bool ok = parseInstanceID(instanceID.data(), instanceID.size(), id);
+
+      gSink = id.vendorID + id.productID;
+      return ok;
+    });
+
+  BenchResult alias = measure(iterations, modalias, [&]() {
+      bool ok = parseModalias(modalias.data(), modalias.size(), id);
+
+      gSink = id.vendorID + id.productID;
+      return ok;
+    });
+
+  BenchResult uevent = measure(iterations, product, [&]() {
+      bool ok = parseUeventProduct(product.data(), product.size(), id);
+
+      gSink = id.vendorID + id.productID;
+      return ok;
+    });
+
+  BenchResult any = measure(iterations, modalias, [&]() {
+      bool ok = parseDeviceID(modalias.data(), modalias.size(), id);
+
+      gSink = id.vendorID + id.productID;
+      return ok;
+    });
+
+  printf("iterations:  %ld\n", iterations);
+  printf("%-22s %14s %14s\n", "parser", "ns/id", "MB/s");
+  print("instance ID, stoi", legacy);
+  print("instance ID", instance);
+  print("modalias", alias);
+  print("uevent PRODUCT", uevent);
+  print("any, modalias", any);
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * Fuzz target for the device ID parsers.
+ *
+ * Built as is, it runs its own loop: IDs of every format are generated
+ * with random values and casing, checked to parse back to what went in,
+ * then mutated byte by byte and fed to the parsers, which must neither
+ * crash nor return values out of range. Built with
+ * -DUSB_DRIVER_LIBFUZZER, it is a plain libFuzzer target:
+ *
+ *   clang++ -std=c++11 -g -fsanitize=fuzzer,address -DUSB_DRIVER_LIBFUZZER \
+ *     src/device_id.cc test/native/device_id_fuzz.cc -o device_id_fuzz
+ *
+ * Usage: device_id_fuzz [iterations] [seed]
+ */
+#include "../../src/device_id.h"
+#include "../../src/utils/formatters.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace USBDriver;
+
+static void check(bool ok, const DeviceID &id, const char *data, size_t size)
+{
+  if(!ok)
+    return;
+
+  if(id.vendorID < 0 || id.vendorID > 0xffff || id.productID < 0 || id.productID > 0xffff ||
+     id.deviceVersion < -1 || id.deviceVersion > 0xffff || id.serialNumber.size() > size) {
+    fprintf(stderr, "FAIL: out of range values parsed from '%.*s'\n", static_cast<int>(size), data);
+    abort();
+  }
+}
+
+static void parseAll(const char *data, size_t size)
+{
+  DeviceID id;
+
+  check(parseInstanceID(data, size, id), id, data, size);
+  check(parseModalias(data, size, id), id, data, size);
+  check(parseUeventProduct(data, size, id), id, data, size);
+  check(parseDeviceID(data, size, id), id, data, size);
+}
+
+#ifdef USB_DRIVER_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  parseAll(reinterpret_cast<const char *>(data), size);
+
+  return 0;
+}
+
+#else
+
+typedef struct Generated {
+  std::string str;
+  DeviceID expected;
+} Generated;
+
+static const char SERIAL_CHARS[] = "0123456789abcdefABCDEF";
+
+static Generated generate(std::mt19937 &rng)
+{
+  Generated gen;
+  Utils::FormatBuffer<128> buf;
+
+  gen.expected.vendorID = rng() & 0xffff;
+  gen.expected.productID = rng() & 0xffff;
+
+  switch(rng() % 3) {
+  case 0:
+    buf << "USB\\VID_" << Utils::hex<4>(gen.expected.vendorID)
+        << "&PID_" << Utils::hex<4>(gen.expected.productID);
+
+    if(rng() % 2) {
+      std::string serial;
+
+      for(size_t i = rng() % 24 + 1; i > 0; --i)
+        serial.push_back(SERIAL_CHARS[rng() % (sizeof(SERIAL_CHARS) - 1)]);
+
+      buf << '\\' << serial;
+
+      for(char c : serial)
+        gen.expected.serialNumber.push_back((c >= 'a' && c <= 'f') ? c - 'a' + 'A' : c);
+    }
+    break;
+  case 1:
+    gen.expected.deviceVersion = rng() & 0xffff;
+
+    buf << "usb:v" << Utils::hex<4>(gen.expected.vendorID) << 'p' << Utils::hex<4>(gen.expected.productID)
+        << 'd' << Utils::hex<4>(gen.expected.deviceVersion) << "dc00dsc00dp00ic08isc06ip50in00";
+    break;
+  case 2:
+    gen.expected.deviceVersion = rng() & 0xffff;
+
+    buf << "PRODUCT=" << Utils::hex(gen.expected.vendorID) << '/' << Utils::hex(gen.expected.productID)
+        << '/' << Utils::hex(gen.expected.deviceVersion);
+    break;
+  }
+
+  gen.str = buf.str();
+
+  // Hex digits in any case
+  for(char &c : gen.str) {
+    if(c >= 'a' && c <= 'f' && rng() % 2)
+      c = c - 'a' + 'A';
+  }
+
+  return gen;
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  unsigned seed = argc > 2 ? static_cast<unsigned>(atol(argv[2])) : 42;
+
+  std::mt19937 rng(seed);
+  DeviceID id;
+
+  for(long i = 0; i < iterations; ++i) {
+    Generated gen = generate(rng);
+
+    if(!parseDeviceID(gen.str.data(), gen.str.size(), id) || id.vendorID != gen.expected.vendorID ||
+       id.productID != gen.expected.productID || id.deviceVersion != gen.expected.deviceVersion ||
+       id.serialNumber != gen.expected.serialNumber) {
+      fprintf(stderr, "FAIL: '%s' didn't parse back\n", gen.str.c_str());
+      return 1;
+    }
+
+    // Flip, drop or truncate a few bytes
+    std::vector<char> mutated(gen.str.begin(), gen.str.end());
+
+    for(int n = rng() % 4 + 1; n > 0 && !mutated.empty(); --n) {
+      size_t at = rng() % mutated.size();
+
+      switch(rng() % 3) {
+      case 0:
+        mutated[at] = static_cast<char>(rng());
+        break;
+      case 1:
+        mutated.erase(mutated.begin() + at);
+        break;
+      case 2:
+        mutated.resize(at);
+        break;
+      }
+    }
+
+    // Without a terminator, so reading past the end shows up under ASan
+    char *data = static_cast<char *>(malloc(mutated.size() ? mutated.size() : 1));
+
+    std::copy(mutated.begin(), mutated.end(), data);
+    parseAll(data, mutated.size());
+    free(data);
+  }
+
+  printf("iterations:  %ld\n", iterations);
+  printf("PASS\n");
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * Compare the time and heap allocations per formatted record of the
+ * formatting layer against the std::string concatenation and snprintf
+ * it replaced, for device UIDs, hex values and log records. Fails if a
+ * FormatBuffer or logger path allocates.
+ *
+ * Usage: format_bench [iterations]
+ */
+#include "../../src/usb_driver.h"
+#include "../../src/utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace USBDriver;
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation accounting
+////////////////////////////////////////////////////////////////////////////////
+static std::atomic<unsigned long long> gAllocations(0);
+
+void *operator new(size_t size)
+{
+  void *ptr = malloc(size ? size : 1);
+
+  if(ptr == NULL)
+    throw std::bad_alloc();
+
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cases
+////////////////////////////////////////////////////////////////////////////////
+typedef struct BenchResult {
+  unsigned long long totalAllocations;
+  double allocations;
+  double nanoseconds;
+} BenchResult;
+
+// Keeps the formatted output alive so it isn't optimized away
+static volatile size_t gSink;
+
+static BenchResult measure(long iterations, const std::function<void(long)> &body)
+{
+  unsigned long long allocations = gAllocations.load();
+  auto start = std::chrono::steady_clock::now();
+
+  for(long i = 0; i < iterations; ++i)
+    body(i);
+
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  BenchResult result;
+
+  result.totalAllocations = gAllocations.load() - allocations;
+  result.allocations = static_cast<double>(result.totalAllocations) / iterations;
+  result.nanoseconds = elapsed.count() / iterations;
+
+  return result;
+}
+
+static void print(const char *name, const BenchResult &result)
+{
+  printf("%-22s %14.2f %14.2f\n", name, result.allocations, result.nanoseconds);
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  USBDevicePtr device(new USBDevice);
+
+  device->vendorID = 0x0781;
+  device->productID = 0x5567;
+  device->serialNumber = "4C530001230715117292";
+
+  // SPDRP_FRIENDLYNAME, the Windows driver's registry property failure
+  const unsigned long property = 12;
+
+  // The uid building of uniqueDeviceID() before the formatting layer
+  BenchResult uidConcat = measure(iterations, [&](long i) {
+      std::string uid;
+      char buf[100];
+
+      uid.append(std::to_string(device->vendorID));
+      uid.append("-");
+      uid.append(std::to_string(device->productID));
+      uid.append("-");
+      uid.append(device->serialNumber.c_str(), device->serialNumber.size());
+
+      snprintf(buf, sizeof(buf), "%lu", static_cast<unsigned long>(i));
+
+      uid.append("-");
+      uid.append(buf);
+
+      gSink = uid.size();
+    });
+
+  BenchResult uidFormat = measure(iterations, [&](long i) {
+      Utils::FormatBuffer<512> uid;
+
+      uid << device->vendorID << '-' << device->productID << '-' << device->serialNumber << '-' << i;
+
+      gSink = uid.size();
+    });
+
+  BenchResult hexSnprintf = measure(iterations, [&](long i) {
+      char buf[32];
+
+      gSink = snprintf(buf, sizeof(buf), "0x%lx", static_cast<unsigned long>(i));
+    });
+
+  BenchResult hexFormat = measure(iterations, [&](long i) {
+      Utils::FormatBuffer<32> buf;
+
+      buf << "0x" << Utils::hex(i);
+
+      gSink = buf.size();
+    });
+
+  Logger::instance().setLogFile("/dev/null");
+  Logger::instance().setRepeatWindow(0);
+
+  BenchResult logRecord = measure(iterations, [&](long) {
+      static char site;
+      Utils::FormatBuffer<64> msg;
+
+      msg << "Failed to get device registry property: " << property;
+
+      gSink = Logger::instance().log(&site, "ERROR", msg, __FUNCTION__, __FILE__, __LINE__);
+    });
+
+  Logger::instance().setRepeatWindow(60000);
+
+  BenchResult logRepeat = measure(iterations, [&](long) {
+      static char site;
+      Utils::FormatBuffer<64> msg;
+
+      msg << "Failed to get device registry property: " << property;
+
+      gSink = Logger::instance().log(&site, "ERROR", msg, __FUNCTION__, __FILE__, __LINE__);
+    });
+
+  printf("iterations:  %ld\n", iterations);
+  printf("%-22s %14s %14s\n", "case", "allocs/record", "ns/record");
+  print("uid, std::string", uidConcat);
+  print("uid, FormatBuffer", uidFormat);
+  print("hex, snprintf", hexSnprintf);
+  print("hex, FormatBuffer", hexFormat);
+  print("log record", logRecord);
+  print("log record, repeated", logRepeat);
+
+  // Tracking the first of the repeated records copies the message into a map node
+  if(uidFormat.totalAllocations != 0 || hexFormat.totalAllocations != 0 || logRecord.totalAllocations != 0 ||
+     logRepeat.totalAllocations > 2) {
+    fprintf(stderr, "FAIL: formatting allocated\n");
+    return 1;
+  }
+
+  printf("PASS\n");
+
+  return 0;
+}
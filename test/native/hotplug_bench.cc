@@ -0,0 +1,355 @@
+/**
+ * End-to-end hotplug latency benchmark.
+ *
+ * Injects timestamped synthetic uevents through a socketpair into the
+ * hotplug watcher and measures the time until the change reaches a
+ * uv_async callback on the event loop thread, the hop the bindings use
+ * to call into JS. Everything between the two ends is the production
+ * pipeline: watcher thread, poll scheduler, getDevices() and the device
+ * registry. Only the enumeration is simulated: each poll reports one
+ * device carrying the sequence number of the latest event seen.
+ *
+ * Several events reaching the loop in one callback are all delivered by
+ * it, so bursts show up as higher latencies and fewer callbacks.
+ *
+ * Usage: hotplug_bench [events per second] [events]
+ * Without arguments, runs from single events up to 10k events/s bursts.
+ * Prints the results as JSON.
+ */
+#include "../../src/linux/watcher.h"
+#include "../../src/poll_scheduler.h"
+#include "../../src/usb_common.h"
+#include "../../src/usb_registry.h"
+#include "../../src/utils/logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <uv.h>
+
+using namespace USBDriver;
+using std::chrono::steady_clock;
+
+typedef struct Scenario {
+  double rate;   // Events per second.
+  long events;
+} Scenario;
+
+static const Scenario DEFAULT_SCENARIOS[] = {
+  { 10, 20 },
+  { 100, 200 },
+  { 1000, 2000 },
+  { 10000, 20000 }
+};
+
+// Give up on a scenario once nothing was delivered for this long
+static const uint64_t STALL_TIMEOUT_MS = 5000;
+
+static const int BENCH_LOCATION_ID = 0x01000000;
+static const std::string BENCH_SERIAL = "BENCH";
+
+////////////////////////////////////////////////////////////////////////////////
+// Simulated platform
+////////////////////////////////////////////////////////////////////////////////
+static std::atomic<long> gApplied(-1);   // Latest sequence number the watcher saw.
+static int gInjectFd = -1;
+
+namespace USBDriver
+{
+  std::vector<USBDevicePtr> enumerateDevices()
+  {
+    std::vector<USBDevicePtr> devices;
+    long seq = gApplied.load();
+
+    ++stats().scans;
+
+    DeviceRegistry &registry = DeviceRegistry::instance();
+
+    registry.beginUpdate();
+
+    if(seq >= 0) {
+      USBDevicePtr device(new USBDevice);
+
+      device->locationID   = BENCH_LOCATION_ID;
+      device->vendorID     = 0x1d6b;
+      device->productID    = 0x0104;
+      device->serialNumber = BENCH_SERIAL;
+      device->mountPoint   = std::to_string(seq);
+
+      ++stats().deviceReads;
+
+      device = mergeDevice(registry.findAttached(device->locationID, device->vendorID,
+                                                 device->productID, BENCH_SERIAL), device);
+      registry.insert(device);
+      devices.push_back(device);
+    }
+
+    registry.endUpdate();
+
+    return devices;
+  }
+
+  // Only polls are measured
+  USBDevicePtr readDevice(const USBDevicePtr &device)
+  {
+    return device;
+  }
+
+  // Every poll registers the device again
+  void invalidateDevices()
+  {
+  }
+
+  const char *watchDevices(const std::function<void()> &onEvent)
+  {
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) != 0) {
+      fprintf(stderr, "socketpair() failed: %s\n", strerror(errno));
+      return "poll";
+    }
+
+    gInjectFd = fds[0];
+
+    return HotplugWatcher::instance().start([onEvent](const std::string &device) {
+        ++stats().watcherEvents;
+
+        // "1-<seq>"
+        long seq = atol(device.c_str() + 2);
+        long applied = gApplied.load();
+
+        while(seq > applied && !gApplied.compare_exchange_weak(applied, seq))
+          ;
+
+        onEvent();
+      }, fds[1]);
+  }
+
+  void unwatchDevices()
+  {
+    HotplugWatcher::instance().stop();
+
+    if(gInjectFd >= 0)
+      close(gInjectFd);
+
+    gInjectFd = -1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Event loop side
+////////////////////////////////////////////////////////////////////////////////
+static std::vector<steady_clock::time_point> gSent;
+static std::vector<double> gLatencies;   // Microseconds.
+static long gFirstSeq = 0;
+static long gDelivered = -1;             // Latest sequence number delivered.
+static unsigned long gCallbacks = 0;
+static steady_clock::time_point gLastDelivery;
+static uv_async_t gAsync;
+static uv_timer_t gStallTimer;
+
+static void _finish()
+{
+  // Nothing signals the handle once the scheduler is stopped
+  PollScheduler::instance().stop();
+
+  uv_close(reinterpret_cast<uv_handle_t *>(&gAsync), NULL);
+  uv_close(reinterpret_cast<uv_handle_t *>(&gStallTimer), NULL);
+}
+
+static void _onDevicesChanged(uv_async_t *)
+{
+  auto devices = PollScheduler::instance().devices();
+  auto now = steady_clock::now();
+
+  ++gCallbacks;
+
+  if(devices.empty())
+    return;
+
+  long seq = atol(devices[0]->mountPoint.c_str());
+  long last = gFirstSeq + static_cast<long>(gSent.size()) - 1;
+
+  for(long n = std::max(gDelivered + 1, gFirstSeq); n <= std::min(seq, last); ++n) {
+    auto latency = now - gSent[n - gFirstSeq];
+    gLatencies.push_back(std::chrono::duration<double, std::micro>(latency).count());
+  }
+
+  gDelivered = std::max(gDelivered, seq);
+  gLastDelivery = now;
+
+  if(gDelivered >= last)
+    _finish();
+}
+
+static void _onStallTimer(uv_timer_t *)
+{
+  if(steady_clock::now() - gLastDelivery > std::chrono::milliseconds(STALL_TIMEOUT_MS))
+    _finish();
+}
+
+static void _inject(const Scenario &scenario)
+{
+  auto start = steady_clock::now();
+
+  for(long i = 0; i < scenario.events; ++i) {
+    long seq = gFirstSeq + i;
+    auto due = start + std::chrono::duration_cast<steady_clock::duration>(
+      std::chrono::duration<double>(i / scenario.rate));
+
+    std::this_thread::sleep_until(due);
+
+    std::string devPath = "/devices/bench/1-" + std::to_string(seq);
+    std::string msg = "add@" + devPath;
+
+    msg += '\0';
+    msg += "ACTION=add";
+    msg += '\0';
+    msg += "DEVPATH=" + devPath;
+    msg += '\0';
+    msg += "SUBSYSTEM=usb";
+    msg += '\0';
+    msg += "DEVTYPE=usb_device";
+    msg += '\0';
+    msg += "SEQNUM=" + std::to_string(seq);
+    msg += '\0';
+
+    gSent[i] = steady_clock::now();
+
+    // Blocks while the watcher is behind, like the kernel's socket buffer filling up
+    if(send(gInjectFd, msg.data(), msg.size(), 0) < 0) {
+      fprintf(stderr, "Failed to inject event %ld: %s\n", seq, strerror(errno));
+      return;
+    }
+  }
+}
+
+static double _percentile(const std::vector<double> &sorted, double p)
+{
+  if(sorted.empty())
+    return 0;
+
+  size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static bool _run(const Scenario &scenario, bool last)
+{
+  unsigned long polls = stats().polls;
+  unsigned long scans = stats().scans;
+
+  gSent.assign(scenario.events, steady_clock::time_point());
+  gLatencies.clear();
+  gLatencies.reserve(scenario.events);
+  gDelivered = gFirstSeq - 1;
+  gCallbacks = 0;
+  gLastDelivery = steady_clock::now();
+
+  uv_loop_t *loop = uv_default_loop();
+
+  uv_async_init(loop, &gAsync, _onDevicesChanged);
+  uv_timer_init(loop, &gStallTimer);
+  uv_timer_start(&gStallTimer, _onStallTimer, 100, 100);
+
+  PollScheduler &scheduler = PollScheduler::instance();
+
+  scheduler.start([]() { uv_async_send(&gAsync); });
+
+  if(gInjectFd < 0) {
+    fprintf(stderr, "The hotplug watcher did not start\n");
+    _finish();
+    uv_run(loop, UV_RUN_DEFAULT);
+    return false;
+  }
+
+  auto start = steady_clock::now();
+  std::thread injector(_inject, scenario);
+
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  injector.join();
+
+  double elapsed = std::chrono::duration<double, std::milli>(gLastDelivery - start).count();
+  std::vector<double> sorted(gLatencies);
+  double sum = 0;
+
+  std::sort(sorted.begin(), sorted.end());
+
+  for(double latency : sorted)
+    sum += latency;
+
+  printf("    {\n");
+  printf("      \"rate\": %.0f,\n", scenario.rate);
+  printf("      \"events\": %ld,\n", scenario.events);
+  printf("      \"delivered\": %zu,\n", sorted.size());
+  printf("      \"callbacks\": %lu,\n", gCallbacks);
+  printf("      \"polls\": %lu,\n", stats().polls - polls);
+  printf("      \"scans\": %lu,\n", stats().scans - scans);
+  printf("      \"durationMs\": %.3f,\n", elapsed);
+  printf("      \"eventsPerSecond\": %.1f,\n", elapsed > 0 ? sorted.size() * 1000.0 / elapsed : 0.0);
+  printf("      \"latencyUs\": {\n");
+  printf("        \"min\": %.1f,\n", sorted.empty() ? 0.0 : sorted.front());
+  printf("        \"mean\": %.1f,\n", sorted.empty() ? 0.0 : sum / sorted.size());
+  printf("        \"p50\": %.1f,\n", _percentile(sorted, 0.50));
+  printf("        \"p90\": %.1f,\n", _percentile(sorted, 0.90));
+  printf("        \"p99\": %.1f,\n", _percentile(sorted, 0.99));
+  printf("        \"max\": %.1f\n", sorted.empty() ? 0.0 : sorted.back());
+  printf("      }\n");
+  printf("    }%s\n", last ? "" : ",");
+
+  gFirstSeq += scenario.events;
+
+  return static_cast<long>(sorted.size()) == scenario.events;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<Scenario> scenarios;
+
+  if(argc > 1) {
+    Scenario scenario;
+    scenario.rate = atof(argv[1]);
+    scenario.events = argc > 2 ? atol(argv[2]) : static_cast<long>(scenario.rate * 2);
+
+    if(scenario.rate <= 0 || scenario.events <= 0) {
+      fprintf(stderr, "Usage: %s [events per second] [events]\n", argv[0]);
+      return 1;
+    }
+
+    scenarios.push_back(scenario);
+  } else {
+    scenarios.assign(DEFAULT_SCENARIOS, DEFAULT_SCENARIOS + sizeof(DEFAULT_SCENARIOS) / sizeof(Scenario));
+  }
+
+  // Keep stdout for the results
+  Logger::instance().setLogFile("/dev/null");
+
+  bool complete = true;
+
+  printf("{\n");
+  printf("  \"scenarios\": [\n");
+
+  for(size_t i = 0; i < scenarios.size(); ++i)
+    complete = _run(scenarios[i], i + 1 == scenarios.size()) && complete;
+
+  printf("  ]\n");
+  printf("}\n");
+
+  if(!complete)
+    fprintf(stderr, "Some events were not delivered within %llums\n",
+            static_cast<unsigned long long>(STALL_TIMEOUT_MS));
+
+  return complete ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+/**
+ * Soak test for the device registry.
+ *
+ * Drives simulated attach, detach and re-plug cycles through the same
+ * registry calls the platform implementations make on every poll, and
+ * fails if the registry or the heap keeps growing.
+ *
+ * Usage: registry_soak [cycles]
+ */
+#include "../../src/usb_common.h"
+#include "../../src/usb_registry.h"
+
+#include <atomic>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/resource.h>
+
+using namespace USBDriver;
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation accounting
+////////////////////////////////////////////////////////////////////////////////
+static std::atomic<unsigned long long> gAllocations(0);
+static std::atomic<long long> gLiveAllocations(0);
+
+void *operator new(size_t size)
+{
+  void *ptr = malloc(size ? size : 1);
+
+  if(ptr == NULL)
+    throw std::bad_alloc();
+
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+  gLiveAllocations.fetch_add(1, std::memory_order_relaxed);
+
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  if(ptr == NULL)
+    return;
+
+  gLiveAllocations.fetch_sub(1, std::memory_order_relaxed);
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+static long peakRSSKilobytes()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;  // Bytes on OSX
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Simulation
+////////////////////////////////////////////////////////////////////////////////
+static const int PORT_COUNT = 32;
+static const int FLEET_SIZE = 256;
+static const long WARMUP_CYCLES = 10000;
+// Heap growth tolerated after warm up, for hash table buckets that never
+// shrink. Anything above this is a leak.
+static const long long MAX_LIVE_GROWTH = 4;
+static const long MAX_RSS_GROWTH_KB = 4096;
+
+typedef struct SimulatedDevice {
+  int vendorID;
+  int productID;
+  std::string serialNumber;
+} SimulatedDevice;
+
+/**
+ * One poll, mirroring what the platform getDevices() does per device.
+ */
+static void poll(const std::vector<int> &ports, const std::vector<SimulatedDevice> &fleet)
+{
+  DeviceRegistry &registry = DeviceRegistry::instance();
+
+  registry.beginUpdate();
+
+  for(int port = 0; port < PORT_COUNT; ++port) {
+    if(ports[port] < 0)
+      continue;
+
+    const SimulatedDevice &sim = fleet[ports[port]];
+
+    USBDevicePtr device(new USBDevice);
+
+    device->locationID   = port;
+    device->vendorID     = sim.vendorID;
+    device->productID    = sim.productID;
+    device->serialNumber = sim.serialNumber;
+    device->product      = "Simulated Mass Storage";
+    device->vendor       = "Simulated Vendor";
+    // Four hubs of eight ports
+    device->busNumber    = 1;
+    device->portPath     = std::to_string(port / 8 + 1) + "." + std::to_string(port % 8 + 1);
+
+    device = mergeDevice(registry.findAttached(port, sim.vendorID, sim.productID, sim.serialNumber),
+                         device);
+
+    registry.insert(device);
+  }
+
+  registry.endUpdate();
+}
+
+int main(int argc, char **argv)
+{
+  long cycles = argc > 1 ? atol(argv[1]) : 2000000;
+
+  std::mt19937 rng(42);
+  std::vector<SimulatedDevice> fleet;
+
+  for(int i = 0; i < FLEET_SIZE; ++i) {
+    SimulatedDevice sim;
+    sim.vendorID = 0x0781;
+    sim.productID = 0x5567 + (i % 4);
+    // Every fourth stick has no serial number
+    sim.serialNumber = (i % 4 == 0) ? "" : "SERIAL" + std::to_string(i) + "XXXXXXXXXXXX";
+
+    fleet.push_back(sim);
+  }
+
+  // Which fleet device sits in each port, -1 if empty
+  std::vector<int> ports(PORT_COUNT, -1);
+
+  long long baselineLive = 0;
+  long baselineRSS = 0;
+
+  for(long cycle = 0; cycle < cycles + WARMUP_CYCLES; ++cycle) {
+    int port = rng() % PORT_COUNT;
+
+    switch(rng() % 3) {
+    case 0: // Attach or re-plug into another port
+      ports[port] = rng() % FLEET_SIZE;
+      break;
+    case 1: // Detach
+      ports[port] = -1;
+      break;
+    case 2: // Nothing changed
+      break;
+    }
+
+    if(cycle == WARMUP_CYCLES) {
+      // Measure with nothing attached so occupancy doesn't skew the result
+      poll(std::vector<int>(PORT_COUNT, -1), fleet);
+
+      baselineLive = gLiveAllocations.load();
+      baselineRSS = peakRSSKilobytes();
+    }
+
+    poll(ports, fleet);
+  }
+
+  size_t registrySize = DeviceRegistry::instance().size();
+
+  poll(std::vector<int>(PORT_COUNT, -1), fleet);
+
+  long long liveGrowth = gLiveAllocations.load() - baselineLive;
+  long rssGrowth = peakRSSKilobytes() - baselineRSS;
+
+  printf("cycles:              %ld\n", cycles);
+  printf("allocations:         %llu (%.2f per cycle)\n", gAllocations.load(),
+         static_cast<double>(gAllocations.load()) / (cycles + WARMUP_CYCLES));
+  printf("live allocations:    %lld (%+lld since warm up)\n", gLiveAllocations.load(), liveGrowth);
+  printf("peak RSS:            %ld KB (%+ld KB since warm up)\n", peakRSSKilobytes(), rssGrowth);
+  printf("registry size:       %zu\n", registrySize);
+  printf("interned strings:    %zu\n", Utils::InternedString::tableSize());
+
+  bool ok = true;
+
+  if(registrySize > static_cast<size_t>(PORT_COUNT)) {
+    fprintf(stderr, "FAIL: registry holds %zu devices for %d ports\n", registrySize, PORT_COUNT);
+    ok = false;
+  }
+
+  if(liveGrowth > MAX_LIVE_GROWTH) {
+    fprintf(stderr, "FAIL: %lld allocations leaked since warm up\n", liveGrowth);
+    ok = false;
+  }
+
+  if(rssGrowth > MAX_RSS_GROWTH_KB) {
+    fprintf(stderr, "FAIL: peak RSS grew by %ld KB since warm up\n", rssGrowth);
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
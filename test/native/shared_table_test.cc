@@ -0,0 +1,201 @@
+/**
+ * Take over a shared table whose owner died in the middle of a write,
+ * and check that readers attaching afterwards see complete tables and
+ * that a second owner is turned away.
+ *
+ * Usage: shared_table_test
+ */
+#include "../../src/shared_table.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+using namespace USBDriver;
+
+// Mirrors the start of SharedHeader in shared_table.cc
+typedef struct HeaderPrefix {
+  uint32_t magic;
+  uint32_t version;
+  std::atomic<uint32_t> sequence;
+  uint32_t capacity;
+  uint32_t count;
+} HeaderPrefix;
+
+static std::string gName;
+
+static void cleanUp()
+{
+  shm_unlink(gName.c_str());
+  unlink(("/tmp" + gName + ".lock").c_str());
+}
+
+namespace USBDriver
+{
+  // Nothing is enumerated locally
+  void invalidateDevices()
+  {
+  }
+}
+
+#define CHECK(expr)                                               \
+  do {                                                            \
+    if(!(expr)) {                                                 \
+      fprintf(stderr, "FAIL: %s, line %d\n", #expr, __LINE__);    \
+      cleanUp();                                                  \
+      exit(1);                                                    \
+    }                                                             \
+  } while(0)
+
+static std::vector<USBDevicePtr> fleet(int count)
+{
+  std::vector<USBDevicePtr> devices;
+
+  for(int i = 0; i < count; ++i) {
+    USBDevicePtr device(new USBDevice);
+
+    device->uid = "1-2-SERIAL" + std::to_string(i);
+    device->locationID = i;
+    device->vendorID = 0x0781;
+    device->productID = 0x5567;
+
+    devices.push_back(device);
+  }
+
+  return devices;
+}
+
+static HeaderPrefix *mapHeader(int &fd)
+{
+  fd = shm_open(gName.c_str(), O_RDWR, 0);
+
+  if(fd < 0)
+    return nullptr;
+
+  void *map = mmap(nullptr, sizeof(HeaderPrefix), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  return map == MAP_FAILED ? nullptr : static_cast<HeaderPrefix *>(map);
+}
+
+static pid_t startChild(void (*child)())
+{
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    child();
+    _exit(0);
+  }
+
+  return pid;
+}
+
+static int waitChild(pid_t pid)
+{
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Publishes, then dies with a write half done
+static void crashingOwner()
+{
+  int fd;
+
+  CHECK(SharedTable::instance().own(gName));
+  SharedTable::instance().publish(fleet(2));
+
+  HeaderPrefix *header = mapHeader(fd);
+
+  CHECK(header != nullptr);
+  header->sequence.fetch_add(1);
+  header->count = 1;
+
+  // No detach(), like a crash
+  _exit(0);
+}
+
+// Written to once the reader may attach, and once the parent owns the table
+static int gReaderPipe[2];
+static int gOwnerPipe[2];
+
+static void waitGo(int *pipe)
+{
+  char go;
+
+  close(pipe[1]);
+
+  if(read(pipe[0], &go, 1) != 1)
+    _exit(2);
+}
+
+// Forked before the parent takes the table over too, the lock must turn it away
+static void secondOwner()
+{
+  waitGo(gOwnerPipe);
+
+  CHECK(!SharedTable::instance().own(gName));
+}
+
+// Forked before the parent takes the table over, to start without a role
+static void reader()
+{
+  waitGo(gReaderPipe);
+
+  CHECK(SharedTable::instance().attach(gName));
+
+  std::vector<USBDevicePtr> devices = SharedTable::instance().devices();
+
+  CHECK(devices.size() == 3);
+  CHECK(devices[2]->uid == "1-2-SERIAL2");
+
+  _exit(0);
+}
+
+int main()
+{
+  gName = "/usb-driver-test-" + std::to_string(getpid());
+
+  CHECK(pipe(gReaderPipe) == 0);
+  CHECK(pipe(gOwnerPipe) == 0);
+  CHECK(waitChild(startChild(crashingOwner)) == 0);
+
+  pid_t readerPID = startChild(reader);
+  pid_t secondOwnerPID = startChild(secondOwner);
+
+  int fd;
+  HeaderPrefix *header = mapHeader(fd);
+
+  CHECK(header != nullptr);
+  CHECK(header->sequence.load() & 1);
+
+  // The dead owner's half written table is dropped on take over
+  CHECK(SharedTable::instance().own(gName));
+  CHECK((header->sequence.load() & 1) == 0);
+  CHECK(header->count == 0);
+
+  SharedTable::instance().publish(fleet(3));
+
+  CHECK((header->sequence.load() & 1) == 0);
+  CHECK(header->count == 3);
+  CHECK(write(gReaderPipe[1], "g", 1) == 1);
+  CHECK(waitChild(readerPID) == 0);
+  CHECK(write(gOwnerPipe[1], "g", 1) == 1);
+  CHECK(waitChild(secondOwnerPID) == 0);
+
+  SharedTable::instance().detach();
+
+  CHECK((header->sequence.load() & 1) == 0);
+
+  cleanUp();
+  printf("PASS\n");
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * Compare the cost of reading USB device data from sysfs one text
+ * attribute at a time against parsing the binary `descriptors` file,
+ * plain reads against batched io_uring reads of the whole bus, and both
+ * against re-reading attribute files kept open across polls, opened
+ * plainly or through io_uring.
+ *
+ * Usage: sysfs_bench [devices path] [iterations]
+ */
+#include "../../src/linux/fd_cache.h"
+#include "../../src/linux/sysfs.h"
+#include "../../src/linux/uring.h"
+#include "../../src/usb_driver.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace USBDriver;
+
+typedef struct BenchResult {
+  double syscalls;
+  double microseconds;
+} BenchResult;
+
+// What a backend reading only text attributes has to open
+static const char *NAIVE_ATTRIBUTES[] = {
+  "idVendor", "idProduct", "bcdDevice", "version", "bDeviceClass",
+  "bDeviceProtocol", "bNumConfigurations", "serial", "product", "manufacturer"
+};
+
+static void naive(const std::string &path)
+{
+  std::string value;
+
+  for(const char *attribute : NAIVE_ATTRIBUTES)
+    Sysfs::readAttribute(path, attribute, value);
+}
+
+static void descriptors(const std::string &path)
+{
+  Sysfs::DeviceDescriptor desc;
+  std::string value;
+
+  if(!Sysfs::readDescriptors(path, desc))
+    return;
+
+  if(desc.serialNumberIndex)
+    Sysfs::readAttribute(path, "serial", value);
+  if(desc.productIndex)
+    Sysfs::readAttribute(path, "product", value);
+  if(desc.manufacturerIndex)
+    Sysfs::readAttribute(path, "manufacturer", value);
+}
+
+static std::string gRoot;
+
+// Whole bus at once, as the Linux backend enumerates
+static void batched(const std::vector<std::string> &paths)
+{
+  std::vector<Sysfs::Device> devices(paths.size());
+
+  for(size_t i = 0; i < paths.size(); ++i)
+    devices[i].name = paths[i].substr(gRoot.size() + 1);
+
+  Sysfs::readDevices(gRoot, devices);
+}
+
+static BenchResult run(void (*strategy)(const std::string &),
+                       void (*batchStrategy)(const std::vector<std::string> &),
+                       const std::vector<std::string> &devices, long iterations)
+{
+  using namespace std::chrono;
+
+  unsigned long syscalls = Sysfs::syscallCount();
+  auto start = steady_clock::now();
+
+  for(long i = 0; i < iterations; ++i) {
+    if(batchStrategy != NULL) {
+      batchStrategy(devices);
+      continue;
+    }
+
+    for(auto &device : devices)
+      strategy(device);
+  }
+
+  double elapsed = duration_cast<duration<double, std::micro> >(steady_clock::now() - start).count();
+  double reads = static_cast<double>(iterations) * devices.size();
+
+  BenchResult result;
+  result.syscalls = (Sysfs::syscallCount() - syscalls) / reads;
+  result.microseconds = elapsed / reads;
+
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  std::string &root = gRoot;
+  root = argc > 1 ? argv[1] : "/sys/bus/usb/devices";
+  long iterations = argc > 2 ? atol(argv[2]) : 1000;
+
+  std::vector<std::string> devices;
+  DIR *dir = opendir(root.c_str());
+
+  if(dir == NULL) {
+    fprintf(stderr, "Failed to open %s\n", root.c_str());
+    return 1;
+  }
+
+  struct dirent *entry;
+
+  while((entry = readdir(dir)) != NULL) {
+    // Same filter as the Linux backend: no interfaces or root hubs
+    if(entry->d_name[0] >= '0' && entry->d_name[0] <= '9' && strchr(entry->d_name, ':') == NULL)
+      devices.push_back(root + "/" + entry->d_name);
+  }
+
+  closedir(dir);
+
+  if(devices.empty()) {
+    fprintf(stderr, "No USB devices found in %s\n", root.c_str());
+    return 1;
+  }
+
+  options().attributeFdBudget = 0;
+
+  BenchResult textResult = run(naive, NULL, devices, iterations);
+  BenchResult descResult = run(descriptors, NULL, devices, iterations);
+  BenchResult batchResult = run(NULL, batched, devices, iterations);
+
+  options().ioUring = true;
+
+  bool haveIOUring = IOUring::instance() != nullptr;
+  BenchResult uringResult = run(NULL, batched, devices, iterations);
+
+  options().ioUring = false;
+  options().attributeFdBudget = 256;
+
+  BenchResult cacheResult = run(NULL, batched, devices, iterations);
+
+  AttributeFdCache::instance().clear();
+  options().ioUring = true;
+
+  BenchResult cachedUringResult = run(NULL, batched, devices, iterations);
+
+  options().ioUring = false;
+
+  printf("devices:     %zu\n", devices.size());
+  printf("iterations:  %ld\n", iterations);
+  printf("io_uring:    %s\n", haveIOUring ? "available" : "unavailable, measured the fallback");
+  printf("%-12s %14s %14s\n", "strategy", "syscalls/dev", "us/dev");
+  printf("%-12s %14.2f %14.2f\n", "attributes", textResult.syscalls, textResult.microseconds);
+  printf("%-12s %14.2f %14.2f\n", "descriptors", descResult.syscalls, descResult.microseconds);
+  printf("%-12s %14.2f %14.2f\n", "batched", batchResult.syscalls, batchResult.microseconds);
+  printf("%-12s %14.2f %14.2f\n", "io_uring", uringResult.syscalls, uringResult.microseconds);
+  printf("%-12s %14.2f %14.2f\n", "fd cache", cacheResult.syscalls, cacheResult.microseconds);
+  printf("%-12s %14.2f %14.2f\n", "both", cachedUringResult.syscalls, cachedUringResult.microseconds);
+
+  return 0;
+}